@@ -0,0 +1,191 @@
+#ifndef STEGANOGRAPHER_CHANNELS_HPP
+#define STEGANOGRAPHER_CHANNELS_HPP
+
+#include "cpu.hpp"
+#include "int_types.hpp"
+
+#include <array>
+#include <bit>
+#include <expected>
+#include <format>
+#include <string>
+#include <string_view>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// The channels of each pixel that data is hidden in, bit c set for channel c. 0 means all channels.
+using ChannelMask = u8;
+
+namespace channels {
+
+inline constexpr ChannelMask all = 0;
+
+// The mask limited to the channels that an image with channelCount channels has
+constexpr ChannelMask normalize(ChannelMask mask, int channelCount)
+{
+    const ChannelMask full = static_cast<ChannelMask>((1u << channelCount) - 1);
+    return mask == all ? full : mask & full;
+}
+
+// Check if a mask selects every channel of an image with channelCount channels
+constexpr bool isAll(ChannelMask mask, int channelCount)
+{
+    return normalize(mask, channelCount) == normalize(all, channelCount);
+}
+
+// Parse a mask from channel letters, like "rgb" to skip alpha or "a" for only alpha. For grayscale images r, g and b
+// all mean the gray channel. An empty string means all channels.
+inline std::expected<ChannelMask, std::string> parse(std::string_view spec, int channelCount)
+{
+    const bool color = channelCount >= 3;
+    const bool alpha = channelCount == 2 || channelCount == 4;
+
+    ChannelMask mask = 0;
+    for (char c : spec) {
+        if (c == 'r' || c == 'g' || c == 'b') {
+            mask |= 1 << (color ? c == 'r' ? 0 : c == 'g' ? 1 : 2 : 0);
+        }
+        else if (c == 'a' && alpha) {
+            mask |= 1 << (channelCount - 1);
+        }
+        else {
+            return std::unexpected(std::format("Invalid channel '{}' for image with {} channels", c, channelCount));
+        }
+    }
+    return mask;
+}
+
+namespace detail {
+
+inline void gatherScalar(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+    for (size_t i = 0; i < pixels; ++i, src += channelCount) {
+        for (int c = 0; c < channelCount; ++c) {
+            if ((mask >> c) & 1) {
+                *dst++ = src[c];
+            }
+        }
+    }
+}
+
+inline void scatterScalar(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+    for (size_t i = 0; i < pixels; ++i, dst += channelCount) {
+        for (int c = 0; c < channelCount; ++c) {
+            if ((mask >> c) & 1) {
+                dst[c] = *src++;
+            }
+        }
+    }
+}
+
+#ifdef STEG_X86
+// Shuffle controls for moving the selected channels of the whole pixels in 16 bytes to and from the front of a
+// register. For 3 channels the last of the 16 bytes is not part of the step.
+struct Shuffles {
+    __m128i gather;
+    __m128i scatter;
+    __m128i selected; // 0xFF for the bytes of selected channels
+    size_t pixels;    // Pixels per step
+    size_t bytes;     // Selected bytes per step
+};
+
+STEG_TARGET("ssse3")
+inline Shuffles makeShuffles(int channelCount, ChannelMask mask)
+{
+    alignas(16) std::array<u8, 16> gather;
+    alignas(16) std::array<u8, 16> scatter;
+    alignas(16) std::array<u8, 16> selected{};
+    gather.fill(0x80); // Zeroes the byte
+    scatter.fill(0x80);
+
+    Shuffles result;
+    result.pixels = 16 / channelCount;
+    result.bytes = 0;
+    for (size_t i = 0; i < result.pixels * channelCount; ++i) {
+        if ((mask >> (i % channelCount)) & 1) {
+            gather[result.bytes] = static_cast<u8>(i);
+            scatter[i] = static_cast<u8>(result.bytes);
+            selected[i] = 0xFF;
+            result.bytes++;
+        }
+    }
+
+    result.gather = _mm_load_si128(reinterpret_cast<const __m128i*>(gather.data()));
+    result.scatter = _mm_load_si128(reinterpret_cast<const __m128i*>(scatter.data()));
+    result.selected = _mm_load_si128(reinterpret_cast<const __m128i*>(selected.data()));
+    return result;
+}
+
+// Writes up to 15 bytes past the gathered bytes
+STEG_TARGET("ssse3")
+inline void gatherSsse3(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+    const Shuffles shuffles = makeShuffles(channelCount, mask);
+
+    // Only whole steps where all 16 loaded bytes belong to the pixels
+    for (; pixels * channelCount >= 16; pixels -= shuffles.pixels) {
+        const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_shuffle_epi8(in, shuffles.gather));
+        src += shuffles.pixels * channelCount;
+        dst += shuffles.bytes;
+    }
+
+    gatherScalar(src, pixels, channelCount, mask, dst);
+}
+
+// Reads up to 15 bytes past the gathered bytes
+STEG_TARGET("ssse3")
+inline void scatterSsse3(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+    const Shuffles shuffles = makeShuffles(channelCount, mask);
+
+    for (; pixels * channelCount >= 16; pixels -= shuffles.pixels) {
+        const __m128i in = _mm_shuffle_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src)), shuffles.scatter);
+        const __m128i original = _mm_loadu_si128(reinterpret_cast<const __m128i*>(dst));
+        const __m128i blended = _mm_or_si128(_mm_and_si128(shuffles.selected, in),
+                                             _mm_andnot_si128(shuffles.selected, original));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), blended);
+        src += shuffles.bytes;
+        dst += shuffles.pixels * channelCount;
+    }
+
+    scatterScalar(src, pixels, channelCount, mask, dst);
+}
+#endif
+
+}
+
+// Extra bytes a buffer for gather() and scatter() needs past the selected bytes
+inline constexpr size_t padding = 16;
+
+// Copy the selected channels of `pixels` pixels to contiguous bytes in dst
+inline void gather(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+#ifdef STEG_X86
+    if (cpu::features().ssse3) {
+        detail::gatherSsse3(src, pixels, channelCount, mask, dst);
+        return;
+    }
+#endif
+    detail::gatherScalar(src, pixels, channelCount, mask, dst);
+}
+
+// Copy contiguous bytes back into the selected channels of `pixels` pixels in dst, keeping the other channels
+inline void scatter(const u8* src, size_t pixels, int channelCount, ChannelMask mask, u8* dst)
+{
+#ifdef STEG_X86
+    if (cpu::features().ssse3) {
+        detail::scatterSsse3(src, pixels, channelCount, mask, dst);
+        return;
+    }
+#endif
+    detail::scatterScalar(src, pixels, channelCount, mask, dst);
+}
+
+}
+
+#endif // STEGANOGRAPHER_CHANNELS_HPP
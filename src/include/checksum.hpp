@@ -0,0 +1,206 @@
+#ifndef STEGANOGRAPHER_CHECKSUM_HPP
+#define STEGANOGRAPHER_CHECKSUM_HPP
+
+#include "cpu.hpp"
+#include "int_types.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstring>
+#include <string_view>
+#include <vector>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// CRC-32C (Castagnoli), which SSE4.2 computes 8 bytes per instruction
+namespace checksum {
+
+namespace detail {
+
+// The polynomial with its bits reversed, bit 31 is x^0
+inline constexpr u32 polynomial = 0x82F63B78;
+
+constexpr std::array<u32, 256> makeTable()
+{
+    std::array<u32, 256> table{};
+    for (u32 i = 0; i < 256; ++i) {
+        u32 crc = i;
+        for (int bit = 0; bit < 8; ++bit) {
+            crc = crc & 1 ? (crc >> 1) ^ polynomial : crc >> 1;
+        }
+        table[i] = crc;
+    }
+    return table;
+}
+
+inline constexpr std::array<u32, 256> table = makeTable();
+
+// a * b mod the polynomial
+constexpr u32 multiply(u32 a, u32 b)
+{
+    u32 product = 0;
+    for (u32 m = 1u << 31; m != 0; m >>= 1) {
+        if (a & m) {
+            product ^= b;
+        }
+        b = b & 1 ? (b >> 1) ^ polynomial : b >> 1;
+    }
+    return product;
+}
+
+// x^(2^k) mod the polynomial
+constexpr std::array<u32, 64> makePowers()
+{
+    std::array<u32, 64> powers{};
+    powers[0] = 1u << 30;
+    for (size_t k = 1; k < powers.size(); ++k) {
+        powers[k] = multiply(powers[k - 1], powers[k - 1]);
+    }
+    return powers;
+}
+
+inline constexpr std::array<u32, 64> powers = makePowers();
+
+// x^(8 * size) mod the polynomial, which moves a CRC register past `size` zero bytes
+constexpr u32 shiftFactor(u64 size)
+{
+    u32 factor = 1u << 31;
+    for (size_t k = 3; size != 0; size >>= 1, ++k) {
+        if (size & 1) {
+            factor = multiply(powers[k], factor);
+        }
+    }
+    return factor;
+}
+
+// Multiplication by a fixed factor is linear, so a table per byte of the other factor does it in 4 lookups
+struct ShiftTable {
+    std::array<std::array<u32, 256>, 4> bytes;
+
+    constexpr u32 operator()(u32 crc) const
+    {
+        return bytes[0][crc & 0xFF] ^ bytes[1][(crc >> 8) & 0xFF] ^ bytes[2][(crc >> 16) & 0xFF] ^ bytes[3][crc >> 24];
+    }
+};
+
+constexpr ShiftTable makeShiftTable(u64 size)
+{
+    const u32 factor = shiftFactor(size);
+    ShiftTable table{};
+    for (u32 byte = 0; byte < 4; ++byte) {
+        for (u32 i = 0; i < 256; ++i) {
+            table.bytes[byte][i] = multiply(factor, i << (8 * byte));
+        }
+    }
+    return table;
+}
+
+// The CRC register (not inverted) after `size` more bytes
+inline u32 updateScalar(u32 crc, const u8* data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef STEG_X86
+// Each crc32 instruction waits for the one before, so three blocks are run side by side and joined by shifting the
+// first two past the others
+inline constexpr size_t blockSize = 1 << 12;
+inline constexpr ShiftTable shiftOne = makeShiftTable(blockSize);
+inline constexpr ShiftTable shiftTwo = makeShiftTable(2 * blockSize);
+
+STEG_TARGET("sse4.2")
+inline u32 updateSse42(u32 crc, const u8* data, size_t size)
+{
+    const auto load = [](const u8* p) {
+        u64 word;
+        std::memcpy(&word, p, sizeof(word));
+        return word;
+    };
+
+    for (; size >= 3 * blockSize; data += 3 * blockSize, size -= 3 * blockSize) {
+        u64 a = crc;
+        u64 b = 0;
+        u64 c = 0;
+        for (size_t i = 0; i < blockSize; i += 8) {
+            a = _mm_crc32_u64(a, load(data + i));
+            b = _mm_crc32_u64(b, load(data + blockSize + i));
+            c = _mm_crc32_u64(c, load(data + 2 * blockSize + i));
+        }
+        crc = shiftTwo(static_cast<u32>(a)) ^ shiftOne(static_cast<u32>(b)) ^ static_cast<u32>(c);
+    }
+
+    u64 wide = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        wide = _mm_crc32_u64(wide, load(data));
+    }
+    crc = static_cast<u32>(wide);
+    for (size_t i = 0; i < size; ++i) {
+        crc = _mm_crc32_u8(crc, data[i]);
+    }
+    return crc;
+}
+#endif
+
+inline u32 update(u32 crc, const u8* data, size_t size)
+{
+#ifdef STEG_X86
+    if (cpu::features().sse42) {
+        return updateSse42(crc, data, size);
+    }
+#endif
+    return updateScalar(crc, data, size);
+}
+
+}
+
+// Continue the CRC-32C of some data with `size` more bytes, starting from 0 for no data
+inline u32 crc32c(const u8* data, size_t size, u32 crc = 0)
+{
+    return ~detail::update(~crc, data, size);
+}
+
+// The CRC-32C of two pieces of data one after the other, from the CRC-32C of each
+constexpr u32 combine(u32 first, u32 second, u64 secondSize)
+{
+    return detail::multiply(detail::shiftFactor(secondSize), first) ^ second;
+}
+
+// The CRC-32C of some data, split over up to `threads` threads (0 for one per hardware thread) on the shared thread
+// pool and combined
+inline u32 crc32c(std::string_view data, size_t threads = 1)
+{
+    constexpr size_t minChunk = 1 << 20;
+
+    const u8* bytes = reinterpret_cast<const u8*>(data.data());
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    const size_t chunks = std::clamp<size_t>(data.size() / minChunk, 1, threads);
+    if (chunks == 1) {
+        return crc32c(bytes, data.size());
+    }
+
+    const size_t chunkSize = (data.size() + chunks - 1) / chunks;
+    std::vector<u32> crcs(chunks);
+    ThreadPool::shared().parallelFor(chunks, [&](size_t i) {
+        const size_t offset = i * chunkSize;
+        crcs[i] = crc32c(bytes + offset, std::min(chunkSize, data.size() - offset));
+    });
+
+    u32 crc = crcs[0];
+    for (size_t i = 1; i < chunks; ++i) {
+        crc = combine(crc, crcs[i], std::min(chunkSize, data.size() - i * chunkSize));
+    }
+    return crc;
+}
+
+}
+
+#endif // STEGANOGRAPHER_CHECKSUM_HPP
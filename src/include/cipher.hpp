@@ -0,0 +1,700 @@
+#ifndef STEGANOGRAPHER_CIPHER_HPP
+#define STEGANOGRAPHER_CIPHER_HPP
+
+#include "cpu.hpp"
+#include "int_types.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <expected>
+#include <format>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// ChaCha20-Poly1305 (RFC 8439) encryption of payloads, so that a revealed payload is useless without the passphrase
+// and any change to it is caught
+namespace cipher {
+
+using Key = std::array<u8, 32>;
+using Nonce = std::array<u8, 12>;
+
+inline constexpr size_t blockSize = 64;
+
+namespace detail {
+
+// The 16 words of the initial state, with the block counter in word 12
+inline std::array<u32, 16> initialState(const Key& key, const Nonce& nonce, u32 counter)
+{
+    std::array<u32, 16> state = {0x61707865, 0x3320646E, 0x79622D32, 0x6B206574};
+    for (size_t i = 0; i < 8; ++i) {
+        std::memcpy(&state[4 + i], key.data() + 4 * i, 4);
+    }
+    state[12] = counter;
+    for (size_t i = 0; i < 3; ++i) {
+        std::memcpy(&state[13 + i], nonce.data() + 4 * i, 4);
+    }
+    if constexpr (std::endian::native == std::endian::big) {
+        for (u32& word : state) {
+            word = std::byteswap(word);
+        }
+    }
+    return state;
+}
+
+// The column and diagonal quarter rounds, 10 of each
+template<typename QuarterRound>
+void rounds(QuarterRound&& quarter)
+{
+    for (int i = 0; i < 10; ++i) {
+        quarter(0, 4, 8, 12);
+        quarter(1, 5, 9, 13);
+        quarter(2, 6, 10, 14);
+        quarter(3, 7, 11, 15);
+        quarter(0, 5, 10, 15);
+        quarter(1, 6, 11, 12);
+        quarter(2, 7, 8, 13);
+        quarter(3, 4, 9, 14);
+    }
+}
+
+// XOR the key stream from the counter in state[12] on into data, one block at a time
+inline void xorScalar(std::array<u32, 16> state, u8* data, size_t size)
+{
+    for (size_t offset = 0; offset < size; offset += blockSize, ++state[12]) {
+        std::array<u32, 16> x = state;
+        rounds([&](size_t a, size_t b, size_t c, size_t d) {
+            x[a] += x[b];
+            x[d] = std::rotl(x[d] ^ x[a], 16);
+            x[c] += x[d];
+            x[b] = std::rotl(x[b] ^ x[c], 12);
+            x[a] += x[b];
+            x[d] = std::rotl(x[d] ^ x[a], 8);
+            x[c] += x[d];
+            x[b] = std::rotl(x[b] ^ x[c], 7);
+        });
+
+        std::array<u8, blockSize> stream;
+        for (size_t i = 0; i < 16; ++i) {
+            const u32 word = x[i] + state[i];
+            for (size_t j = 0; j < 4; ++j) {
+                stream[4 * i + j] = static_cast<u8>(word >> (8 * j));
+            }
+        }
+        const size_t count = std::min(blockSize, size - offset);
+        for (size_t i = 0; i < count; ++i) {
+            data[offset + i] ^= stream[i];
+        }
+    }
+}
+
+#ifdef STEG_X86
+// The SIMD kernels run several blocks at a time, each vector holding the same word of every block. The rounds are
+// spelled out per instruction set since lambdas do not get the target of the function around them.
+template<int N>
+STEG_TARGET("sse2")
+inline __m128i rotateSse2(__m128i v)
+{
+    return _mm_or_si128(_mm_slli_epi32(v, N), _mm_srli_epi32(v, 32 - N));
+}
+
+STEG_TARGET("sse2")
+inline void quarterSse2(__m128i& a, __m128i& b, __m128i& c, __m128i& d)
+{
+    a = _mm_add_epi32(a, b);
+    d = rotateSse2<16>(_mm_xor_si128(d, a));
+    c = _mm_add_epi32(c, d);
+    b = rotateSse2<12>(_mm_xor_si128(b, c));
+    a = _mm_add_epi32(a, b);
+    d = rotateSse2<8>(_mm_xor_si128(d, a));
+    c = _mm_add_epi32(c, d);
+    b = rotateSse2<7>(_mm_xor_si128(b, c));
+}
+
+// XOR words i to i + 3 of four blocks into them
+STEG_TARGET("sse2")
+inline void transposeXorSse2(u8* out, const __m128i* x)
+{
+    const __m128i ab0 = _mm_unpacklo_epi32(x[0], x[1]);
+    const __m128i ab1 = _mm_unpackhi_epi32(x[0], x[1]);
+    const __m128i cd0 = _mm_unpacklo_epi32(x[2], x[3]);
+    const __m128i cd1 = _mm_unpackhi_epi32(x[2], x[3]);
+    const __m128i rows[4] = {_mm_unpacklo_epi64(ab0, cd0), _mm_unpackhi_epi64(ab0, cd0),
+                             _mm_unpacklo_epi64(ab1, cd1), _mm_unpackhi_epi64(ab1, cd1)};
+    for (size_t block = 0; block < 4; ++block) {
+        __m128i* p = reinterpret_cast<__m128i*>(out + block * blockSize);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), rows[block]));
+    }
+}
+
+// Four blocks at a time, returning the number of bytes done
+STEG_TARGET("sse2")
+inline size_t xorSse2(std::array<u32, 16>& state, u8* data, size_t size)
+{
+    size_t done = 0;
+    for (; done + 4 * blockSize <= size; done += 4 * blockSize, state[12] += 4) {
+        __m128i input[16];
+        for (size_t i = 0; i < 16; ++i) {
+            input[i] = _mm_set1_epi32(static_cast<int>(state[i]));
+        }
+        input[12] = _mm_add_epi32(input[12], _mm_setr_epi32(0, 1, 2, 3));
+
+        __m128i x[16];
+        std::copy_n(input, 16, x);
+        for (int i = 0; i < 10; ++i) {
+            quarterSse2(x[0], x[4], x[8], x[12]);
+            quarterSse2(x[1], x[5], x[9], x[13]);
+            quarterSse2(x[2], x[6], x[10], x[14]);
+            quarterSse2(x[3], x[7], x[11], x[15]);
+            quarterSse2(x[0], x[5], x[10], x[15]);
+            quarterSse2(x[1], x[6], x[11], x[12]);
+            quarterSse2(x[2], x[7], x[8], x[13]);
+            quarterSse2(x[3], x[4], x[9], x[14]);
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            x[i] = _mm_add_epi32(x[i], input[i]);
+        }
+        for (size_t i = 0; i < 16; i += 4) {
+            transposeXorSse2(data + done + 4 * i, x + i);
+        }
+    }
+    return done;
+}
+
+// Rotations by 16 and 8 bits move whole bytes, which one shuffle does
+STEG_TARGET("avx2")
+inline void quarterAvx2(__m256i& a, __m256i& b, __m256i& c, __m256i& d)
+{
+    const __m256i rotate16 = _mm256_setr_epi8(2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13,
+                                              2, 3, 0, 1, 6, 7, 4, 5, 10, 11, 8, 9, 14, 15, 12, 13);
+    const __m256i rotate8 = _mm256_setr_epi8(3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14,
+                                             3, 0, 1, 2, 7, 4, 5, 6, 11, 8, 9, 10, 15, 12, 13, 14);
+    a = _mm256_add_epi32(a, b);
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate16);
+    c = _mm256_add_epi32(c, d);
+    b = _mm256_xor_si256(b, c);
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 12), _mm256_srli_epi32(b, 20));
+    a = _mm256_add_epi32(a, b);
+    d = _mm256_shuffle_epi8(_mm256_xor_si256(d, a), rotate8);
+    c = _mm256_add_epi32(c, d);
+    b = _mm256_xor_si256(b, c);
+    b = _mm256_or_si256(_mm256_slli_epi32(b, 7), _mm256_srli_epi32(b, 25));
+}
+
+// XOR words i to i + 7 of eight blocks into them
+STEG_TARGET("avx2")
+inline void transposeXorAvx2(u8* out, const __m256i* x)
+{
+    __m256i t[8];
+    for (size_t i = 0; i < 8; i += 4) {
+        t[i] = _mm256_unpacklo_epi32(x[i], x[i + 1]);
+        t[i + 1] = _mm256_unpackhi_epi32(x[i], x[i + 1]);
+        t[i + 2] = _mm256_unpacklo_epi32(x[i + 2], x[i + 3]);
+        t[i + 3] = _mm256_unpackhi_epi32(x[i + 2], x[i + 3]);
+    }
+    // Each 128 bit half holds four words of one block, u[j] has blocks j and j + 4
+    __m256i u[8];
+    for (size_t i = 0; i < 8; i += 4) {
+        u[i] = _mm256_unpacklo_epi64(t[i], t[i + 2]);
+        u[i + 1] = _mm256_unpackhi_epi64(t[i], t[i + 2]);
+        u[i + 2] = _mm256_unpacklo_epi64(t[i + 1], t[i + 3]);
+        u[i + 3] = _mm256_unpackhi_epi64(t[i + 1], t[i + 3]);
+    }
+    for (size_t block = 0; block < 4; ++block) {
+        __m256i* low = reinterpret_cast<__m256i*>(out + block * blockSize);
+        __m256i* high = reinterpret_cast<__m256i*>(out + (block + 4) * blockSize);
+        _mm256_storeu_si256(low, _mm256_xor_si256(_mm256_loadu_si256(low),
+                                                  _mm256_permute2x128_si256(u[block], u[block + 4], 0x20)));
+        _mm256_storeu_si256(high, _mm256_xor_si256(_mm256_loadu_si256(high),
+                                                   _mm256_permute2x128_si256(u[block], u[block + 4], 0x31)));
+    }
+}
+
+// Eight blocks at a time
+STEG_TARGET("avx2")
+inline size_t xorAvx2(std::array<u32, 16>& state, u8* data, size_t size)
+{
+    size_t done = 0;
+    for (; done + 8 * blockSize <= size; done += 8 * blockSize, state[12] += 8) {
+        __m256i input[16];
+        for (size_t i = 0; i < 16; ++i) {
+            input[i] = _mm256_set1_epi32(static_cast<int>(state[i]));
+        }
+        input[12] = _mm256_add_epi32(input[12], _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7));
+
+        __m256i x[16];
+        std::copy_n(input, 16, x);
+        for (int i = 0; i < 10; ++i) {
+            quarterAvx2(x[0], x[4], x[8], x[12]);
+            quarterAvx2(x[1], x[5], x[9], x[13]);
+            quarterAvx2(x[2], x[6], x[10], x[14]);
+            quarterAvx2(x[3], x[7], x[11], x[15]);
+            quarterAvx2(x[0], x[5], x[10], x[15]);
+            quarterAvx2(x[1], x[6], x[11], x[12]);
+            quarterAvx2(x[2], x[7], x[8], x[13]);
+            quarterAvx2(x[3], x[4], x[9], x[14]);
+        }
+        for (size_t i = 0; i < 16; ++i) {
+            x[i] = _mm256_add_epi32(x[i], input[i]);
+        }
+        transposeXorAvx2(data + done, x);
+        transposeXorAvx2(data + done + 32, x + 8);
+    }
+    return done;
+}
+#endif
+
+// XOR the key stream from the counter in state[12] on into data
+inline void xorStream(std::array<u32, 16> state, u8* data, size_t size)
+{
+    size_t done = 0;
+#ifdef STEG_X86
+    if (std::endian::native == std::endian::little) {
+        if (cpu::features().avx2) {
+            done = xorAvx2(state, data, size);
+        }
+        else if (cpu::features().sse2) {
+            done = xorSse2(state, data, size);
+        }
+    }
+#endif
+    xorScalar(state, data + done, size - done);
+}
+
+}
+
+// Encrypt or decrypt data in place with the ChaCha20 key stream from block `counter` on, split over up to `threads`
+// threads (0 for one per hardware thread) on the shared thread pool. Up to 2^32 blocks of 64 bytes.
+inline void apply(const Key& key, const Nonce& nonce, u32 counter, u8* data, size_t size, size_t threads = 1)
+{
+    constexpr size_t minChunk = 1 << 20;
+
+    const std::array<u32, 16> state = detail::initialState(key, nonce, counter);
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    const size_t chunks = std::clamp<size_t>(size / minChunk, 1, threads);
+    if (chunks == 1) {
+        detail::xorStream(state, data, size);
+        return;
+    }
+
+    // Chunks of whole blocks, each starting at its own counter
+    const size_t chunkSize = ((size + chunks - 1) / chunks + blockSize - 1) / blockSize * blockSize;
+    ThreadPool::shared().parallelFor(chunks, [&](size_t i) {
+        const size_t offset = std::min(i * chunkSize, size);
+        std::array<u32, 16> chunkState = state;
+        chunkState[12] += static_cast<u32>(offset / blockSize);
+        detail::xorStream(chunkState, data + offset, std::min(chunkSize, size - offset));
+    });
+}
+
+namespace detail {
+
+inline u32 load32(const u8* p)
+{
+    return p[0] | (static_cast<u32>(p[1]) << 8) | (static_cast<u32>(p[2]) << 16) | (static_cast<u32>(p[3]) << 24);
+}
+
+inline void store32(u8* p, u32 word)
+{
+    for (size_t i = 0; i < 4; ++i) {
+        p[i] = static_cast<u8>(word >> (8 * i));
+    }
+}
+
+// SHA-256 (FIPS 180-4), only used to stretch passphrases
+class Sha256 {
+  public:
+    void update(const u8* data, size_t size)
+    {
+        total += size;
+        while (size > 0) {
+            const size_t count = std::min(size, buffer.size() - filled);
+            std::copy_n(data, count, buffer.begin() + filled);
+            filled += count;
+            data += count;
+            size -= count;
+            if (filled == buffer.size()) {
+                compress(buffer.data());
+                filled = 0;
+            }
+        }
+    }
+
+    std::array<u8, 32> finish()
+    {
+        const u64 bits = total * 8;
+        const u8 one = 0x80;
+        update(&one, 1);
+        const u8 zero = 0;
+        while (filled != 56) {
+            update(&zero, 1);
+        }
+        for (int i = 7; i >= 0; --i) {
+            const u8 byte = static_cast<u8>(bits >> (8 * i));
+            update(&byte, 1);
+        }
+
+        std::array<u8, 32> digest;
+        for (size_t i = 0; i < 8; ++i) {
+            for (size_t j = 0; j < 4; ++j) {
+                digest[4 * i + j] = static_cast<u8>(state[i] >> (24 - 8 * j));
+            }
+        }
+        return digest;
+    }
+
+  private:
+    void compress(const u8* block)
+    {
+        static constexpr std::array<u32, 64> rounds = {
+            0x428A2F98, 0x71374491, 0xB5C0FBCF, 0xE9B5DBA5, 0x3956C25B, 0x59F111F1, 0x923F82A4, 0xAB1C5ED5,
+            0xD807AA98, 0x12835B01, 0x243185BE, 0x550C7DC3, 0x72BE5D74, 0x80DEB1FE, 0x9BDC06A7, 0xC19BF174,
+            0xE49B69C1, 0xEFBE4786, 0x0FC19DC6, 0x240CA1CC, 0x2DE92C6F, 0x4A7484AA, 0x5CB0A9DC, 0x76F988DA,
+            0x983E5152, 0xA831C66D, 0xB00327C8, 0xBF597FC7, 0xC6E00BF3, 0xD5A79147, 0x06CA6351, 0x14292967,
+            0x27B70A85, 0x2E1B2138, 0x4D2C6DFC, 0x53380D13, 0x650A7354, 0x766A0ABB, 0x81C2C92E, 0x92722C85,
+            0xA2BFE8A1, 0xA81A664B, 0xC24B8B70, 0xC76C51A3, 0xD192E819, 0xD6990624, 0xF40E3585, 0x106AA070,
+            0x19A4C116, 0x1E376C08, 0x2748774C, 0x34B0BCB5, 0x391C0CB3, 0x4ED8AA4A, 0x5B9CCA4F, 0x682E6FF3,
+            0x748F82EE, 0x78A5636F, 0x84C87814, 0x8CC70208, 0x90BEFFFA, 0xA4506CEB, 0xBEF9A3F7, 0xC67178F2,
+        };
+
+        std::array<u32, 64> w;
+        for (size_t i = 0; i < 16; ++i) {
+            w[i] = (static_cast<u32>(block[4 * i]) << 24) | (static_cast<u32>(block[4 * i + 1]) << 16) |
+                   (static_cast<u32>(block[4 * i + 2]) << 8) | block[4 * i + 3];
+        }
+        for (size_t i = 16; i < 64; ++i) {
+            const u32 s0 = std::rotr(w[i - 15], 7) ^ std::rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+            const u32 s1 = std::rotr(w[i - 2], 17) ^ std::rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+            w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+        }
+
+        auto [a, b, c, d, e, f, g, h] = state;
+        for (size_t i = 0; i < 64; ++i) {
+            const u32 t1 = h + (std::rotr(e, 6) ^ std::rotr(e, 11) ^ std::rotr(e, 25)) + ((e & f) ^ (~e & g)) +
+                           rounds[i] + w[i];
+            const u32 t2 = (std::rotr(a, 2) ^ std::rotr(a, 13) ^ std::rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+            h = g;
+            g = f;
+            f = e;
+            e = d + t1;
+            d = c;
+            c = b;
+            b = a;
+            a = t1 + t2;
+        }
+        const std::array<u32, 8> result = {a, b, c, d, e, f, g, h};
+        for (size_t i = 0; i < 8; ++i) {
+            state[i] += result[i];
+        }
+    }
+
+    std::array<u32, 8> state = {0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A,
+                                0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19};
+    std::array<u8, 64> buffer{};
+    size_t filled = 0;
+    u64 total = 0;
+};
+
+// Poly1305 (RFC 8439) in five 26 bit limbs, so every product fits in 64 bits
+class Poly1305 {
+  public:
+    explicit Poly1305(const u8* key)
+        : r{load32(key) & 0x3FFFFFF, (load32(key + 3) >> 2) & 0x3FFFF03, (load32(key + 6) >> 4) & 0x3FFC0FF,
+            (load32(key + 9) >> 6) & 0x3F03FFF, (load32(key + 12) >> 8) & 0x00FFFFF},
+          s{load32(key + 16), load32(key + 20), load32(key + 24), load32(key + 28)}
+    {}
+
+    void update(const u8* data, size_t size)
+    {
+        if (filled) {
+            const size_t count = std::min(size, buffer.size() - filled);
+            std::copy_n(data, count, buffer.begin() + filled);
+            filled += count;
+            data += count;
+            size -= count;
+            if (filled < buffer.size()) {
+                return;
+            }
+            block(buffer.data(), 1 << 24);
+            filled = 0;
+        }
+        for (; size >= 16; data += 16, size -= 16) {
+            block(data, 1 << 24);
+        }
+        std::copy_n(data, size, buffer.begin());
+        filled = size;
+    }
+
+    // Zeros up to a multiple of 16 bytes, as the AEAD construction pads its parts
+    void pad()
+    {
+        if (filled) {
+            std::fill(buffer.begin() + filled, buffer.end(), 0);
+            block(buffer.data(), 1 << 24);
+            filled = 0;
+        }
+    }
+
+    std::array<u8, 16> finish()
+    {
+        if (filled) {
+            buffer[filled] = 1;
+            std::fill(buffer.begin() + filled + 1, buffer.end(), 0);
+            block(buffer.data(), 0);
+        }
+
+        constexpr u32 mask = 0x3FFFFFF;
+        auto [h0, h1, h2, h3, h4] = h;
+        u32 c = h1 >> 26;
+        h1 &= mask;
+        h2 += c;
+        c = h2 >> 26;
+        h2 &= mask;
+        h3 += c;
+        c = h3 >> 26;
+        h3 &= mask;
+        h4 += c;
+        c = h4 >> 26;
+        h4 &= mask;
+        h0 += c * 5;
+        c = h0 >> 26;
+        h0 &= mask;
+        h1 += c;
+
+        // h - p, kept if it did not borrow
+        u32 g0 = h0 + 5;
+        c = g0 >> 26;
+        g0 &= mask;
+        u32 g1 = h1 + c;
+        c = g1 >> 26;
+        g1 &= mask;
+        u32 g2 = h2 + c;
+        c = g2 >> 26;
+        g2 &= mask;
+        u32 g3 = h3 + c;
+        c = g3 >> 26;
+        g3 &= mask;
+        const u32 g4 = h4 + c - (1 << 26);
+        const u32 keep = (g4 >> 31) - 1;
+        h0 = (h0 & ~keep) | (g0 & keep);
+        h1 = (h1 & ~keep) | (g1 & keep);
+        h2 = (h2 & ~keep) | (g2 & keep);
+        h3 = (h3 & ~keep) | (g3 & keep);
+        h4 = (h4 & ~keep) | (g4 & keep);
+
+        const std::array<u32, 4> words = {h0 | (h1 << 26), (h1 >> 6) | (h2 << 20), (h2 >> 12) | (h3 << 14),
+                                          (h3 >> 18) | (h4 << 8)};
+        std::array<u8, 16> tag;
+        u64 carry = 0;
+        for (size_t i = 0; i < 4; ++i) {
+            carry += static_cast<u64>(words[i]) + s[i];
+            store32(tag.data() + 4 * i, static_cast<u32>(carry));
+            carry >>= 32;
+        }
+        return tag;
+    }
+
+  private:
+    void block(const u8* m, u32 hibit)
+    {
+        constexpr u32 mask = 0x3FFFFFF;
+        h[0] += load32(m) & mask;
+        h[1] += (load32(m + 3) >> 2) & mask;
+        h[2] += (load32(m + 6) >> 4) & mask;
+        h[3] += (load32(m + 9) >> 6) & mask;
+        h[4] += (load32(m + 12) >> 8) | hibit;
+
+        const auto mul = [](u32 a, u32 b) { return static_cast<u64>(a) * b; };
+        const auto [r0, r1, r2, r3, r4] = r;
+        const u32 s1 = r1 * 5, s2 = r2 * 5, s3 = r3 * 5, s4 = r4 * 5;
+        const auto [h0, h1, h2, h3, h4] = h;
+        std::array<u64, 5> d = {
+            mul(h0, r0) + mul(h1, s4) + mul(h2, s3) + mul(h3, s2) + mul(h4, s1),
+            mul(h0, r1) + mul(h1, r0) + mul(h2, s4) + mul(h3, s3) + mul(h4, s2),
+            mul(h0, r2) + mul(h1, r1) + mul(h2, r0) + mul(h3, s4) + mul(h4, s3),
+            mul(h0, r3) + mul(h1, r2) + mul(h2, r1) + mul(h3, r0) + mul(h4, s4),
+            mul(h0, r4) + mul(h1, r3) + mul(h2, r2) + mul(h3, r1) + mul(h4, r0),
+        };
+        u64 carry = 0;
+        for (size_t i = 0; i < 5; ++i) {
+            d[i] += carry;
+            h[i] = static_cast<u32>(d[i]) & mask;
+            carry = d[i] >> 26;
+        }
+        h[0] += static_cast<u32>(carry) * 5;
+        h[1] += h[0] >> 26;
+        h[0] &= mask;
+    }
+
+    std::array<u32, 5> r;
+    std::array<u32, 4> s;
+    std::array<u32, 5> h{};
+    std::array<u8, 16> buffer{};
+    size_t filled = 0;
+};
+
+// The Poly1305 tag of ChaCha20-Poly1305 over aad and the ciphertext, keyed by the first block of the key stream
+inline std::array<u8, 16> authenticate(const Key& key, const Nonce& nonce, std::span<const u8> aad, const u8* data,
+                                       size_t size)
+{
+    std::array<u8, blockSize> oneTimeKey{};
+    xorScalar(initialState(key, nonce, 0), oneTimeKey.data(), oneTimeKey.size());
+
+    Poly1305 mac(oneTimeKey.data());
+    mac.update(aad.data(), aad.size());
+    mac.pad();
+    mac.update(data, size);
+    mac.pad();
+    std::array<u8, 16> lengths;
+    for (size_t i = 0; i < 8; ++i) {
+        lengths[i] = static_cast<u8>(static_cast<u64>(aad.size()) >> (8 * i));
+        lengths[8 + i] = static_cast<u8>(static_cast<u64>(size) >> (8 * i));
+    }
+    mac.update(lengths.data(), lengths.size());
+    return mac.finish();
+}
+
+}
+
+using Salt = std::array<u8, 16>;
+using Tag = std::array<u8, 16>;
+
+// PBKDF2 iterations of deriveKey(), so that every guess at a passphrase is slow
+inline constexpr u32 iterations = 1 << 17;
+
+// Stretch a passphrase into a key with PBKDF2-HMAC-SHA256 (RFC 8018) and a salt, so the same passphrase gives
+// different keys for different payloads
+inline Key deriveKey(std::string_view passphrase, std::span<const u8> salt, u32 rounds = iterations)
+{
+    // HMAC keys longer than a block are hashed first
+    std::array<u8, 64> pad{};
+    if (passphrase.size() > pad.size()) {
+        detail::Sha256 hash;
+        hash.update(reinterpret_cast<const u8*>(passphrase.data()), passphrase.size());
+        const auto digest = hash.finish();
+        std::copy(digest.begin(), digest.end(), pad.begin());
+    }
+    else {
+        std::copy(passphrase.begin(), passphrase.end(), pad.begin());
+    }
+
+    // Every HMAC starts from the states after its padded keys
+    detail::Sha256 inner;
+    detail::Sha256 outer;
+    for (u8& byte : pad) {
+        byte ^= 0x36;
+    }
+    inner.update(pad.data(), pad.size());
+    for (u8& byte : pad) {
+        byte ^= 0x36 ^ 0x5C;
+    }
+    outer.update(pad.data(), pad.size());
+    const auto hmac = [&](auto... parts) {
+        detail::Sha256 hash = inner;
+        (hash.update(parts.data(), parts.size()), ...);
+        const auto digest = hash.finish();
+        hash = outer;
+        hash.update(digest.data(), digest.size());
+        return hash.finish();
+    };
+
+    // One block of output, the first block index is 1
+    constexpr std::array<u8, 4> index = {0, 0, 0, 1};
+    Key block = hmac(salt, index);
+    Key key = block;
+    for (u32 i = 1; i < rounds; ++i) {
+        block = hmac(block);
+        for (size_t j = 0; j < key.size(); ++j) {
+            key[j] ^= block[j];
+        }
+    }
+    return key;
+}
+
+// Encrypt data in place with ChaCha20-Poly1305 (RFC 8439) and return its tag, which also covers aad
+inline Tag seal(const Key& key, const Nonce& nonce, std::span<const u8> aad, u8* data, size_t size,
+                size_t threads = 1)
+{
+    apply(key, nonce, 1, data, size, threads);
+    return detail::authenticate(key, nonce, aad, data, size);
+}
+
+// Check the tag of data encrypted with seal() and decrypt it in place, leaving it untouched if the tag does not match
+inline bool open(const Key& key, const Nonce& nonce, std::span<const u8> aad, u8* data, size_t size, const Tag& tag,
+                 size_t threads = 1)
+{
+    const Tag expected = detail::authenticate(key, nonce, aad, data, size);
+    u8 difference = 0;
+    for (size_t i = 0; i < tag.size(); ++i) {
+        difference |= expected[i] ^ tag[i];
+    }
+    if (difference) {
+        return false;
+    }
+    apply(key, nonce, 1, data, size, threads);
+    return true;
+}
+
+// Bytes encrypt() adds to the plaintext: the salt and nonce in front and the tag after it
+inline constexpr size_t overhead = sizeof(Salt) + sizeof(Nonce) + sizeof(Tag);
+
+// Encrypt data under a key derived from a passphrase with a fresh random salt and nonce
+inline std::string encrypt(std::string_view plaintext, std::string_view passphrase, size_t threads = 1)
+{
+    std::string result(overhead + plaintext.size(), 0);
+    u8* bytes = reinterpret_cast<u8*>(result.data());
+    std::random_device random;
+    for (size_t i = 0; i < sizeof(Salt) + sizeof(Nonce); i += 4) {
+        detail::store32(bytes + i, random());
+    }
+    Salt salt;
+    Nonce nonce;
+    std::copy_n(bytes, salt.size(), salt.begin());
+    std::copy_n(bytes + salt.size(), nonce.size(), nonce.begin());
+
+    u8* data = bytes + salt.size() + nonce.size();
+    std::copy(plaintext.begin(), plaintext.end(), data);
+    const Tag tag = seal(deriveKey(passphrase, salt), nonce, {}, data, plaintext.size(), threads);
+    std::copy(tag.begin(), tag.end(), data + plaintext.size());
+    return result;
+}
+
+// Decrypt the output of encrypt(), failing if the passphrase is wrong or the ciphertext was changed
+inline std::expected<std::string, std::string> decrypt(std::string_view ciphertext, std::string_view passphrase,
+                                                       size_t threads = 1)
+{
+    if (ciphertext.size() < overhead) {
+        return std::unexpected(
+            std::format("Encrypted data of {} bytes is too short for its salt, nonce and tag", ciphertext.size()));
+    }
+
+    const u8* bytes = reinterpret_cast<const u8*>(ciphertext.data());
+    Salt salt;
+    Nonce nonce;
+    Tag tag;
+    std::copy_n(bytes, salt.size(), salt.begin());
+    std::copy_n(bytes + salt.size(), nonce.size(), nonce.begin());
+    std::copy_n(bytes + ciphertext.size() - tag.size(), tag.size(), tag.begin());
+
+    std::string result(ciphertext.substr(salt.size() + nonce.size(), ciphertext.size() - overhead));
+    if (!open(deriveKey(passphrase, salt), nonce, {}, reinterpret_cast<u8*>(result.data()), result.size(), tag,
+              threads)) {
+        return std::unexpected("Wrong passphrase, or the encrypted payload was changed");
+    }
+    return result;
+}
+
+}
+
+#endif // STEGANOGRAPHER_CIPHER_HPP
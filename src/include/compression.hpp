@@ -1,69 +1,659 @@
 #ifndef STEGANOGRAPHER_COMPRESSION_HPP
 #define STEGANOGRAPHER_COMPRESSION_HPP
 
+#include "cpu.hpp"
 #include "int_types.hpp"
 
-#include <cassert>
+#include <algorithm>
+#include <bit>
 #include <cstdint>
+#include <cstring>
+#include <expected>
+#include <format>
 #include <limits>
+#include <new>
+#include <span>
 #include <string>
 #include <string_view>
+#include <type_traits>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
 
 
 namespace rle {
 
-// Create an RLE compressed string corresponding to the input
-template<typename CountT = u16>
-requires(std::is_integral_v<CountT>)
+// Run counts stored as LEB128: 7 bits per byte, least significant first, with the high bit set on all but the last
+// byte. Runs of up to 127 bytes take one byte for their count and no run is ever too long for it.
+struct Varint {};
+
+// What compress() and extract() can store run counts as
+template<typename CountT>
+concept RunCount = std::is_integral_v<CountT> || std::is_same_v<CountT, Varint>;
+
+namespace detail {
+
+// Each run scanner returns how many bytes from the start of data equal data[0], at least one and at most size
+
+inline size_t runScalar(const u8* data, size_t size, size_t from)
+{
+    while (from < size && data[from] == data[0]) {
+        ++from;
+    }
+    return from;
+}
+
+// Most runs are short. Every vector step depends on the one before it, so the first bytes are compared one at a time
+// where the branch predictor can run ahead, and only runs longer than that go to the vectors.
+constexpr size_t probeSize = 8;
+
+inline size_t runProbe(const u8* data, size_t size)
+{
+    size_t i = 1;
+    while (i < probeSize && i < size && data[i] == data[0]) {
+        ++i;
+    }
+    return i;
+}
+
+#ifdef STEG_X86
+STEG_TARGET("sse2")
+inline size_t runSse2(const u8* data, size_t size)
+{
+    const __m128i current = _mm_set1_epi8(static_cast<char>(data[0]));
+    size_t i = runProbe(data, size);
+    if (i < probeSize) {
+        return i;
+    }
+    for (; i + 16 <= size; i += 16) {
+        const __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const u32 differ = ~static_cast<u32>(_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, current))) & 0xFFFF;
+        if (differ != 0) {
+            return i + std::countr_zero(differ);
+        }
+    }
+    return runScalar(data, size, i);
+}
+
+STEG_TARGET("avx2")
+inline size_t runAvx2(const u8* data, size_t size)
+{
+    const __m256i current = _mm256_set1_epi8(static_cast<char>(data[0]));
+    size_t i = runProbe(data, size);
+    if (i < probeSize) {
+        return i;
+    }
+    for (; i + 32 <= size; i += 32) {
+        const __m256i bytes = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const u32 differ = ~static_cast<u32>(_mm256_movemask_epi8(_mm256_cmpeq_epi8(bytes, current)));
+        if (differ != 0) {
+            return i + std::countr_zero(differ);
+        }
+    }
+    return runScalar(data, size, i);
+}
+
+STEG_TARGET("avx512f,avx512bw")
+inline size_t runAvx512(const u8* data, size_t size)
+{
+    const __m512i current = _mm512_set1_epi8(static_cast<char>(data[0]));
+    size_t i = runProbe(data, size);
+    if (i < probeSize) {
+        return i;
+    }
+    for (; i + 64 <= size; i += 64) {
+        const u64 differ = _mm512_cmpneq_epi8_mask(_mm512_loadu_si512(data + i), current);
+        if (differ != 0) {
+            return i + std::countr_zero(differ);
+        }
+    }
+    return runScalar(data, size, i);
+}
+#endif
+
+inline size_t runPortable(const u8* data, size_t size)
+{
+    return runScalar(data, size, 1);
+}
+
+using RunFn = size_t (*)(const u8* data, size_t size);
+
+// The widest run scanner this CPU supports, looked up once per compress() rather than once per run
+inline RunFn runScanner()
+{
+#ifdef STEG_X86
+    if (cpu::features().avx512bw) {
+        return runAvx512;
+    }
+    if (cpu::features().avx2) {
+        return runAvx2;
+    }
+    if (cpu::features().sse2) {
+        return runSse2;
+    }
+#endif
+    return runPortable;
+}
+
+// Each literal scanner returns where the first run of at least minRun equal bytes in data starts, or size if there is
+// none. Shorter runs are cheaper to store as part of the literal bytes around them.
+constexpr size_t minRun = 4;
+
+inline size_t literalScalar(const u8* data, size_t size, size_t from)
+{
+    for (size_t i = from; i + minRun <= size; ++i) {
+        if (data[i] == data[i + 1] && data[i] == data[i + 2] && data[i] == data[i + 3]) {
+            return i;
+        }
+    }
+    return size;
+}
+
+#ifdef STEG_X86
+// Byte i of the mask is set if bytes i to i + 3 are equal
+STEG_TARGET("sse2")
+inline size_t literalSse2(const u8* data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 + minRun - 1 <= size; i += 16) {
+        const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i));
+        const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 1));
+        const __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 2));
+        const __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i + 3));
+        const __m128i equal = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, b), _mm_cmpeq_epi8(a, c)),
+                                            _mm_cmpeq_epi8(a, d));
+        const u32 mask = static_cast<u32>(_mm_movemask_epi8(equal));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return literalScalar(data, size, i);
+}
+
+STEG_TARGET("avx2")
+inline size_t literalAvx2(const u8* data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 + minRun - 1 <= size; i += 32) {
+        const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i));
+        const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 1));
+        const __m256i c = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 2));
+        const __m256i d = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i + 3));
+        const __m256i equal = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, b), _mm256_cmpeq_epi8(a, c)),
+                                               _mm256_cmpeq_epi8(a, d));
+        const u32 mask = static_cast<u32>(_mm256_movemask_epi8(equal));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return literalScalar(data, size, i);
+}
+
+STEG_TARGET("avx512f,avx512bw")
+inline size_t literalAvx512(const u8* data, size_t size)
+{
+    size_t i = 0;
+    for (; i + 64 + minRun - 1 <= size; i += 64) {
+        const __m512i a = _mm512_loadu_si512(data + i);
+        const u64 mask = _mm512_cmpeq_epi8_mask(a, _mm512_loadu_si512(data + i + 1))
+                         & _mm512_cmpeq_epi8_mask(a, _mm512_loadu_si512(data + i + 2))
+                         & _mm512_cmpeq_epi8_mask(a, _mm512_loadu_si512(data + i + 3));
+        if (mask != 0) {
+            return i + std::countr_zero(mask);
+        }
+    }
+    return literalScalar(data, size, i);
+}
+#endif
+
+inline size_t literalPortable(const u8* data, size_t size)
+{
+    return literalScalar(data, size, 0);
+}
+
+using LiteralFn = size_t (*)(const u8* data, size_t size);
+
+inline LiteralFn literalScanner()
+{
+#ifdef STEG_X86
+    if (cpu::features().avx512bw) {
+        return literalAvx512;
+    }
+    if (cpu::features().avx2) {
+        return literalAvx2;
+    }
+    if (cpu::features().sse2) {
+        return literalSse2;
+    }
+#endif
+    return literalPortable;
+}
+
+// Write a run of count bytes with room bytes available. Runs of up to 16 bytes are two 8 byte stores of the byte
+// broadcast when there is room for them, longer ones a memset.
+inline void fill(char* output, size_t room, char c, size_t count)
+{
+    if (count <= 16 && room >= 16) {
+        const u64 pattern = u64{0x0101010101010101} * static_cast<u8>(c);
+        std::memcpy(output, &pattern, sizeof(pattern));
+        std::memcpy(output + 8, &pattern, sizeof(pattern));
+    }
+    else {
+        std::memset(output, c, count);
+    }
+}
+
+// Most bytes a LEB128 u64 takes
+constexpr size_t maxVarintSize = 10;
+
+inline size_t writeVarint(char* output, u64 value)
+{
+    size_t size = 0;
+    for (; value >= 0x80; value >>= 7) {
+        output[size++] = static_cast<char>(value | 0x80);
+    }
+    output[size++] = static_cast<char>(value);
+    return size;
+}
+
+// Read a LEB128 u64 from at least maxVarintSize readable bytes. Returns the bytes it took, 0 if it does not fit a u64.
+inline size_t readVarint(const char* input, u64& value)
+{
+    value = 0;
+    for (size_t i = 0; i < maxVarintSize; ++i) {
+        const u8 byte = static_cast<u8>(input[i]);
+        value |= static_cast<u64>(byte & 0x7F) << (7 * i);
+        if (byte < 0x80) {
+            return i == maxVarintSize - 1 && byte > 1 ? 0 : i + 1;
+        }
+    }
+    return 0;
+}
+
+// How a run is stored: its count, then its byte. A run takes from minSize bytes for one byte to maxSize.
+template<RunCount CountT>
+struct Runs {
+    static constexpr size_t minSize = sizeof(CountT) + 1;
+    static constexpr size_t maxSize = sizeof(CountT) + 1;
+    static constexpr u64 maxCount = static_cast<u64>(std::numeric_limits<CountT>::max());
+
+    static size_t write(char* output, u64 count, char c)
+    {
+        const CountT stored = static_cast<CountT>(count);
+        std::memcpy(output, &stored, sizeof(CountT));
+        output[sizeof(CountT)] = c;
+        return maxSize;
+    }
+
+    // Read from at least maxSize readable bytes. Returns the bytes it took, 0 if the run is malformed.
+    static size_t read(const char* input, u64& count, char& c)
+    {
+        CountT stored;
+        std::memcpy(&stored, input, sizeof(CountT));
+        count = static_cast<u64>(stored);
+        c = input[sizeof(CountT)];
+        return maxSize;
+    }
+};
+
+template<>
+struct Runs<Varint> {
+    static constexpr size_t minSize = 2;
+    static constexpr size_t maxSize = maxVarintSize + 1;
+    static constexpr u64 maxCount = std::numeric_limits<u64>::max();
+
+    static size_t write(char* output, u64 count, char c)
+    {
+        const size_t size = writeVarint(output, count);
+        output[size] = c;
+        return size + 1;
+    }
+
+    static size_t read(const char* input, u64& count, char& c)
+    {
+        const size_t size = readVarint(input, count);
+        c = input[size];
+        return size == 0 ? 0 : size + 1;
+    }
+};
+
+// Call visit(count, byte) for the runs of an RLE compressed string, until it returns false. Returns false if a run is
+// malformed or cut off. Whole blocks of runs are read without checking for the end of the input or a malformed run,
+// which are only looked for once per block. The last runs are read from a zero padded copy.
+template<RunCount CountT, typename Visit>
+bool forEachRun(std::string_view data, Visit&& visit)
+{
+    using Format = Runs<CountT>;
+    constexpr size_t blockRuns = 16;
+    const char* input = data.data();
+    const char* const end = input + data.size();
+
+    bool more = true;
+    bool valid = true;
+    while (more && valid && static_cast<size_t>(end - input) >= blockRuns * Format::maxSize) {
+        for (size_t i = 0; i < blockRuns; ++i) {
+            u64 count;
+            char c;
+            const size_t size = Format::read(input, count, c);
+            valid &= size != 0;
+            more &= visit(count, c);
+            input += size;
+        }
+    }
+    while (more && valid && input < end) {
+        char padded[Format::maxSize] = {};
+        const size_t available = std::min(Format::maxSize, static_cast<size_t>(end - input));
+        std::memcpy(padded, input, available);
+        u64 count;
+        char c;
+        const size_t size = Format::read(padded, count, c);
+        valid = size != 0 && size <= available;
+        if (valid) {
+            more = visit(count, c);
+            input += size;
+        }
+    }
+    return valid;
+}
+
+// Call run(count, byte) and literal(bytes, size) for the tokens of a packed string, until either returns false.
+// Returns false if a token is malformed or cut off. While a longest header and the byte of a run fit in what is left,
+// headers are read without checking for the end of the input.
+template<typename Run, typename Literal>
+bool forEachToken(std::string_view data, Run&& run, Literal&& literal)
+{
+    constexpr size_t maxHeaderSize = maxVarintSize + 1;
+    const char* input = data.data();
+    const char* const end = input + data.size();
+
+    bool more = true;
+    while (more && input < end) {
+        u64 header;
+        size_t size;
+        if (static_cast<size_t>(end - input) >= maxHeaderSize) {
+            size = readVarint(input, header);
+        }
+        else {
+            char padded[maxHeaderSize] = {};
+            std::memcpy(padded, input, static_cast<size_t>(end - input));
+            size = readVarint(padded, header);
+            if (size >= static_cast<size_t>(end - input)) {
+                return false;
+            }
+        }
+        if (size == 0) {
+            return false;
+        }
+        input += size;
+
+        const u64 length = (header >> 1) + 1;
+        if (header & 1) {
+            if (length > static_cast<u64>(end - input)) {
+                return false;
+            }
+            more = literal(input, static_cast<size_t>(length));
+            input += length;
+        }
+        else {
+            more = run(length, *input);
+            ++input;
+        }
+    }
+    return true;
+}
+
+}
+
+// Create an RLE compressed string corresponding to the input. Runs longer than CountT can count are split.
+template<RunCount CountT = u16>
 std::string compress(std::string_view data)
 {
+    using Format = detail::Runs<CountT>;
     std::string result;
+    if (data.empty()) {
+        return result;
+    }
 
-    // Helper to store count and then the character in the result string
-    const auto storeChar = [&result](char c, CountT count) {
-        result.resize(result.size() + sizeof(CountT));                                         // Add bytes to store a number (of type CountT)
-        CountT* u = reinterpret_cast<CountT*>(result.data() + result.size() - sizeof(CountT)); // One past the last char
-        *u = count;
-        result += c;
-    };
+    // Runs are written straight into the string. It starts out sized for runs averaging 16 bytes with counts of up to
+    // two bytes and doubles up to the worst case of one run per byte, rather than zero filling the worst case up front.
+    const size_t worstCase = data.size() * Format::minSize;
+    result.resize(std::min(worstCase, data.size() / 16 * std::min<size_t>(Format::maxSize, 3)) + Format::maxSize);
+    size_t used = 0;
+
+    const detail::RunFn scan = detail::runScanner();
+    const u8* bytes = reinterpret_cast<const u8*>(data.data());
+    for (size_t i = 0; i < data.size();) {
+        const char c = data[i];
+        size_t run = scan(bytes + i, data.size() - i);
+        i += run;
+        while (run > 0) {
+            if (result.size() - used < Format::maxSize) {
+                result.resize(std::max(std::min(worstCase, 2 * result.size()), used + Format::maxSize));
+            }
+            const u64 count = std::min<u64>(run, Format::maxCount);
+            used += Format::write(result.data() + used, count, c);
+            run -= count;
+        }
+    }
+
+    result.resize(used);
+    if (result.capacity() > 2 * result.size()) {
+        result.shrink_to_fit();
+    }
+    return result;
+}
 
-    char current = 0;
-    CountT count = 0;
+// Number of bytes extract() expands an RLE compressed string to, or why it is not one compress() could have made
+template<RunCount CountT = u16>
+std::expected<size_t, std::string> extractedSize(std::string_view data)
+{
+    // A zero count or an overflowing sum is only looked at once all runs are read
+    u64 size = 0;
+    bool invalid = false;
+    const bool whole = detail::forEachRun<CountT>(data, [&](u64 count, char) {
+        const u64 sum = size + count;
+        invalid |= count == 0 || sum < size;
+        size = sum;
+        return true;
+    });
+
+    if (!whole) {
+        return std::unexpected("RLE data ends in the middle of a run or has a malformed count");
+    }
+    if (invalid) {
+        return std::unexpected("RLE data has a run of no bytes or more bytes than fit in memory");
+    }
+    if (size > std::string().max_size()) {
+        return std::unexpected(std::format("RLE data expands to {} bytes, more than fit in memory", size));
+    }
+    return static_cast<size_t>(size);
+}
 
-    for (char c : data) {
-        if (c != current && count > 0) {
-            storeChar(current, count);
-            count = 0;
+// Extract the bytes of an RLE compressed string from `skip` on into a buffer, until either runs out. Returns how many
+// bytes were written. Bytes of the buffer past that may be overwritten. Nothing is read or written out of bounds, but
+// only extractedSize() tells whether the data is well formed.
+template<RunCount CountT = u16>
+size_t extract(std::string_view data, std::span<char> output, size_t skip = 0)
+{
+    size_t written = 0;
+    detail::forEachRun<CountT>(data, [&](u64 count, char c) {
+        if (skip > 0) {
+            const u64 skipped = std::min<u64>(skip, count);
+            skip -= static_cast<size_t>(skipped);
+            count -= skipped;
         }
+        const size_t run = static_cast<size_t>(std::min<u64>(count, output.size() - written));
+        detail::fill(output.data() + written, output.size() - written, c, run);
+        written += run;
+        return written < output.size();
+    });
+    return written;
+}
 
-        current = c;
-        assert(count < std::numeric_limits<CountT>::max());
-        count++;
+// Extract an RLE compressed string into the original uncompressed string. Data that compress() could not have made
+// is an error rather than read out of bounds.
+template<RunCount CountT = u16>
+std::expected<std::string, std::string> extract(std::string_view data)
+{
+    const auto size = extractedSize<CountT>(data);
+    if (!size) {
+        return std::unexpected(size.error());
     }
 
-    if (count > 0) {
-        storeChar(current, count);
+    // Garbage counts can add up to more than can be allocated
+    std::string result;
+    try {
+        result.reserve(*size);
+    }
+    catch (const std::bad_alloc&) {
+        return std::unexpected(std::format("RLE data expands to {} bytes, more than can be allocated", *size));
     }
 
+    // Checked to add up to exactly the output, so the runs are expanded without checking for its end.
+    // libstdc++ 12 can hand the operation its grown capacity instead of the size asked for, so that is not used.
+    result.resize_and_overwrite(*size, [&](char* output, size_t) {
+        char* const end = output + *size;
+        detail::forEachRun<CountT>(data, [&](u64 count, char c) {
+            detail::fill(output, static_cast<size_t>(end - output), c, static_cast<size_t>(count));
+            output += count;
+            return true;
+        });
+        return *size;
+    });
     return result;
 }
 
-// Extract an RLE compressed string into the original uncompressed string
-template<typename CountT = u16>
-requires(std::is_integral_v<CountT>)
-std::string extract(std::string_view data)
+// Packed RLE stores bytes that do not repeat as they are, so it is at most a few bytes, plus one per 8 KiB, larger
+// than its input. Every token starts with a LEB128 header of (length - 1) << 1, with the low bit set for a literal. A run
+// header is followed by its byte, a literal header by its length in bytes copied from the input. Only runs of at least
+// 4 bytes are split off from the literal bytes around them.
+inline std::string pack(std::string_view data)
 {
     std::string result;
+    result.resize(data.size() / 8 + 2 * detail::Runs<Varint>::maxSize);
+    size_t used = 0;
+    const auto reserve = [&](size_t size) {
+        if (result.size() - used < size) {
+            result.resize(std::max(2 * result.size(), used + size));
+        }
+    };
 
-    for (size_t i = 0; i < data.size(); ++i) {
-        const CountT* count = reinterpret_cast<const CountT*>(data.data() + i);
-        i += sizeof(CountT); // Skip past the count
-        char c = data[i];
-        for (CountT j = 0; j < *count; ++j) {
-            result.push_back(c);
+    const detail::LiteralFn findRun = detail::literalScanner();
+    const detail::RunFn scan = detail::runScanner();
+    const u8* bytes = reinterpret_cast<const u8*>(data.data());
+    for (size_t i = 0; i < data.size();) {
+        const size_t literal = findRun(bytes + i, data.size() - i);
+        if (literal > 0) {
+            reserve(detail::maxVarintSize + literal);
+            used += detail::writeVarint(result.data() + used, (static_cast<u64>(literal) - 1) << 1 | 1);
+            std::memcpy(result.data() + used, data.data() + i, literal);
+            used += literal;
+            i += literal;
+        }
+        if (i < data.size()) {
+            const size_t run = scan(bytes + i, data.size() - i);
+            reserve(detail::Runs<Varint>::maxSize);
+            used += detail::writeVarint(result.data() + used, (static_cast<u64>(run) - 1) << 1);
+            result[used++] = data[i];
+            i += run;
         }
     }
 
+    result.resize(used);
+    if (result.capacity() > 2 * result.size()) {
+        result.shrink_to_fit();
+    }
+    return result;
+}
+
+// Number of bytes unpack() expands a packed string to, or why it is not one pack() could have made
+inline std::expected<size_t, std::string> unpackedSize(std::string_view data)
+{
+    u64 size = 0;
+    bool overflow = false;
+    const auto add = [&](u64 length) {
+        const u64 sum = size + length;
+        overflow |= sum < size;
+        size = sum;
+        return true;
+    };
+    const bool whole = detail::forEachToken(
+        data, [&](u64 count, char) { return add(count); }, [&](const char*, size_t length) { return add(length); });
+
+    if (!whole) {
+        return std::unexpected("Packed data ends in the middle of a token or has a malformed header");
+    }
+    if (overflow || size > std::string().max_size()) {
+        return std::unexpected("Packed data expands to more bytes than fit in memory");
+    }
+    return static_cast<size_t>(size);
+}
+
+// Unpack the bytes of a packed string from `skip` on into a buffer, until either runs out. Returns how many bytes
+// were written. Bytes of the buffer past that may be overwritten. Nothing is read or written out of bounds, but only
+// unpackedSize() tells whether the data is well formed.
+inline size_t unpack(std::string_view data, std::span<char> output, size_t skip = 0)
+{
+    size_t written = 0;
+    const auto skipped = [&](u64 length) {
+        const u64 skipping = std::min<u64>(skip, length);
+        skip -= static_cast<size_t>(skipping);
+        return skipping;
+    };
+    detail::forEachToken(
+        data,
+        [&](u64 count, char c) {
+            count -= skipped(count);
+            const size_t run = static_cast<size_t>(std::min<u64>(count, output.size() - written));
+            detail::fill(output.data() + written, output.size() - written, c, run);
+            written += run;
+            return written < output.size();
+        },
+        [&](const char* bytes, size_t length) {
+            const size_t from = static_cast<size_t>(skipped(length));
+            const size_t size = std::min(length - from, output.size() - written);
+            std::memcpy(output.data() + written, bytes + from, size);
+            written += size;
+            return written < output.size();
+        });
+    return written;
+}
+
+// Unpack a packed string into the original string. Data that pack() could not have made is an error rather than read
+// out of bounds.
+inline std::expected<std::string, std::string> unpack(std::string_view data)
+{
+    const auto size = unpackedSize(data);
+    if (!size) {
+        return std::unexpected(size.error());
+    }
+
+    std::string result;
+    try {
+        result.reserve(*size);
+    }
+    catch (const std::bad_alloc&) {
+        return std::unexpected(std::format("Packed data expands to {} bytes, more than can be allocated", *size));
+    }
+
+    // Checked to add up to exactly the output, so the tokens are expanded without checking for its end
+    result.resize_and_overwrite(*size, [&](char* output, size_t) {
+        char* const end = output + *size;
+        detail::forEachToken(
+            data,
+            [&](u64 count, char c) {
+                detail::fill(output, static_cast<size_t>(end - output), c, static_cast<size_t>(count));
+                output += count;
+                return true;
+            },
+            [&](const char* bytes, size_t length) {
+                std::memcpy(output, bytes, length);
+                output += length;
+                return true;
+            });
+        return *size;
+    });
     return result;
 }
 
@@ -0,0 +1,111 @@
+#ifndef STEGANOGRAPHER_CPU_HPP
+#define STEGANOGRAPHER_CPU_HPP
+
+#include "int_types.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define STEG_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#endif
+
+// Mark a function as compiled for a specific instruction set extension. MSVC allows intrinsics anywhere.
+#if defined(__GNUC__)
+#define STEG_TARGET(features) __attribute__((target(features)))
+#else
+#define STEG_TARGET(features)
+#endif
+
+
+namespace cpu {
+
+// Instruction set extensions relevant for the embedding kernels
+struct Features {
+    bool sse2 = false;
+    bool ssse3 = false;
+    bool sse42 = false;
+    bool avx2 = false;
+    bool avx512bw = false;
+    bool bmi2 = false;
+    bool fastBmi2 = false; // PDEP/PEXT are not microcoded, which they are on AMD before Zen 3
+};
+
+namespace detail {
+
+#ifdef STEG_X86
+// Run cpuid for the given leaf and subleaf, returning {eax, ebx, ecx, edx}
+inline void cpuid(u32 leaf, u32 subleaf, u32 (&regs)[4])
+{
+#if defined(_MSC_VER)
+    int r[4];
+    __cpuidex(r, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i) {
+        regs[i] = static_cast<u32>(r[i]);
+    }
+#else
+    __cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+#endif
+}
+
+// Read the XCR0 register, telling which register states the OS saves on context switches
+inline u64 xgetbv()
+{
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    u32 eax = 0, edx = 0;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<u64>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+inline Features detect()
+{
+    Features result;
+#ifdef STEG_X86
+    u32 regs[4];
+    cpuid(0, 0, regs);
+    const u32 maxLeaf = regs[0];
+    const bool amd = (regs[1] == 0x68747541 && regs[3] == 0x69746E65)   // "AuthenticAMD"
+                     || (regs[1] == 0x6F677948 && regs[3] == 0x6E65476E); // "HygonGenuine"
+
+    cpuid(1, 0, regs);
+    const u32 family = ((regs[0] >> 8) & 0xF) + ((regs[0] >> 20) & 0xFF);
+    result.sse2 = (regs[3] >> 26) & 1;
+    result.ssse3 = (regs[2] >> 9) & 1;
+    result.sse42 = (regs[2] >> 20) & 1;
+    const bool osxsave = (regs[2] >> 27) & 1;
+    const bool avx = (regs[2] >> 28) & 1;
+
+    // AVX registers are only usable if the OS saves them, ZMM registers need the opmask and upper halves too
+    const u64 xcr0 = osxsave ? xgetbv() : 0;
+    const bool ymmEnabled = avx && (xcr0 & 0x6) == 0x6;
+    const bool zmmEnabled = ymmEnabled && (xcr0 & 0xE0) == 0xE0;
+
+    if (maxLeaf >= 7) {
+        cpuid(7, 0, regs);
+        result.avx2 = ymmEnabled && ((regs[1] >> 5) & 1);
+        result.avx512bw = zmmEnabled && ((regs[1] >> 16) & 1) && ((regs[1] >> 30) & 1); // AVX512F and AVX512BW
+        result.bmi2 = (regs[1] >> 8) & 1;
+        result.fastBmi2 = result.bmi2 && !(amd && family < 0x19);
+    }
+#endif
+    return result;
+}
+
+}
+
+// Features of the CPU we are running on, detected once on first use
+inline const Features& features()
+{
+    static const Features detected = detail::detect();
+    return detected;
+}
+
+}
+
+#endif // STEGANOGRAPHER_CPU_HPP
@@ -0,0 +1,671 @@
+#ifndef STEGANOGRAPHER_ECC_HPP
+#define STEGANOGRAPHER_ECC_HPP
+
+#include "cpu.hpp"
+#include "int_types.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <expected>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// Reed-Solomon error correction over GF(2^8), so payloads survive a few flipped bits in the carrier
+namespace ecc {
+
+// Codewords of blockSize bytes, of which `parity` are parity bytes. Up to parity / 2 bad bytes per codeword can
+// be corrected.
+struct Params {
+    u8 blockSize = 255;
+    u8 parity = 32;
+};
+
+// Codewords are interleaved byte by byte in groups of this many, which spreads a burst of errors over many
+// codewords and lets SIMD registers hold one byte of each codeword
+inline constexpr size_t lanes = 32;
+
+inline std::expected<void, std::string> validate(const Params& params)
+{
+    if (params.parity < 2 || params.parity >= params.blockSize) {
+        return std::unexpected(std::format("Invalid Reed-Solomon code with {} parity bytes in blocks of {} bytes, "
+                                           "parity must be at least 2 and less than the block size",
+                                           params.parity, params.blockSize));
+    }
+    return {};
+}
+
+namespace detail {
+
+// GF(2^8) with the polynomial x^8 + x^4 + x^3 + x^2 + 1 and generator 2
+struct Field {
+    std::array<u8, 512> exp; // Doubled so that exp[log a + log b] needs no reduction
+    std::array<u8, 256> log;
+};
+
+constexpr Field makeField()
+{
+    Field field{};
+    u32 x = 1;
+    for (size_t i = 0; i < 255; ++i) {
+        field.exp[i] = field.exp[i + 255] = static_cast<u8>(x);
+        field.log[x] = static_cast<u8>(i);
+        x <<= 1;
+        if (x & 0x100) {
+            x ^= 0x11D;
+        }
+    }
+    return field;
+}
+
+inline constexpr Field field = makeField();
+
+constexpr u8 mul(u8 a, u8 b)
+{
+    return a && b ? field.exp[field.log[a] + field.log[b]] : 0;
+}
+
+// a / b for nonzero b
+constexpr u8 div(u8 a, u8 b)
+{
+    return a ? field.exp[field.log[a] + 255 - field.log[b]] : 0;
+}
+
+// The generator to the power e
+constexpr u8 power(int e)
+{
+    return field.exp[(e % 255 + 255) % 255];
+}
+
+// Coefficients of the generator polynomial, the product of (x - 2^j) for j < parity, lowest degree first and
+// without the leading 1
+inline std::vector<u8> generator(size_t parity)
+{
+    std::vector<u8> result(parity + 1, 0);
+    result[0] = 1;
+    for (size_t j = 0; j < parity; ++j) {
+        const u8 root = power(static_cast<int>(j));
+        for (size_t i = j + 1; i > 0; --i) {
+            result[i] = result[i - 1] ^ mul(result[i], root);
+        }
+        result[0] = mul(result[0], root);
+    }
+    result.pop_back();
+    return result;
+}
+
+// Compute the parity bytes of a codeword with k data bytes at data[0], data[stride], ... into parity[0],
+// parity[stride], ... by dividing by the generator in a shift register
+inline void encodeScalar(const u8* data, size_t k, const std::vector<u8>& gen, u8* parity, size_t stride)
+{
+    const size_t p = gen.size();
+    std::array<u8, 255> r{};
+    for (size_t i = 0; i < k; ++i) {
+        const u8 feedback = data[i * stride] ^ r[p - 1];
+        for (size_t j = p - 1; j > 0; --j) {
+            r[j] = r[j - 1] ^ mul(feedback, gen[j]);
+        }
+        r[0] = mul(feedback, gen[0]);
+    }
+    for (size_t q = 0; q < p; ++q) {
+        parity[q * stride] = r[p - 1 - q];
+    }
+}
+
+// The p syndromes of a codeword of n bytes at codeword[0], codeword[stride], ..., returning if any is nonzero
+inline bool syndromesScalar(const u8* codeword, size_t n, size_t p, size_t stride, u8* syndromes)
+{
+    bool any = false;
+    for (size_t j = 0; j < p; ++j) {
+        const u8 root = power(static_cast<int>(j));
+        u8 s = 0;
+        for (size_t i = 0; i < n; ++i) {
+            s = mul(s, root) ^ codeword[i * stride];
+        }
+        syndromes[j] = s;
+        any |= s != 0;
+    }
+    return any;
+}
+
+// Correct a codeword with nonzero syndromes in place, returning false if it has more bad bytes than the code can
+// correct. Byte i of the codeword is the coefficient of x^(n - 1 - i).
+inline bool correct(u8* codeword, size_t n, size_t p, size_t stride, const u8* syndromes)
+{
+    // Berlekamp-Massey finds the error locator, with a root 2^-e for an error at degree e
+    std::array<u8, 256> locator{};
+    std::array<u8, 256> previous{};
+    locator[0] = previous[0] = 1;
+    size_t errors = 0;
+    size_t shift = 1;
+    u8 previousDiscrepancy = 1;
+
+    for (size_t r = 0; r < p; ++r) {
+        u8 discrepancy = syndromes[r];
+        for (size_t i = 1; i <= errors; ++i) {
+            discrepancy ^= mul(locator[i], syndromes[r - i]);
+        }
+        if (discrepancy == 0) {
+            ++shift;
+            continue;
+        }
+
+        const std::array<u8, 256> old = locator;
+        const u8 scale = div(discrepancy, previousDiscrepancy);
+        for (size_t i = 0; i + shift <= p; ++i) {
+            locator[i + shift] ^= mul(scale, previous[i]);
+        }
+        if (2 * errors <= r) {
+            errors = r + 1 - errors;
+            previous = old;
+            previousDiscrepancy = discrepancy;
+            shift = 1;
+        }
+        else {
+            ++shift;
+        }
+    }
+    if (2 * errors > p) {
+        return false;
+    }
+
+    // Chien search for the roots, there must be one per error
+    std::array<size_t, 128> degrees;
+    size_t found = 0;
+    for (size_t e = 0; e < n; ++e) {
+        const u8 x = power(-static_cast<int>(e));
+        u8 value = 0;
+        for (size_t i = errors + 1; i > 0; --i) {
+            value = mul(value, x) ^ locator[i - 1];
+        }
+        if (value == 0) {
+            if (found == errors) {
+                return false;
+            }
+            degrees[found++] = e;
+        }
+    }
+    if (found != errors) {
+        return false;
+    }
+
+    // Forney's formula for the error values, from the evaluator S(x) * locator(x) mod x^p
+    std::array<u8, 256> evaluator{};
+    for (size_t i = 0; i < p; ++i) {
+        for (size_t j = 0; j <= errors && i + j < p; ++j) {
+            evaluator[i + j] ^= mul(syndromes[i], locator[j]);
+        }
+    }
+    for (size_t k = 0; k < found; ++k) {
+        const int e = static_cast<int>(degrees[k]);
+        const u8 x = power(-e);
+        const u8 xSquared = mul(x, x);
+
+        u8 numerator = 0;
+        for (size_t i = p; i > 0; --i) {
+            numerator = mul(numerator, x) ^ evaluator[i - 1];
+        }
+        // The formal derivative of the locator only has the odd terms
+        u8 denominator = 0;
+        for (int i = static_cast<int>(errors | 1); i > 0; i -= 2) {
+            denominator = mul(denominator, xSquared) ^ locator[i];
+        }
+        if (denominator == 0) {
+            return false;
+        }
+        codeword[(n - 1 - degrees[k]) * stride] ^= mul(power(e), div(numerator, denominator));
+    }
+
+    // A codeword too damaged to correct can still look correctable, so check the result
+    std::array<u8, 256> check;
+    return !syndromesScalar(codeword, n, p, stride, check.data());
+}
+
+// Products with a constant c, split into tables for the low and high nibble of the other factor so that a byte
+// shuffle does 16 or 32 multiplications at once. Each table is repeated for both halves of an AVX2 register.
+struct SplitTable {
+    alignas(32) std::array<u8, 32> low;
+    alignas(32) std::array<u8, 32> high;
+};
+
+inline std::vector<SplitTable> splitTables(const std::vector<u8>& constants)
+{
+    std::vector<SplitTable> result(constants.size());
+    for (size_t i = 0; i < constants.size(); ++i) {
+        for (u8 x = 0; x < 16; ++x) {
+            result[i].low[x] = result[i].low[x + 16] = mul(constants[i], x);
+            result[i].high[x] = result[i].high[x + 16] = mul(constants[i], static_cast<u8>(x << 4));
+        }
+    }
+    return result;
+}
+
+#ifdef STEG_X86
+STEG_TARGET("ssse3")
+inline __m128i mulSsse3(__m128i v, const SplitTable& table)
+{
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    const __m128i low = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table.low.data())),
+                                         _mm_and_si128(v, nibble));
+    const __m128i high = _mm_shuffle_epi8(_mm_load_si128(reinterpret_cast<const __m128i*>(table.high.data())),
+                                          _mm_and_si128(_mm_srli_epi16(v, 4), nibble));
+    return _mm_xor_si128(low, high);
+}
+
+// The shift register of encodeScalar() for all the lanes of a group, 16 at a time: the remainder of the `length`
+// interleaved bytes at data, times x^p, divided by the generator
+STEG_TARGET("ssse3")
+inline void remainderSsse3(const u8* data, size_t length, const std::vector<SplitTable>& gen, u8* remainder)
+{
+    const size_t p = gen.size();
+    __m128i r[255];
+    for (size_t half = 0; half < lanes; half += 16) {
+        std::fill_n(r, p, _mm_setzero_si128());
+        for (size_t i = 0; i < length; ++i) {
+            const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + i * lanes + half));
+            const __m128i feedback = _mm_xor_si128(in, r[p - 1]);
+            for (size_t j = p - 1; j > 0; --j) {
+                r[j] = _mm_xor_si128(r[j - 1], mulSsse3(feedback, gen[j]));
+            }
+            r[0] = mulSsse3(feedback, gen[0]);
+        }
+        for (size_t q = 0; q < p; ++q) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(remainder + q * lanes + half), r[p - 1 - q]);
+        }
+    }
+}
+
+STEG_TARGET("avx2")
+inline __m256i mulAvx2(__m256i v, const SplitTable& table)
+{
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    const __m256i low = _mm256_shuffle_epi8(_mm256_load_si256(reinterpret_cast<const __m256i*>(table.low.data())),
+                                            _mm256_and_si256(v, nibble));
+    const __m256i high = _mm256_shuffle_epi8(_mm256_load_si256(reinterpret_cast<const __m256i*>(table.high.data())),
+                                             _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+    return _mm256_xor_si256(low, high);
+}
+
+STEG_TARGET("avx2")
+inline void remainderAvx2(const u8* data, size_t length, const std::vector<SplitTable>& gen, u8* remainder)
+{
+    const size_t p = gen.size();
+    __m256i r[255];
+    std::fill_n(r, p, _mm256_setzero_si256());
+    for (size_t i = 0; i < length; ++i) {
+        const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(data + i * lanes));
+        const __m256i feedback = _mm256_xor_si256(in, r[p - 1]);
+        for (size_t j = p - 1; j > 0; --j) {
+            r[j] = _mm256_xor_si256(r[j - 1], mulAvx2(feedback, gen[j]));
+        }
+        r[0] = mulAvx2(feedback, gen[0]);
+    }
+    for (size_t q = 0; q < p; ++q) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(remainder + q * lanes), r[p - 1 - q]);
+    }
+}
+
+// remainderAvx2() or remainderSsse3() if the CPU has either, for whole groups
+inline bool remainderSimd(const u8* data, size_t length, const std::vector<SplitTable>& gen, u8* remainder)
+{
+    if (cpu::features().avx2) {
+        remainderAvx2(data, length, gen, remainder);
+        return true;
+    }
+    if (cpu::features().ssse3) {
+        remainderSsse3(data, length, gen, remainder);
+        return true;
+    }
+    return false;
+}
+
+// out ^= c * in for the constant c of the table, returning the number of bytes done
+STEG_TARGET("ssse3")
+inline size_t mulAddSsse3(u8* out, const u8* in, size_t size, const SplitTable& table)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + i));
+        const __m128i o = _mm_loadu_si128(reinterpret_cast<const __m128i*>(out + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_xor_si128(o, mulSsse3(v, table)));
+    }
+    return i;
+}
+
+STEG_TARGET("avx2")
+inline size_t mulAddAvx2(u8* out, const u8* in, size_t size, const SplitTable& table)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in + i));
+        const __m256i o = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(out + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_xor_si256(o, mulAvx2(v, table)));
+    }
+    return i;
+}
+#endif
+
+inline void mulAddScalar(u8* out, const u8* in, size_t size, u8 c)
+{
+    for (size_t i = 0; i < size; ++i) {
+        out[i] ^= mul(c, in[i]);
+    }
+}
+
+inline void mulAdd(u8* out, const u8* in, size_t size, u8 c, const SplitTable& table)
+{
+    size_t done = 0;
+#ifdef STEG_X86
+    if (cpu::features().avx2) {
+        done = mulAddAvx2(out, in, size, table);
+    }
+    else if (cpu::features().ssse3) {
+        done = mulAddSsse3(out, in, size, table);
+    }
+#endif
+    mulAddScalar(out + done, in + done, size - done, c);
+}
+
+// Encode the `count` interleaved codewords of a group, with their data at data[0..count * k) and parity following
+inline void encodeGroup(u8* group, size_t count, size_t k, const std::vector<u8>& gen,
+                        const std::vector<SplitTable>& genTables)
+{
+#ifdef STEG_X86
+    if (count == lanes && remainderSimd(group, k, genTables, group + k * lanes)) {
+        return;
+    }
+#endif
+    for (size_t lane = 0; lane < count; ++lane) {
+        encodeScalar(group + lane, k, gen, group + k * count + lane, count);
+    }
+}
+
+// Correct the `count` interleaved codewords of n bytes in a group, returning false if one can not be corrected
+inline bool decodeGroup(u8* group, size_t count, size_t n, const std::vector<u8>& gen,
+                        const std::vector<SplitTable>& genTables)
+{
+    const size_t p = gen.size();
+    std::array<u8, 255> syndromes;
+
+#ifdef STEG_X86
+    // A codeword is intact if the generator divides it, which the encoding shift register checks for all the
+    // lanes at once. Only damaged codewords take the slow path.
+    std::array<u8, 255 * lanes> remainder;
+    if (count == lanes && remainderSimd(group, n, genTables, remainder.data())) {
+        std::array<u8, lanes> damaged{};
+        for (size_t q = 0; q < p; ++q) {
+            for (size_t lane = 0; lane < lanes; ++lane) {
+                damaged[lane] |= remainder[q * lanes + lane];
+            }
+        }
+        for (size_t lane = 0; lane < lanes; ++lane) {
+            if (damaged[lane] && syndromesScalar(group + lane, n, p, lanes, syndromes.data())
+                && !correct(group + lane, n, p, lanes, syndromes.data())) {
+                return false;
+            }
+        }
+        return true;
+    }
+#endif
+    for (size_t lane = 0; lane < count; ++lane) {
+        if (syndromesScalar(group + lane, n, p, count, syndromes.data())
+            && !correct(group + lane, n, p, count, syndromes.data())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Bytes of the length prefix in front of the data
+inline constexpr size_t prefixSize = 8;
+
+// Copy bytes [offset, offset + size) of the data with its length prefix and zero padding to out
+inline void copyPlain(std::string_view data, size_t offset, size_t size, u8* out)
+{
+    std::array<u8, prefixSize> prefix;
+    for (size_t i = 0; i < prefixSize; ++i) {
+        prefix[i] = static_cast<u8>(static_cast<u64>(data.size()) >> (8 * i));
+    }
+
+    const size_t end = offset + size;
+    for (; offset < std::min(end, prefixSize); ++offset) {
+        *out++ = prefix[offset];
+    }
+    const size_t dataEnd = std::min(end, data.size() + prefixSize);
+    if (offset < dataEnd) {
+        out = std::copy(data.begin() + (offset - prefixSize), data.begin() + (dataEnd - prefixSize), out);
+        offset = dataEnd;
+    }
+    std::fill_n(out, end - offset, u8{0});
+}
+
+// Call fn(first, last) for ranges of `count` groups, split over up to `threads` threads (0 for one per hardware
+// thread) on the shared thread pool
+template<typename F>
+void forEachGroups(size_t count, size_t threads, F&& fn)
+{
+    constexpr size_t minGroups = 64; // About 500 kB of codewords
+
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    if (threads <= 1 || count < 2 * minGroups) {
+        fn(0, count);
+        return;
+    }
+
+    const size_t perChunk = std::max((count + threads - 1) / threads, minGroups);
+    ThreadPool::shared().parallelFor((count + perChunk - 1) / perChunk, [&](size_t i) {
+        fn(i * perChunk, std::min(count, (i + 1) * perChunk));
+    });
+}
+
+}
+
+// Size of the output of encode() for `size` bytes of data
+inline size_t encodedSize(size_t size, const Params& params)
+{
+    const size_t k = params.blockSize - params.parity;
+    const size_t codewords = (size + detail::prefixSize + k - 1) / k;
+    return codewords * params.blockSize;
+}
+
+// The most bytes of data whose encode() output fits in `size` bytes
+inline size_t dataCapacity(size_t size, const Params& params)
+{
+    const size_t data = size / params.blockSize * (params.blockSize - params.parity);
+    return data > detail::prefixSize ? data - detail::prefixSize : 0;
+}
+
+// Add parity to data, split over up to `threads` threads. The data is prefixed with its length and cut into
+// codewords, interleaved in groups of `lanes` codewords. Each group holds the data bytes of all its codewords
+// followed by their parity bytes.
+inline std::string encode(std::string_view data, const Params& params, size_t threads = 1)
+{
+    const size_t n = params.blockSize;
+    const size_t k = n - params.parity;
+    const std::vector<u8> gen = detail::generator(params.parity);
+    const std::vector<detail::SplitTable> genTables = detail::splitTables(gen);
+
+    const size_t codewords = encodedSize(data.size(), params) / n;
+    std::string result(codewords * n, 0);
+    u8* out = reinterpret_cast<u8*>(result.data());
+
+    detail::forEachGroups((codewords + lanes - 1) / lanes, threads, [&](size_t first, size_t last) {
+        for (size_t g = first; g < last; ++g) {
+            const size_t count = std::min(lanes, codewords - g * lanes);
+            u8* group = out + g * lanes * n;
+            detail::copyPlain(data, g * lanes * k, count * k, group);
+            detail::encodeGroup(group, count, k, gen, genTables);
+        }
+    });
+    return result;
+}
+
+// Correct and extract the data from the output of encode() with the same parameters, split over up to `threads`
+// threads
+inline std::expected<std::string, std::string> decode(std::string_view encoded, const Params& params,
+                                                      size_t threads = 1)
+{
+    const size_t n = params.blockSize;
+    const size_t k = n - params.parity;
+    if (encoded.size() % n != 0 || encoded.size() == 0) {
+        return std::unexpected(std::format("Error corrected data of {} bytes is not made of {} byte blocks",
+                                           encoded.size(), n));
+    }
+    const std::vector<u8> gen = detail::generator(params.parity);
+    const std::vector<detail::SplitTable> genTables = detail::splitTables(gen);
+    const size_t codewords = encoded.size() / n;
+
+    // Correct a copy of a group, which stays in cache while its data is copied out
+    const auto decodeGroup = [&](size_t g, u8* group) {
+        const size_t count = std::min(lanes, codewords - g * lanes);
+        std::copy_n(encoded.begin() + g * lanes * n, count * n, group);
+        return detail::decodeGroup(group, count, n, gen, genTables);
+    };
+
+    // The first group has the length, which gives the size of the output
+    std::array<u8, lanes * 255> first;
+    if (!decodeGroup(0, first.data())) {
+        return std::unexpected("Too many errors to correct");
+    }
+    u64 size = 0;
+    for (size_t i = 0; i < detail::prefixSize && i < k * std::min(lanes, codewords); ++i) {
+        size |= static_cast<u64>(first[i]) << (8 * i);
+    }
+    if (codewords * k < detail::prefixSize || size > codewords * k - detail::prefixSize) {
+        return std::unexpected(std::format("Invalid length {} in error corrected data", size));
+    }
+
+    // Copy the data bytes of group g to where they go in the result
+    std::string result(size, 0);
+    const auto copyData = [&](size_t g, const u8* group) {
+        const size_t count = std::min(lanes, codewords - g * lanes);
+        const size_t begin = std::max(g * lanes * k, detail::prefixSize);
+        const size_t end = std::min(g * lanes * k + count * k, size + detail::prefixSize);
+        if (begin < end) {
+            std::copy(group + (begin - g * lanes * k), group + (end - g * lanes * k),
+                      result.begin() + (begin - detail::prefixSize));
+        }
+    };
+    copyData(0, first.data());
+
+    std::atomic<bool> failed = false;
+    const size_t groups = (codewords + lanes - 1) / lanes;
+    detail::forEachGroups(groups - 1, threads, [&](size_t begin, size_t end) {
+        std::array<u8, lanes * 255> group;
+        for (size_t g = begin + 1; g < end + 1 && !failed; ++g) {
+            if (!decodeGroup(g, group.data())) {
+                failed = true;
+                return;
+            }
+            copyData(g, group.data());
+        }
+    });
+    if (failed) {
+        return std::unexpected("Too many errors to correct");
+    }
+    return result;
+}
+
+// Erasure coding of shards: k parity shards for n data shards of the same size, such that any n of the n + k shards
+// give back the data. Shard i is row i of [I; C] times the data shards, where C is a Cauchy matrix, every square
+// submatrix of which is invertible.
+inline constexpr size_t maxShards = 256;
+
+// Row j of C, the coefficients of the n data shards in parity shard j
+inline std::vector<u8> parityRow(size_t j, size_t n)
+{
+    std::vector<u8> row(n);
+    for (size_t d = 0; d < n; ++d) {
+        row[d] = detail::div(1, static_cast<u8>((n + j) ^ d));
+    }
+    return row;
+}
+
+// The coefficients of each of n shards with these indices in the n data shards, the inverse of their rows of
+// [I; C]. Fails if an index repeats or is out of range.
+inline std::expected<std::vector<std::vector<u8>>, std::string> recoveryMatrix(std::span<const size_t> indices,
+                                                                                size_t n)
+{
+    if (indices.size() != n) {
+        return std::unexpected(std::format("Need {} shards to recover the data, got {}", n, indices.size()));
+    }
+    std::vector<std::vector<u8>> rows;
+    std::vector<std::vector<u8>> inverse(n, std::vector<u8>(n, 0));
+    for (size_t r = 0; r < n; ++r) {
+        if (indices[r] >= maxShards) {
+            return std::unexpected(std::format("Invalid shard index {}", indices[r]));
+        }
+        if (indices[r] < n) {
+            rows.emplace_back(n, 0);
+            rows.back()[indices[r]] = 1;
+        }
+        else {
+            rows.push_back(parityRow(indices[r] - n, n));
+        }
+        inverse[r][r] = 1;
+    }
+
+    // Gauss-Jordan elimination
+    for (size_t column = 0; column < n; ++column) {
+        const auto pivot = std::find_if(rows.begin() + column, rows.end(),
+                                        [&](const std::vector<u8>& row) { return row[column] != 0; });
+        if (pivot == rows.end()) {
+            return std::unexpected("The shards do not have independent rows, is one of them repeated?");
+        }
+        const size_t p = static_cast<size_t>(pivot - rows.begin());
+        std::swap(rows[column], rows[p]);
+        std::swap(inverse[column], inverse[p]);
+
+        const u8 scale = detail::div(1, rows[column][column]);
+        for (size_t i = 0; i < n; ++i) {
+            rows[column][i] = detail::mul(rows[column][i], scale);
+            inverse[column][i] = detail::mul(inverse[column][i], scale);
+        }
+        for (size_t r = 0; r < n; ++r) {
+            const u8 factor = rows[r][column];
+            if (r == column || factor == 0) {
+                continue;
+            }
+            for (size_t i = 0; i < n; ++i) {
+                rows[r][i] ^= detail::mul(factor, rows[column][i]);
+                inverse[r][i] ^= detail::mul(factor, inverse[column][i]);
+            }
+        }
+    }
+    return inverse;
+}
+
+// out = the sum of coefficients[i] * shards[i] over `size` bytes, as for a parity shard with parityRow() or a data
+// shard with a row of recoveryMatrix()
+inline void combineShards(std::span<const u8* const> shards, std::span<const u8> coefficients, size_t size, u8* out)
+{
+    // Blocks small enough that the output stays in L1 while every shard is added to it
+    constexpr size_t blockSize = 1 << 13;
+
+    const std::vector<detail::SplitTable> tables =
+        detail::splitTables(std::vector<u8>(coefficients.begin(), coefficients.end()));
+    std::fill_n(out, size, u8{0});
+    for (size_t offset = 0; offset < size; offset += blockSize) {
+        const size_t count = std::min(blockSize, size - offset);
+        for (size_t i = 0; i < shards.size(); ++i) {
+            if (coefficients[i] != 0) {
+                detail::mulAdd(out + offset, shards[i] + offset, count, coefficients[i], tables[i]);
+            }
+        }
+    }
+}
+
+}
+
+#endif // STEGANOGRAPHER_ECC_HPP
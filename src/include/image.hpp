@@ -10,6 +10,7 @@
 #include <ostream>
 #include <string>
 #include <string_view>
+#include <utility>
 #include <vector>
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -25,6 +26,10 @@ struct Image {
     Image(const char* filename) : ownsData(true) {
         data = stbi_load(filename, &x, &y, &channels, 0);
     }
+    // A new image owning an uninitialized buffer of x * y * channels bytes
+    Image(int x, int y, int channels) : x(x), y(y), channels(channels), ownsData(true) {
+        data = static_cast<uint8_t*>(STBI_MALLOC(size()));
+    }
     ~Image() {
         if (ownsData && data) {
             stbi_image_free(data);
@@ -36,8 +41,9 @@ struct Image {
     Image& operator=(const Image&) = delete;
 
     Image(Image&& rhs) noexcept
-        : x(rhs.x), y(rhs.y), channels(rhs.channels), data(rhs.data) {
+        : x(rhs.x), y(rhs.y), channels(rhs.channels), data(rhs.data), ownsData(rhs.ownsData) {
         rhs.data = nullptr;
+        rhs.ownsData = false;
     }
     Image& operator=(Image&& rhs) noexcept {
         if (this == &rhs) {
@@ -50,11 +56,13 @@ struct Image {
         y = rhs.y;
         channels = rhs.channels;
         data = rhs.data;
+        ownsData = rhs.ownsData;
         rhs.data = nullptr;
+        rhs.ownsData = false;
         return *this;
     }
 
-    size_t size() const { return x * y * channels; }
+    size_t size() const { return static_cast<size_t>(x) * y * channels; }
 
     bool operator==(const Image& rhs) const {
         return x == rhs.x && y == rhs.y && channels == rhs.channels && std::equal(data, data + size(), rhs.data);
@@ -102,8 +110,8 @@ struct Image {
         return result;
     }
 
-    // Decode a string representation created by encodeString() into a new Image
-    static std::expected<Image, std::string> decodeString(std::string_view str) {
+    // Decode the image size at the start of a string representation created by encodeString(), leaving data unset
+    static std::expected<Image, std::string> decodeHeader(std::string_view str) {
         if (str.size() < 12) {
             // Need at least 3 i32s for image size
             return std::unexpected("Not enough data in string for image size");
@@ -116,12 +124,23 @@ struct Image {
             result.y = ints[1];
             result.channels = ints[2];
         }
+        if (result.x <= 0 || result.y <= 0 || result.channels < 1 || result.channels > 4) {
+            return std::unexpected("Invalid image size in string");
+        }
+        return result;
+    }
 
-        if (str.size() - 12 < result.size()) {
+    // Decode a string representation created by encodeString() into a new Image
+    static std::expected<Image, std::string> decodeString(std::string_view str) {
+        auto header = decodeHeader(str);
+        if (!header) {
+            return std::unexpected(header.error());
+        }
+        if (str.size() - 12 < header->size()) {
             return std::unexpected("Not enough data in string to decode image");
         }
 
-        result.data = new u8[result.size()];
+        Image result(header->x, header->y, header->channels);
         for (size_t i = 0; i < result.size(); ++i) {
             result.data[i] = str[i + 12];
         }
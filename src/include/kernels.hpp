@@ -0,0 +1,650 @@
+#ifndef STEGANOGRAPHER_KERNELS_HPP
+#define STEGANOGRAPHER_KERNELS_HPP
+
+#include "cpu.hpp"
+#include "int_types.hpp"
+
+#include <array>
+#include <bit>
+#include <cstring>
+#include <expected>
+#include <format>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+namespace kernels {
+
+// The available embedding kernels, in order of preference
+enum class Kernel {
+    Scalar,
+    Swar,
+    Sse2,
+    Bmi2,
+    Avx2,
+    Avx512,
+};
+
+// Store the bits of `size` payload bytes in the lowest bpp bits of ceil(8 * size / bpp) carrier bytes, for a bpp
+// fixed by the function. Bit k of the payload goes to bit k % bpp of carrier byte k / bpp, the layout of hide().
+using HideFn = void (*)(u8* carrier, const u8* payload, size_t size);
+
+// Read back `size` payload bytes stored by a HideFn with the same bpp
+using RevealFn = void (*)(const u8* carrier, u8* payload, size_t size);
+
+// Store `size` payload bytes at 1 bpp like a HideFn, but by LSB matching: a carrier byte whose LSB is wrong gets 1
+// added or subtracted instead of its LSB replaced. The signs come from a PRNG seeded with `seed`, keyed by the index
+// of the 64 carrier byte unit, so `carrier` must start at unit `unit` and any split of the payload gives the same
+// result. Payloads stored like this are read back with the 1 bpp RevealFn.
+using MatchFn = void (*)(u8* carrier, const u8* payload, size_t size, u64 seed, u64 unit);
+
+struct KernelInfo {
+    Kernel kernel;
+    std::string_view name;
+
+    // Functions specialized for bpp 1-8 (at index bpp - 1), nullptr for a bpp the kernel has nothing special for
+    std::array<HideFn, 8> hide;
+    std::array<RevealFn, 8> reveal;
+    MatchFn match; // nullptr if the kernel has no LSB matching function
+};
+
+namespace detail {
+
+// Mask of the lowest Bpp bits in each byte of a word
+template<size_t Bpp>
+constexpr u64 lowBits = 0x0101010101010101ULL * ((1u << Bpp) - 1);
+
+// Load a group of Bpp payload bytes, which covers exactly 8 carrier bytes, into the low bits of a word
+template<size_t Bpp>
+u64 loadGroup(const u8* payload)
+{
+    u64 bits = 0;
+    std::memcpy(&bits, payload, Bpp);
+    return bits;
+}
+
+template<size_t Bpp>
+void storeGroup(u8* payload, u64 bits)
+{
+    std::memcpy(payload, &bits, Bpp);
+}
+
+// Call f(std::integral_constant<size_t, I>{}) for I = 0..N-1, fully unrolled
+template<size_t N, typename F>
+constexpr void unroll(F&& f)
+{
+    [&]<size_t... I>(std::index_sequence<I...>) {
+        (f(std::integral_constant<size_t, I>{}), ...);
+    }(std::make_index_sequence<N>{});
+}
+
+// Spread the 8 bits of a byte into the LSBs of the 8 bytes of a word, bit i ending up in byte i
+constexpr u64 spreadBits(u8 byte)
+{
+    const u64 isolated = (byte * 0x0101010101010101ULL) & 0x8040201008040201ULL; // Byte i keeps only bit i
+    return ((isolated + 0x7F7F7F7F7F7F7F7FULL) >> 7) & 0x0101010101010101ULL;      // Move the set bit in each byte to its LSB
+}
+
+// Gather the LSBs of the 8 bytes of a word into a byte, the inverse of spreadBits()
+constexpr u8 gatherBits(u64 word)
+{
+    return static_cast<u8>(((word & 0x0101010101010101ULL) * 0x0102040810204080ULL) >> 56);
+}
+
+// For byte j of a group of Bpp payload bytes and each of its possible values, the bits it sets in the 8 carrier
+// bytes of the group
+template<size_t Bpp>
+constexpr std::array<std::array<u64, 256>, Bpp> depositTable = [] {
+    std::array<std::array<u64, 256>, Bpp> table{};
+    for (size_t j = 0; j < Bpp; ++j) {
+        for (size_t value = 0; value < 256; ++value) {
+            for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex) {
+                const size_t k = 8 * j + bitIndex; // Bit index within the group
+                table[j][value] |= static_cast<u64>((value >> bitIndex) & 1) << (8 * (k / Bpp) + k % Bpp);
+            }
+        }
+    }
+    return table;
+}();
+
+// Portable equivalent of _pdep_u64(loadGroup<Bpp>(payload), lowBits<Bpp>): the bits of a group of payload bytes,
+// placed in the low Bpp bits of each byte of a word
+template<size_t Bpp>
+u64 deposit(const u8* payload)
+{
+    if constexpr (Bpp == 1) {
+        return spreadBits(payload[0]);
+    }
+    else if constexpr (Bpp == 8) {
+        return loadGroup<Bpp>(payload);
+    }
+    else {
+        u64 result = 0;
+        unroll<Bpp>([&](auto j) { result |= depositTable<Bpp>[j][payload[j]]; });
+        return result;
+    }
+}
+
+// Portable equivalent of _pext_u64(word, lowBits<Bpp>), the inverse of deposit()
+template<size_t Bpp>
+constexpr u64 extract(u64 word)
+{
+    if constexpr (Bpp == 1) {
+        return gatherBits(word);
+    }
+    else if constexpr (Bpp == 8) {
+        return word;
+    }
+    else {
+        u64 result = 0;
+        unroll<8>([&](auto i) { result |= ((word >> (8 * i)) & ((1u << Bpp) - 1)) << (Bpp * i); });
+        return result;
+    }
+}
+
+// One bit at a time, works for any layout and is used for the tails of the other kernels. Whole groups are
+// fully unrolled so that every pixel and bit index is a constant.
+template<size_t Bpp>
+void hideScalar(u8* carrier, const u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        unroll<8 * Bpp>([&](auto k) {
+            constexpr size_t pixelIndex = decltype(k)::value / Bpp; // Which pixel this bit should be in
+            constexpr size_t bitInPixel = decltype(k)::value % Bpp; // Which index in the pixel this bit belongs to
+            const u8 bitValue = (payload[k / 8] >> (k % 8)) & 1;
+
+            u8& pixel = carrier[pixelIndex];
+            pixel = (pixel & ~(1 << bitInPixel)) | (bitValue << bitInPixel);
+        });
+    }
+
+    size_t globalBitIndex = 0; // Which bit we are at in the rest of the payload
+
+    for (size_t i = 0; i < size % Bpp; ++i) {
+        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex, ++globalBitIndex) {
+            const size_t bitInPixel = globalBitIndex % Bpp;
+            u8& pixel = carrier[globalBitIndex / Bpp];
+            pixel = (pixel & ~(1 << bitInPixel)) | (((payload[i] >> bitIndex) & 1) << bitInPixel);
+        }
+    }
+}
+
+template<size_t Bpp>
+void revealScalar(const u8* carrier, u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        u8 group[Bpp] = {};
+        unroll<8 * Bpp>([&](auto k) {
+            constexpr size_t bitInPixel = decltype(k)::value % Bpp;
+            group[k / 8] |= ((carrier[k / Bpp] >> bitInPixel) & 1) << (k % 8);
+        });
+        std::memcpy(payload, group, Bpp);
+    }
+
+    size_t globalBitIndex = 0;
+
+    for (size_t i = 0; i < size % Bpp; ++i) {
+        u8 c = 0;
+        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex, ++globalBitIndex) {
+            const u8 pixel = carrier[globalBitIndex / Bpp];
+            c |= ((pixel >> (globalBitIndex % Bpp)) & 1) << bitIndex;
+        }
+        payload[i] = c;
+    }
+}
+
+// The signs for LSB matching in the 64 carrier bytes of a unit, bit i set to subtract from byte i. This is
+// splitmix64, which is fast and random enough that the changes leave no pattern.
+constexpr u64 matchSigns(u64 seed, u64 unit)
+{
+    u64 x = seed + (unit + 1) * 0x9E3779B97F4A7C15;
+    x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9;
+    x = (x ^ (x >> 27)) * 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+// Make the LSB of a carrier byte equal to bit by adding or subtracting 1 if it is not. At 0 and 255 the direction
+// that stays in range is taken whatever the sign says.
+constexpr u8 matchByte(u8 pixel, u8 bit, bool subtract)
+{
+    if (((pixel ^ bit) & 1) == 0) {
+        return pixel;
+    }
+    return (subtract || pixel == 255) && pixel != 0 ? pixel - 1 : pixel + 1;
+}
+
+inline void matchScalar(u8* carrier, const u8* payload, size_t size, u64 seed, u64 unit)
+{
+    u64 signs = 0;
+    for (size_t i = 0; i < size; ++i, carrier += 8) {
+        if (i % 8 == 0) {
+            signs = matchSigns(seed, unit + i / 8);
+        }
+        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex) {
+            const bool subtract = (signs >> (i % 8 * 8 + bitIndex)) & 1;
+            carrier[bitIndex] = matchByte(carrier[bitIndex], (payload[i] >> bitIndex) & 1, subtract);
+        }
+    }
+}
+
+// One group of Bpp payload bytes per 64-bit word, requires a little endian machine
+template<size_t Bpp>
+void hideSwar(u8* carrier, const u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        u64 word;
+        std::memcpy(&word, carrier, sizeof(word));
+        word = (word & ~lowBits<Bpp>) | deposit<Bpp>(payload);
+        std::memcpy(carrier, &word, sizeof(word));
+    }
+
+    hideScalar<Bpp>(carrier, payload, size % Bpp);
+}
+
+template<size_t Bpp>
+void revealSwar(const u8* carrier, u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        u64 word;
+        std::memcpy(&word, carrier, sizeof(word));
+        storeGroup<Bpp>(payload, extract<Bpp>(word));
+    }
+
+    revealScalar<Bpp>(carrier, payload, size % Bpp);
+}
+
+#ifdef STEG_X86
+// The vector kernels handle as many payload bytes as fit in a register, and leave the rest to the next smaller kernel
+
+// 0xFF in byte i for each bit i of 16 bits that is set
+STEG_TARGET("sse2")
+inline __m128i byteMaskSse2(u32 bits)
+{
+    const __m128i bitSelect = _mm_set1_epi64x(0x8040201008040201LL);
+
+    // Broadcast the first byte to the low 8 bytes and the second to the high 8 bytes
+    __m128i bytes = _mm_cvtsi32_si128(static_cast<int>(bits & 0xFFFF));
+    bytes = _mm_unpacklo_epi8(bytes, bytes);
+    bytes = _mm_unpacklo_epi16(bytes, bytes);
+    bytes = _mm_unpacklo_epi32(bytes, bytes);
+    return _mm_cmpeq_epi8(_mm_and_si128(bytes, bitSelect), bitSelect);
+}
+
+// Two payload bytes per 16 carrier bytes
+STEG_TARGET("sse2")
+inline void hideSse2(u8* carrier, const u8* payload, size_t size)
+{
+    const __m128i one = _mm_set1_epi8(1);
+
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2, carrier += 16) {
+        // Turn each byte into 0 or 1 depending on the bit it is responsible for, then blend into the LSBs
+        const __m128i bits = _mm_and_si128(byteMaskSse2(payload[i] | (payload[i + 1] << 8)), one);
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carrier));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(carrier), _mm_or_si128(_mm_andnot_si128(one, pixels), bits));
+    }
+
+    hideSwar<1>(carrier, payload + i, size - i);
+}
+
+STEG_TARGET("sse2")
+inline void revealSse2(const u8* carrier, u8* payload, size_t size)
+{
+    size_t i = 0;
+    for (; i + 2 <= size; i += 2, carrier += 16) {
+        // Shift each LSB up to the MSB of its byte. Shifting 16-bit lanes is fine since only the MSBs are kept.
+        const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carrier));
+        const u32 bits = static_cast<u32>(_mm_movemask_epi8(_mm_slli_epi16(pixels, 7)));
+        payload[i] = static_cast<u8>(bits);
+        payload[i + 1] = static_cast<u8>(bits >> 8);
+    }
+
+    revealSwar<1>(carrier, payload + i, size - i);
+}
+
+// Eight payload bytes per unit of 64 carrier bytes, in four steps of 16
+STEG_TARGET("sse2")
+inline void matchSse2(u8* carrier, const u8* payload, size_t size, u64 seed, u64 unit)
+{
+    const __m128i one = _mm_set1_epi8(1);
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i max = _mm_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        const u64 signs = matchSigns(seed, unit + i / 8);
+        for (size_t step = 0; step < 4; ++step, carrier += 16) {
+            const __m128i pixels = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carrier));
+            const __m128i bits = _mm_and_si128(byteMaskSse2(payload[i + 2 * step] | (payload[i + 2 * step + 1] << 8)),
+                                               one);
+            const __m128i mismatch = _mm_and_si128(_mm_xor_si128(pixels, bits), one);
+
+            // Subtract where the sign says so or at 255, never at 0
+            __m128i subtract = _mm_or_si128(byteMaskSse2(static_cast<u32>(signs >> (16 * step))),
+                                            _mm_cmpeq_epi8(pixels, max));
+            subtract = _mm_andnot_si128(_mm_cmpeq_epi8(pixels, zero), subtract);
+
+            const __m128i up = _mm_adds_epu8(pixels, mismatch);
+            const __m128i down = _mm_subs_epu8(pixels, mismatch);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(carrier),
+                             _mm_or_si128(_mm_and_si128(subtract, down), _mm_andnot_si128(subtract, up)));
+        }
+    }
+
+    matchScalar(carrier, payload + i, size - i, seed, unit + i / 8);
+}
+
+// 0xFF in byte i for each bit i of 32 bits that is set
+STEG_TARGET("avx2")
+inline __m256i byteMaskAvx2(u32 bits)
+{
+    // Byte index of the byte of bits that each byte takes its bit from, within a 4 byte broadcast
+    const __m256i spread = _mm256_setr_epi8(0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 1, 1, 1, 1,
+                                            2, 2, 2, 2, 2, 2, 2, 2, 3, 3, 3, 3, 3, 3, 3, 3);
+    const __m256i bitSelect = _mm256_set1_epi64x(0x8040201008040201LL);
+
+    const __m256i bytes = _mm256_shuffle_epi8(_mm256_set1_epi32(static_cast<int>(bits)), spread);
+    return _mm256_cmpeq_epi8(_mm256_and_si256(bytes, bitSelect), bitSelect);
+}
+
+// Four payload bytes per 32 carrier bytes
+STEG_TARGET("avx2")
+inline void hideAvx2(u8* carrier, const u8* payload, size_t size)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4, carrier += 32) {
+        u32 word;
+        std::memcpy(&word, payload + i, sizeof(word));
+        const __m256i bits = _mm256_and_si256(byteMaskAvx2(word), one);
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carrier));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(carrier), _mm256_or_si256(_mm256_andnot_si256(one, pixels), bits));
+    }
+
+    hideSse2(carrier, payload + i, size - i);
+}
+
+STEG_TARGET("avx2")
+inline void revealAvx2(const u8* carrier, u8* payload, size_t size)
+{
+    size_t i = 0;
+    for (; i + 4 <= size; i += 4, carrier += 32) {
+        const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carrier));
+        const u32 bits = static_cast<u32>(_mm256_movemask_epi8(_mm256_slli_epi16(pixels, 7)));
+        std::memcpy(payload + i, &bits, sizeof(bits));
+    }
+
+    revealSse2(carrier, payload + i, size - i);
+}
+
+// Eight payload bytes per unit of 64 carrier bytes, in two steps of 32
+STEG_TARGET("avx2")
+inline void matchAvx2(u8* carrier, const u8* payload, size_t size, u64 seed, u64 unit)
+{
+    const __m256i one = _mm256_set1_epi8(1);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i max = _mm256_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8) {
+        const u64 signs = matchSigns(seed, unit + i / 8);
+        for (size_t step = 0; step < 2; ++step, carrier += 32) {
+            u32 word;
+            std::memcpy(&word, payload + i + 4 * step, sizeof(word));
+            const __m256i pixels = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carrier));
+            const __m256i mismatch = _mm256_and_si256(_mm256_xor_si256(pixels, byteMaskAvx2(word)), one);
+
+            __m256i subtract = _mm256_or_si256(byteMaskAvx2(static_cast<u32>(signs >> (32 * step))),
+                                               _mm256_cmpeq_epi8(pixels, max));
+            subtract = _mm256_andnot_si256(_mm256_cmpeq_epi8(pixels, zero), subtract);
+
+            const __m256i up = _mm256_adds_epu8(pixels, mismatch);
+            const __m256i down = _mm256_subs_epu8(pixels, mismatch);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(carrier), _mm256_blendv_epi8(up, down, subtract));
+        }
+    }
+
+    matchScalar(carrier, payload + i, size - i, seed, unit + i / 8);
+}
+
+// Eight payload bytes per 64 carrier bytes, the payload bits are used directly as a byte mask
+STEG_TARGET("avx512f,avx512bw")
+inline void hideAvx512(u8* carrier, const u8* payload, size_t size)
+{
+    const __m512i one = _mm512_set1_epi8(1);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8, carrier += 64) {
+        u64 bits;
+        std::memcpy(&bits, payload + i, sizeof(bits));
+        const __m512i pixels = _mm512_loadu_si512(carrier);
+        _mm512_storeu_si512(carrier, _mm512_or_si512(_mm512_andnot_si512(one, pixels), _mm512_maskz_mov_epi8(bits, one)));
+    }
+
+    hideAvx2(carrier, payload + i, size - i);
+}
+
+STEG_TARGET("avx512f,avx512bw")
+inline void revealAvx512(const u8* carrier, u8* payload, size_t size)
+{
+    const __m512i one = _mm512_set1_epi8(1);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8, carrier += 64) {
+        const u64 bits = _mm512_test_epi8_mask(_mm512_loadu_si512(carrier), one);
+        std::memcpy(payload + i, &bits, sizeof(bits));
+    }
+
+    revealAvx2(carrier, payload + i, size - i);
+}
+
+// Eight payload bytes per unit of 64 carrier bytes, with the payload bits and signs used directly as byte masks
+STEG_TARGET("avx512f,avx512bw")
+inline void matchAvx512(u8* carrier, const u8* payload, size_t size, u64 seed, u64 unit)
+{
+    const __m512i one = _mm512_set1_epi8(1);
+    const __m512i zero = _mm512_setzero_si512();
+    const __m512i max = _mm512_set1_epi8(-1);
+
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8, carrier += 64) {
+        u64 bits;
+        std::memcpy(&bits, payload + i, sizeof(bits));
+        const __m512i pixels = _mm512_loadu_si512(carrier);
+        const __mmask64 mismatch = _kxor_mask64(_cvtu64_mask64(bits), _mm512_test_epi8_mask(pixels, one));
+
+        // Mismatched bytes get +1 or -1 by their sign, except that 0 always goes up and 255 down. The masked compares
+        // and blends do this with fewer mask operations, which are what limit the loop.
+        const __mmask64 down = _mm512_mask_cmpneq_epi8_mask(
+            _kand_mask64(mismatch, _cvtu64_mask64(matchSigns(seed, unit + i / 8))), pixels, zero);
+        __m512i delta = _mm512_mask_mov_epi8(one, down, max);
+        delta = _mm512_mask_mov_epi8(delta, _mm512_mask_cmpeq_epi8_mask(mismatch, pixels, max), max);
+        _mm512_storeu_si512(carrier, _mm512_mask_add_epi8(pixels, mismatch, pixels, delta));
+    }
+
+    matchScalar(carrier, payload + i, size - i, seed, unit + i / 8);
+}
+
+// Like the SWAR kernel, but with a single PDEP/PEXT per group of Bpp payload bytes
+template<size_t Bpp>
+STEG_TARGET("bmi2")
+void hideBmi2(u8* carrier, const u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        u64 word;
+        std::memcpy(&word, carrier, sizeof(word));
+        word = (word & ~lowBits<Bpp>) | _pdep_u64(loadGroup<Bpp>(payload), lowBits<Bpp>);
+        std::memcpy(carrier, &word, sizeof(word));
+    }
+
+    hideScalar<Bpp>(carrier, payload, size % Bpp);
+}
+
+template<size_t Bpp>
+STEG_TARGET("bmi2")
+void revealBmi2(const u8* carrier, u8* payload, size_t size)
+{
+    const size_t groups = size / Bpp;
+    for (size_t i = 0; i < groups; ++i, carrier += 8, payload += Bpp) {
+        u64 word;
+        std::memcpy(&word, carrier, sizeof(word));
+        storeGroup<Bpp>(payload, _pext_u64(word, lowBits<Bpp>));
+    }
+
+    revealScalar<Bpp>(carrier, payload, size % Bpp);
+}
+#endif
+
+}
+
+// Fill a table with the instantiations of a kernel function template for each bpp
+#define STEG_PER_BPP(fn) {fn<1>, fn<2>, fn<3>, fn<4>, fn<5>, fn<6>, fn<7>, fn<8>}
+
+// All kernels, indexed by Kernel. Kernels for other architectures have no functions.
+inline constexpr std::array<KernelInfo, 6> all{{
+    {Kernel::Scalar, "scalar", STEG_PER_BPP(detail::hideScalar), STEG_PER_BPP(detail::revealScalar),
+     detail::matchScalar},
+    {Kernel::Swar, "swar", STEG_PER_BPP(detail::hideSwar), STEG_PER_BPP(detail::revealSwar), nullptr},
+#ifdef STEG_X86
+    {Kernel::Sse2, "sse2", {detail::hideSse2}, {detail::revealSse2}, detail::matchSse2},
+    {Kernel::Bmi2, "bmi2", STEG_PER_BPP(detail::hideBmi2), STEG_PER_BPP(detail::revealBmi2), nullptr},
+    {Kernel::Avx2, "avx2", {detail::hideAvx2}, {detail::revealAvx2}, detail::matchAvx2},
+    {Kernel::Avx512, "avx512", {detail::hideAvx512}, {detail::revealAvx512}, detail::matchAvx512},
+#else
+    {Kernel::Sse2, "sse2", {}, {}, nullptr},
+    {Kernel::Bmi2, "bmi2", {}, {}, nullptr},
+    {Kernel::Avx2, "avx2", {}, {}, nullptr},
+    {Kernel::Avx512, "avx512", {}, {}, nullptr},
+#endif
+}};
+
+#undef STEG_PER_BPP
+
+inline const KernelInfo& info(Kernel kernel)
+{
+    return all[static_cast<size_t>(kernel)];
+}
+
+// Check if a kernel can run on this machine
+inline bool supported(Kernel kernel)
+{
+    switch (kernel) {
+    case Kernel::Scalar:
+        return true;
+    case Kernel::Swar:
+        return std::endian::native == std::endian::little;
+    case Kernel::Sse2:
+        return cpu::features().sse2;
+    case Kernel::Bmi2:
+        return cpu::features().bmi2;
+    case Kernel::Avx2:
+        return cpu::features().avx2;
+    case Kernel::Avx512:
+        return cpu::features().avx512bw;
+    }
+    return false;
+}
+
+// The fastest kernel with a specialization for bpp that is supported on this machine. BMI2 is skipped on CPUs
+// where PDEP/PEXT are microcoded, since the portable SWAR kernel is faster there.
+inline Kernel best(size_t bpp)
+{
+    for (size_t i = all.size(); i-- > 0;) {
+        const Kernel kernel = all[i].kernel;
+        if (kernel == Kernel::Bmi2 && !cpu::features().fastBmi2) {
+            continue;
+        }
+        if (supported(kernel) && all[i].hide[bpp - 1]) {
+            return kernel;
+        }
+    }
+    return Kernel::Scalar;
+}
+
+// Find a kernel by its name
+inline std::optional<Kernel> parse(std::string_view name)
+{
+    for (const KernelInfo& k : all) {
+        if (k.name == name) {
+            return k.kernel;
+        }
+    }
+    return std::nullopt;
+}
+
+namespace detail {
+
+inline std::optional<Kernel>& selectedKernel()
+{
+    static std::optional<Kernel> kernel;
+    return kernel;
+}
+
+inline const std::array<Kernel, 8>& bestKernels()
+{
+    static const std::array<Kernel, 8> kernels = [] {
+        std::array<Kernel, 8> result;
+        for (size_t bpp = 1; bpp <= 8; ++bpp) {
+            result[bpp - 1] = best(bpp);
+        }
+        return result;
+    }();
+    return kernels;
+}
+
+}
+
+// The kernel used by hide() and reveal() for a bpp (1-8). This is the one chosen with select(), or the scalar
+// kernel if that has no specialization for the bpp, so that another fast kernel is never measured in its place.
+// Without a selection it is the best one for this machine.
+inline const KernelInfo& active(size_t bpp)
+{
+    const std::optional<Kernel> selected = detail::selectedKernel();
+    if (selected) {
+        return info(info(*selected).hide[bpp - 1] ? *selected : Kernel::Scalar);
+    }
+    return info(detail::bestKernels()[bpp - 1]);
+}
+
+// The LSB matching function of the kernel chosen with select(), or the scalar one if that has none. Without a
+// selection it is the one of the fastest kernel that has one.
+inline MatchFn activeMatch()
+{
+    const std::optional<Kernel> selected = detail::selectedKernel();
+    if (selected) {
+        return info(*selected).match ? info(*selected).match : detail::matchScalar;
+    }
+    for (size_t i = all.size(); i-- > 0;) {
+        if (supported(all[i].kernel) && all[i].match) {
+            return all[i].match;
+        }
+    }
+    return detail::matchScalar;
+}
+
+// Override the kernel used by hide() and reveal(). Not thread safe, meant to be called at startup.
+inline std::expected<void, std::string> select(Kernel kernel)
+{
+    if (!supported(kernel)) {
+        return std::unexpected(std::format("Kernel {} is not supported on this machine", info(kernel).name));
+    }
+    detail::selectedKernel() = kernel;
+    return {};
+}
+
+}
+
+#endif // STEGANOGRAPHER_KERNELS_HPP
@@ -0,0 +1,417 @@
+#ifndef STEGANOGRAPHER_KEYED_HPP
+#define STEGANOGRAPHER_KEYED_HPP
+
+#include "channels.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "kernels.hpp"
+#include "steganography.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <expected>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Hiding in a keyed pseudorandom order of the carrier. The carrier is cut into tiles of whole pixels that fit in
+// L1, the tiles are visited in a keyed order and the 64 byte units within each tile are too, so the kernels still
+// work on one small block of memory at a time. Consecutive units of the payload go to consecutive tiles, so even a
+// short payload is spread over the whole carrier.
+namespace keyed {
+
+namespace detail {
+
+// The splitmix64 finalizer
+constexpr u64 mix(u64 x)
+{
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+}
+
+inline constexpr size_t tilePixels = 4096;
+
+}
+
+// Turn a passphrase into a key for the embedding order. This only hides where the data is, it is not encryption.
+constexpr u64 deriveKey(std::string_view passphrase)
+{
+    u64 hash = 0xCBF29CE484222325; // FNV-1a
+    for (char c : passphrase) {
+        hash = (hash ^ static_cast<u8>(c)) * 0x100000001B3;
+    }
+    return detail::mix(hash);
+}
+
+// A keyed pseudorandom permutation of [0, size): a balanced Feistel network over the smallest even number of bits
+// covering size, repeated until the result falls in range
+class Permutation {
+  public:
+    Permutation(u64 key, u64 size) : key(key), size(size) {
+        halfBits = static_cast<int>(std::bit_width(std::max<u64>(size, 2) - 1) + 1) / 2;
+        halfMask = (u64{1} << halfBits) - 1;
+    }
+
+    u64 operator()(u64 index) const {
+        do {
+            index = encrypt(index);
+        } while (index >= size);
+        return index;
+    }
+
+  private:
+    u64 encrypt(u64 index) const {
+        u64 left = index >> halfBits;
+        u64 right = index & halfMask;
+        for (u64 round = 0; round < rounds; ++round) {
+            const u64 next = left ^ (detail::mix((key + round * 0x9E3779B97F4A7C15) ^ right) & halfMask);
+            left = right;
+            right = next;
+        }
+        return (left << halfBits) | right;
+    }
+
+    static constexpr u64 rounds = 4;
+
+    u64 key;
+    u64 size;
+    int halfBits;
+    u64 halfMask;
+};
+
+namespace detail {
+
+// Carrier bytes moved as one. Whole cache lines keep reordering a tile about as cheap as embedding in it.
+inline constexpr size_t unitSize = 64;
+
+// The order an image is visited in for a key and channel mask
+class Layout {
+  public:
+    Layout(const Image& plainsight, ChannelMask mask, u64 key)
+        : key(key),
+          channelCount(plainsight.channels),
+          mask(channels::normalize(mask, plainsight.channels)),
+          all(channels::isAll(mask, plainsight.channels)),
+          perPixel(std::popcount(this->mask)),
+          tileSize(tilePixels * perPixel),
+          fullTiles(static_cast<size_t>(plainsight.x) * plainsight.y / tilePixels),
+          lastSize(static_cast<size_t>(plainsight.x) * plainsight.y % tilePixels * perPixel),
+          tileOrder(mix(key ^ 1), fullTiles),
+          order(tileSize / unitSize) {
+        // Every full tile uses this order, rotated and offset by its own key
+        const Permutation inTile(mix(key ^ 2), order.size());
+        for (size_t i = 0; i < order.size(); ++i) {
+            order[i] = static_cast<u16>(inTile(i));
+        }
+    }
+
+    // Selected bytes per full tile, a multiple of 64 so that tiles start at a group of Bpp payload bytes
+    size_t tileBytes() const { return tileSize; }
+
+    // Tiles of tilePixels pixels, not counting the smaller one at the end
+    size_t fullTileCount() const { return fullTiles; }
+
+    // The pixels of logical tile t and how many selected bytes they have
+    template<typename Pixel>
+    std::pair<Pixel*, size_t> tile(Pixel* data, size_t t) const {
+        const size_t physical = t < fullTiles ? tileOrder(t) : fullTiles;
+        return {data + physical * tilePixels * channelCount, t < fullTiles ? tileSize : lastSize};
+    }
+
+    // Copy the units holding the first `count` bytes of logical tile t from its selected bytes in the keyed order
+    void toOrder(size_t t, size_t count, const u8* selected, u8* ordered) const {
+        forEachUnit(t, count, [&](size_t i, size_t unit, size_t bytes) {
+            copyUnit(ordered + i * unitSize, selected + unit * unitSize, bytes);
+        });
+    }
+
+    // Undo toOrder()
+    void fromOrder(size_t t, size_t count, const u8* ordered, u8* selected) const {
+        forEachUnit(t, count, [&](size_t i, size_t unit, size_t bytes) {
+            copyUnit(selected + unit * unitSize, ordered + i * unitSize, bytes);
+        });
+    }
+
+    // Copy the selected bytes of a tile to contiguous memory, unless they already are
+    template<typename Pixel>
+    Pixel* gather(Pixel* pixels, size_t size, u8* buffer) const {
+        if (all) {
+            return pixels;
+        }
+        channels::gather(pixels, size / perPixel, channelCount, mask, buffer);
+        return buffer;
+    }
+
+    // Undo gather() after changing the bytes it returned
+    void scatter(const u8* selected, size_t size, u8* pixels) const {
+        if (!all) {
+            channels::scatter(selected, size / perPixel, channelCount, mask, pixels);
+        }
+    }
+
+  private:
+    // A fixed size copy is a single load and store, only the partial unit at the end of the image needs a call
+    static void copyUnit(u8* dst, const u8* src, size_t bytes) {
+        if (bytes == unitSize) [[likely]] {
+            std::memcpy(dst, src, unitSize);
+        }
+        else {
+            std::memcpy(dst, src, bytes);
+        }
+    }
+
+    // Call fn(i, unit, bytes) for the units of logical tile t covering `count` bytes, with unit i of the keyed
+    // order at position `unit` of the tile and `bytes` long, which is less than unitSize only at the end of the image
+    template<typename F>
+    void forEachUnit(size_t t, size_t count, F&& fn) const {
+        const size_t units = (count + unitSize - 1) / unitSize;
+
+        if (t >= fullTiles) {
+            // The last tile is only visited once, so its order is not worth a table. A partial unit stays at the end.
+            const size_t fullUnits = lastSize / unitSize;
+            const Permutation inTile(mix(key ^ 3), fullUnits);
+            for (size_t i = 0; i < units; ++i) {
+                if (i < fullUnits) {
+                    fn(i, inTile(i), unitSize);
+                }
+                else {
+                    fn(i, i, lastSize - i * unitSize);
+                }
+            }
+            return;
+        }
+
+        const u64 tileKey = mix(key + (t + 4) * 0x9E3779B97F4A7C15);
+        const size_t tileUnits = order.size();
+        const size_t offset = (tileKey >> 16 & 0xFFFF) % tileUnits;
+        size_t index = (tileKey & 0xFFFF) % tileUnits;
+        for (size_t i = 0; i < units; ++i) {
+            const size_t unit = order[index] + offset;
+            fn(i, unit >= tileUnits ? unit - tileUnits : unit, unitSize);
+            index = index + 1 == tileUnits ? 0 : index + 1;
+        }
+    }
+
+    u64 key;
+    int channelCount;
+    ChannelMask mask;
+    bool all;
+    size_t perPixel;
+    size_t tileSize;
+    size_t fullTiles;
+    size_t lastSize;
+    Permutation tileOrder;
+    std::vector<u16> order;
+};
+
+// Buffers for one tile
+struct Scratch {
+    std::array<u8, tilePixels * 4 + channels::padding> selected;
+    std::array<u8, tilePixels * 4> ordered;
+    std::array<u8, tilePixels * 4> payload;
+};
+
+// The payload bytes of one logical tile: units of 8 * Bpp bytes, one per unit of the tile, starting at `offset` and
+// `stride` bytes apart, `size` bytes in all
+struct Part {
+    size_t tile;
+    size_t offset;
+    size_t stride;
+    size_t size;
+};
+
+// Call fn(scratch, part) for every logical tile that holds a part of `size` payload bytes, split over up to `threads`
+// threads. Payload unit u goes to unit u / fullTiles of full tile u % fullTiles, and once those are all used the rest
+// go to the last tile in order.
+template<size_t Bpp, typename F>
+void forEachTile(const Layout& layout, size_t size, size_t threads, F&& fn)
+{
+    constexpr size_t unit = unitSize * Bpp / 8;
+    const size_t fullTiles = layout.fullTileCount();
+    const size_t units = (size + unit - 1) / unit;
+    const size_t spread = std::min(units, fullTiles * (layout.tileBytes() / unitSize));
+    const size_t tiles = std::min(units, fullTiles) + (units > spread ? 1 : 0);
+    if (tiles == 0) {
+        return;
+    }
+
+    const auto part = [&](size_t t) {
+        if (t >= fullTiles) {
+            return Part{fullTiles, spread * unit, unit, size - spread * unit};
+        }
+        const size_t slots = (spread - t + fullTiles - 1) / fullTiles;
+        const size_t last = t + (slots - 1) * fullTiles;
+        return Part{t, t * unit, fullTiles * unit, (slots - 1) * unit + std::min(unit, size - last * unit)};
+    };
+
+    // Split like the payload bytes would be, in runs of whole tiles
+    const size_t perTile = (size + tiles - 1) / tiles;
+    ::detail::forEachChunk(tiles * perTile, threads, perTile, [&](size_t offset, size_t chunkSize) {
+        Scratch scratch;
+        for (size_t t = offset / perTile; t < (offset + chunkSize) / perTile; ++t) {
+            fn(scratch, part(t));
+        }
+    });
+}
+
+// The payload bytes of a part in one piece, copied to buffer unless they already are
+template<size_t Bpp>
+const u8* gatherPayload(const u8* payload, const Part& part, u8* buffer)
+{
+    constexpr size_t unit = unitSize * Bpp / 8;
+    if (part.stride == unit) {
+        return payload + part.offset;
+    }
+    // Fixed size copies of the whole units, only the last one can be shorter
+    const size_t whole = part.size / unit;
+    const u8* source = payload + part.offset;
+    for (size_t i = 0; i < whole; ++i, source += part.stride) {
+        std::memcpy(buffer + i * unit, source, unit);
+    }
+    std::memcpy(buffer + whole * unit, source, part.size - whole * unit);
+    return buffer;
+}
+
+// Where to reveal the payload bytes of a part to, the payload itself unless they need scatterPayload()
+template<size_t Bpp>
+u8* payloadTarget(u8* payload, const Part& part, u8* buffer)
+{
+    return part.stride == unitSize * Bpp / 8 ? payload + part.offset : buffer;
+}
+
+// Undo gatherPayload() into the payload after revealing to payloadTarget()
+template<size_t Bpp>
+void scatterPayload(const u8* buffer, const Part& part, u8* payload)
+{
+    constexpr size_t unit = unitSize * Bpp / 8;
+    if (part.stride == unit) {
+        return;
+    }
+    const size_t whole = part.size / unit;
+    u8* target = payload + part.offset;
+    for (size_t i = 0; i < whole; ++i, target += part.stride) {
+        std::memcpy(target, buffer + i * unit, unit);
+    }
+    std::memcpy(target, buffer + whole * unit, part.size - whole * unit);
+}
+
+}
+
+// Hide a message like ::hide<Bpp>(), but in the keyed order of the carrier bytes
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<void, std::string> hide(Image& plainsight, std::string_view message, u64 key, size_t threads = 1,
+                                      ChannelMask mask = channels::all)
+{
+    const size_t carrierSize = ::detail::carrierSize(plainsight, mask);
+    if (message.size() * 8 > carrierSize * Bpp) {
+        return std::unexpected(
+            std::format("Could not fit message ({} bytes) in image ({} bytes) using {} LSB",
+            message.size(), carrierSize, Bpp));
+    }
+
+    const detail::Layout layout(plainsight, mask, key);
+    const kernels::HideFn kernel = kernels::active(Bpp).hide[Bpp - 1];
+    const u8* payload = reinterpret_cast<const u8*>(message.data());
+
+    detail::forEachTile<Bpp>(layout, message.size(), threads, [&](detail::Scratch& scratch, const detail::Part& part) {
+        const size_t used = (part.size * 8 + Bpp - 1) / Bpp;
+        const auto [pixels, tileSize] = layout.tile(plainsight.data, part.tile);
+        u8* selected = layout.gather(pixels, tileSize, scratch.selected.data());
+        const u8* source = detail::gatherPayload<Bpp>(payload, part, scratch.payload.data());
+
+        layout.toOrder(part.tile, used, selected, scratch.ordered.data());
+        kernel(scratch.ordered.data(), source, part.size);
+        layout.fromOrder(part.tile, used, scratch.ordered.data(), selected);
+
+        layout.scatter(selected, tileSize, pixels);
+    });
+
+    return {};
+}
+
+// Extract a message hidden with keyed::hide<Bpp>() with the same key into `output`, returning the number of bytes
+// written
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<size_t, std::string> reveal(const Image& plainsight, size_t messageLength, std::span<u8> output,
+                                          u64 key, size_t threads = 1, ChannelMask mask = channels::all)
+{
+    const size_t carrierSize = ::detail::carrierSize(plainsight, mask);
+    if (messageLength * 8 > carrierSize * Bpp) {
+        return std::unexpected(
+            std::format("Can not extract message of {} bytes from image of {} bytes using {} LSB",
+                        messageLength, carrierSize, Bpp));
+    }
+    if (output.size() < messageLength) {
+        return std::unexpected(
+            std::format("Output of {} bytes is too small for message of {} bytes", output.size(), messageLength));
+    }
+
+    const detail::Layout layout(plainsight, mask, key);
+    const kernels::RevealFn kernel = kernels::active(Bpp).reveal[Bpp - 1];
+    const u8* data = plainsight.data;
+
+    detail::forEachTile<Bpp>(layout, messageLength, threads, [&](detail::Scratch& scratch, const detail::Part& part) {
+        const size_t used = (part.size * 8 + Bpp - 1) / Bpp;
+        const auto [pixels, tileSize] = layout.tile(data, part.tile);
+        const u8* selected = layout.gather(pixels, tileSize, scratch.selected.data());
+        u8* target = detail::payloadTarget<Bpp>(output.data(), part, scratch.payload.data());
+
+        layout.toOrder(part.tile, used, selected, scratch.ordered.data());
+        kernel(scratch.ordered.data(), target, part.size);
+        detail::scatterPayload<Bpp>(target, part, output.data());
+    });
+
+    return messageLength;
+}
+
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, u64 key,
+                                               size_t threads = 1, ChannelMask mask = channels::all)
+{
+    std::string message(messageLength, 0);
+    const std::span<u8> output(reinterpret_cast<u8*>(message.data()), messageLength);
+    auto result = reveal<Bpp>(plainsight, messageLength, output, key, threads, mask);
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+    return message;
+}
+
+inline std::expected<void, std::string> hide(Image& plainsight, std::string_view message, u64 key, size_t bpp = 1,
+                                             size_t threads = 1, ChannelMask mask = channels::all)
+{
+    return ::detail::withBpp(bpp, [&]<size_t Bpp>() { return hide<Bpp>(plainsight, message, key, threads, mask); });
+}
+
+inline std::expected<size_t, std::string> reveal(const Image& plainsight, size_t messageLength, std::span<u8> output,
+                                                 u64 key, size_t bpp = 1, size_t threads = 1,
+                                                 ChannelMask mask = channels::all)
+{
+    return ::detail::withBpp(bpp, [&]<size_t Bpp>() {
+        return reveal<Bpp>(plainsight, messageLength, output, key, threads, mask);
+    });
+}
+
+inline std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, u64 key,
+                                                      size_t bpp = 1, size_t threads = 1,
+                                                      ChannelMask mask = channels::all)
+{
+    return ::detail::withBpp(bpp, [&]<size_t Bpp>() {
+        return reveal<Bpp>(plainsight, messageLength, key, threads, mask);
+    });
+}
+
+}
+
+#endif // STEGANOGRAPHER_KEYED_HPP
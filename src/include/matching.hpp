@@ -0,0 +1,56 @@
+#ifndef STEGANOGRAPHER_MATCHING_HPP
+#define STEGANOGRAPHER_MATCHING_HPP
+
+#include "channels.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "kernels.hpp"
+#include "steganography.hpp"
+
+#include <algorithm>
+#include <expected>
+#include <format>
+#include <string>
+#include <string_view>
+
+
+// LSB matching: carrier bytes whose LSB is wrong get 1 added or subtracted at random instead of their LSB replaced.
+// Replacement only ever swaps values 2i and 2i + 1, which evens out their counts in the histogram and gives the
+// payload away. The LSBs end up the same, so reveal() at 1 bpp reads the message back.
+namespace matching {
+
+// Hide a message at 1 bpp like hide<1>(), by LSB matching with signs from a PRNG seeded with `seed`. Split over up
+// to `threads` threads (0 for one per hardware thread) and only using the bytes of the channels in `mask`.
+inline std::expected<void, std::string> hide(Image& plainsight, std::string_view message, u64 seed,
+                                             size_t threads = 1, ChannelMask mask = channels::all)
+{
+    const size_t carrierSize = ::detail::carrierSize(plainsight, mask);
+    if (message.size() * 8 > carrierSize) {
+        return std::unexpected(std::format("Could not fit message ({} bytes) in image ({} bytes) using LSB matching",
+                                           message.size(), carrierSize));
+    }
+
+    // Chunks and masked blocks start at multiples of 64 carrier bytes, the units the signs are drawn for
+    const kernels::MatchFn kernel = kernels::activeMatch();
+    const u8* payload = reinterpret_cast<const u8*>(message.data());
+    ::detail::forEachChunk(message.size(), threads, ::detail::chunkAlignment<1>(plainsight, mask),
+                           [&](size_t offset, size_t size) {
+        if (channels::isAll(mask, plainsight.channels)) {
+            kernel(plainsight.data + offset * 8, payload + offset, size, seed, offset / 8);
+            return;
+        }
+
+        ::detail::forEachMaskedBlock(plainsight.data, plainsight.channels,
+                                     channels::normalize(mask, plainsight.channels), offset * 8, size * 8,
+                                     [&](size_t done, u8* carrier, size_t count) {
+            const size_t start = done / 8;
+            kernel(carrier, payload + offset + start, std::min(count / 8, size - start), seed, (offset + start) / 8);
+        });
+    });
+
+    return {};
+}
+
+}
+
+#endif // STEGANOGRAPHER_MATCHING_HPP
@@ -0,0 +1,314 @@
+#ifndef STEGANOGRAPHER_MATRIX_HPP
+#define STEGANOGRAPHER_MATRIX_HPP
+
+#include "channels.hpp"
+#include "cpu.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "steganography.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
+#include <cstring>
+#include <expected>
+#include <format>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// Matrix embedding with [2^k - 1, k] Hamming codes: each block of 2^k - 1 carrier bytes holds k message bits as the
+// syndrome of its least significant bits, so hiding them changes at most one byte of the block instead of about half
+namespace matrix {
+
+inline constexpr size_t maxK = 16;
+
+// Carrier bytes per block
+constexpr size_t blockSize(size_t k)
+{
+    return (size_t{1} << k) - 1;
+}
+
+// Message bytes that fit in the carrier bytes of the channels in `mask`
+inline size_t capacity(const Image& plainsight, size_t k, ChannelMask mask = channels::all)
+{
+    return ::detail::carrierSize(plainsight, mask) / blockSize(k) * k / 8;
+}
+
+namespace detail {
+
+// Carrier bytes per batch, whose least significant bits are collected into one small buffer
+inline constexpr size_t batchBytes = 1 << 15;
+
+// Collect the least significant bit of `count` carrier bytes into a bit plane, bit i for byte i
+inline void lsbPlaneScalar(const u8* carrier, size_t count, u8* plane)
+{
+    for (size_t i = 0; i < count; i += 8) {
+        u8 bits = 0;
+        for (size_t j = 0; j < std::min<size_t>(8, count - i); ++j) {
+            bits |= (carrier[i + j] & 1) << j;
+        }
+        plane[i / 8] = bits;
+    }
+}
+
+#ifdef STEG_X86
+// Moving the least significant bit to the top of each byte lets movemask collect 16 or 32 of them at once
+STEG_TARGET("sse2")
+inline size_t lsbPlaneSse2(const u8* carrier, size_t count, u8* plane)
+{
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        const __m128i in = _mm_loadu_si128(reinterpret_cast<const __m128i*>(carrier + i));
+        const u16 bits = static_cast<u16>(_mm_movemask_epi8(_mm_slli_epi64(in, 7)));
+        std::memcpy(plane + i / 8, &bits, sizeof(bits));
+    }
+    return i;
+}
+
+STEG_TARGET("avx2")
+inline size_t lsbPlaneAvx2(const u8* carrier, size_t count, u8* plane)
+{
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        const __m256i in = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(carrier + i));
+        const u32 bits = static_cast<u32>(_mm256_movemask_epi8(_mm256_slli_epi64(in, 7)));
+        std::memcpy(plane + i / 8, &bits, sizeof(bits));
+    }
+    return i;
+}
+#endif
+
+inline void lsbPlane(const u8* carrier, size_t count, u8* plane)
+{
+    size_t done = 0;
+#ifdef STEG_X86
+    if (cpu::features().avx2) {
+        done = lsbPlaneAvx2(carrier, count, plane);
+    }
+    else if (cpu::features().sse2) {
+        done = lsbPlaneSse2(carrier, count, plane);
+    }
+#endif
+    lsbPlaneScalar(carrier + done, count - done, plane + done / 8);
+}
+
+// For each byte of a bit plane, the XOR of the indices of its set bits in bits 0-2 and their parity in bit 3
+constexpr std::array<u8, 256> makeSyndromeTable()
+{
+    std::array<u8, 256> table{};
+    for (size_t bits = 0; bits < 256; ++bits) {
+        u8 entry = 0;
+        for (u8 j = 0; j < 8; ++j) {
+            if ((bits >> j) & 1) {
+                entry ^= j | 8;
+            }
+        }
+        table[bits] = entry;
+    }
+    return table;
+}
+
+inline constexpr std::array<u8, 256> syndromeTable = makeSyndromeTable();
+
+// At least 56 bits of the plane from bit `bit` on. The plane needs 8 bytes of padding.
+inline u64 loadBits(const u8* plane, size_t bit)
+{
+    u64 word;
+    std::memcpy(&word, plane + bit / 8, sizeof(word));
+    return word >> (bit % 8);
+}
+
+// The syndrome of the block of n bits at bit `first` of the plane: the XOR of i + 1 for every set bit i. With a
+// zero bit in front of the block every bit is labeled by its position, and the table handles 8 positions at once.
+inline u32 syndrome(const u8* plane, size_t first, size_t n)
+{
+    if (n < 8) {
+        return syndromeTable[(loadBits(plane, first) << 1) & ((1u << (n + 1)) - 1)] & 7;
+    }
+
+    u32 result = 0;
+    for (size_t position = 0; position <= n; position += 56) {
+        u64 bits = position == 0 ? loadBits(plane, first) << 1 : loadBits(plane, first + position - 1);
+        const size_t count = std::min<size_t>(56, n + 1 - position);
+        bits &= (u64{1} << count) - 1;
+        for (size_t j = 0; j < count; j += 8) {
+            const u8 entry = syndromeTable[(bits >> j) & 0xFF];
+            result ^= (entry & 7) ^ (static_cast<u32>(position + j) & (0u - (entry >> 3)));
+        }
+    }
+    return result;
+}
+
+// The `count` <= 16 bits of a message from bit `bit` on, zero past its end
+inline u32 readBits(const u8* message, size_t size, size_t bit, size_t count)
+{
+    u32 bits = 0;
+    if (bit / 8 + sizeof(bits) <= size) {
+        std::memcpy(&bits, message + bit / 8, sizeof(bits));
+        return (bits >> (bit % 8)) & ((1u << count) - 1);
+    }
+    for (size_t i = 0; i < 3 && bit / 8 + i < size; ++i) {
+        bits |= static_cast<u32>(message[bit / 8 + i]) << (8 * i);
+    }
+    return (bits >> (bit % 8)) & ((1u << count) - 1);
+}
+
+// Write `count` bits to a zeroed message from bit `bit` on, dropping those past its end
+inline void writeBits(u8* message, size_t size, size_t bit, u32 bits, size_t count)
+{
+    for (size_t written = 0; written < count;) {
+        const size_t i = (bit + written) / 8;
+        if (i >= size) {
+            return;
+        }
+        const size_t shift = (bit + written) % 8;
+        message[i] |= static_cast<u8>(bits << shift);
+        bits >>= 8 - shift;
+        written += 8 - shift;
+    }
+}
+
+// The selected carrier byte at `index`, see forEachMaskedBlock()
+template<typename Pixel>
+Pixel* carrierByte(Pixel* data, int channelCount, ChannelMask mask, size_t index)
+{
+    const size_t perPixel = std::popcount(mask);
+    if (perPixel == static_cast<size_t>(channelCount)) {
+        return data + index;
+    }
+
+    size_t skip = index % perPixel;
+    int channel = 0;
+    for (;; ++channel) {
+        if (((mask >> channel) & 1) && skip-- == 0) {
+            break;
+        }
+    }
+    return data + index / perPixel * channelCount + channel;
+}
+
+// Call fn(first, count, plane) for batches of `count` blocks from block `begin` to `end`, with the least significant
+// bits of their carrier bytes in `plane`, starting with those of block `first`
+template<typename F>
+void forEachBatch(const Image& plainsight, ChannelMask mask, size_t k, size_t begin, size_t end, F&& fn)
+{
+    const size_t n = blockSize(k);
+    const size_t batchBlocks = std::max<size_t>(1, batchBytes / n);
+    std::vector<u8> plane((batchBlocks * n + 7) / 8 + 8);
+    const u8* data = plainsight.data;
+
+    for (size_t first = begin; first < end; first += batchBlocks) {
+        const size_t count = std::min(batchBlocks, end - first) * n;
+        if (channels::isAll(mask, plainsight.channels)) {
+            lsbPlane(data + first * n, count, plane.data());
+        }
+        else {
+            ::detail::forEachMaskedBlock(data, plainsight.channels, mask, first * n, count,
+                                         [&](size_t done, u8* carrier, size_t size) {
+                lsbPlane(carrier, size, plane.data() + done / 8);
+            });
+        }
+        fn(first, count / n, plane.data());
+    }
+}
+
+}
+
+// Hide a message with matrix embedding in the least significant bits of the bytes in the channels of `mask`, split
+// over up to `threads` threads (0 for one per hardware thread). Returns the number of carrier bytes changed.
+inline std::expected<size_t, std::string> hide(Image& plainsight, std::string_view message, size_t k = 3,
+                                               size_t threads = 1, ChannelMask mask = channels::all)
+{
+    if (k == 0 || k > maxK) {
+        return std::unexpected(std::format("Invalid Hamming code parameter k: {}, must be 1-{}", k, maxK));
+    }
+    if (message.size() > capacity(plainsight, k, mask)) {
+        return std::unexpected(
+            std::format("Could not fit message ({} bytes) in image ({} bytes) using matrix embedding with k = {}",
+                        message.size(), ::detail::carrierSize(plainsight, mask), k));
+    }
+
+    const size_t n = blockSize(k);
+    const size_t blocks = (message.size() * 8 + k - 1) / k;
+    const u8* payload = reinterpret_cast<const u8*>(message.data());
+    mask = channels::normalize(mask, plainsight.channels);
+
+    // Chunks of whole blocks and pixels, see chunkAlignment()
+    std::atomic<size_t> changed = 0;
+    ::detail::forEachChunk(blocks * n, threads, 8 * n * std::popcount(mask), [&](size_t offset, size_t size) {
+        size_t chunkChanged = 0;
+        detail::forEachBatch(plainsight, mask, k, offset / n, (offset + size) / n,
+                             [&](size_t first, size_t count, const u8* plane) {
+            for (size_t b = 0; b < count; ++b) {
+                const u32 bits = detail::readBits(payload, message.size(), (first + b) * k, k);
+                const u32 flip = detail::syndrome(plane, b * n, n) ^ bits;
+                if (flip != 0) {
+                    *detail::carrierByte(plainsight.data, plainsight.channels, mask, (first + b) * n + flip - 1) ^= 1;
+                    ++chunkChanged;
+                }
+            }
+        });
+        changed += chunkChanged;
+    });
+
+    return changed.load();
+}
+
+// Extract a message hidden with matrix::hide() into `output`, returning the number of bytes written
+inline std::expected<size_t, std::string> reveal(const Image& plainsight, size_t messageLength, std::span<u8> output,
+                                                 size_t k = 3, size_t threads = 1, ChannelMask mask = channels::all)
+{
+    if (k == 0 || k > maxK) {
+        return std::unexpected(std::format("Invalid Hamming code parameter k: {}, must be 1-{}", k, maxK));
+    }
+    if (messageLength > capacity(plainsight, k, mask)) {
+        return std::unexpected(
+            std::format("Can not extract message of {} bytes from image of {} bytes using matrix embedding with k = {}",
+                        messageLength, ::detail::carrierSize(plainsight, mask), k));
+    }
+    if (output.size() < messageLength) {
+        return std::unexpected(
+            std::format("Output of {} bytes is too small for message of {} bytes", output.size(), messageLength));
+    }
+
+    const size_t n = blockSize(k);
+    const size_t blocks = (messageLength * 8 + k - 1) / k;
+    std::fill_n(output.begin(), messageLength, u8{0});
+    mask = channels::normalize(mask, plainsight.channels);
+
+    // Chunks of a multiple of 8 blocks also end on a whole byte of the message
+    ::detail::forEachChunk(blocks * n, threads, 8 * n * std::popcount(mask), [&](size_t offset, size_t size) {
+        detail::forEachBatch(plainsight, mask, k, offset / n, (offset + size) / n,
+                             [&](size_t first, size_t count, const u8* plane) {
+            for (size_t b = 0; b < count; ++b) {
+                detail::writeBits(output.data(), messageLength, (first + b) * k, detail::syndrome(plane, b * n, n), k);
+            }
+        });
+    });
+
+    return messageLength;
+}
+
+inline std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, size_t k = 3,
+                                                      size_t threads = 1, ChannelMask mask = channels::all)
+{
+    std::string message(messageLength, 0);
+    const std::span<u8> output(reinterpret_cast<u8*>(message.data()), messageLength);
+    auto result = matrix::reveal(plainsight, messageLength, output, k, threads, mask);
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+    return message;
+}
+
+}
+
+#endif // STEGANOGRAPHER_MATRIX_HPP
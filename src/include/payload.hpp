@@ -0,0 +1,699 @@
+#ifndef STEGANOGRAPHER_PAYLOAD_HPP
+#define STEGANOGRAPHER_PAYLOAD_HPP
+
+#include "channels.hpp"
+#include "checksum.hpp"
+#include "cipher.hpp"
+#include "compression.hpp"
+#include "ecc.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "keyed.hpp"
+#include "matching.hpp"
+#include "matrix.hpp"
+#include "steganography.hpp"
+
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <expected>
+#include <format>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <span>
+#include <string>
+#include <string_view>
+#include <utility>
+
+
+// Payloads that describe themselves: a small header at the start of the image tells how the rest was hidden, so
+// revealing needs no options
+namespace payload {
+
+// How the message is transformed before it is hidden
+enum class Codec : u8 {
+    None = 0,
+    Rle8 = 1, // rle::compress() with u8 counts
+    Rle16 = 2,
+    Rle32 = 3,
+    Rle64 = 4,
+    RleVarint = 5, // rle::compress() with LEB128 counts
+    Packed = 6,    // rle::pack()
+};
+
+struct Header {
+    u64 length = 0; // Bytes hidden after the header, after applying the codec and error correction
+    u8 bpp = 1;
+    Codec codec = Codec::None;
+    ChannelMask channels = channels::all; // Normalized for the image
+    bool keyed = false;                   // Hidden in a keyed order with keyed::hide()
+    bool matching = false;                // Hidden by LSB matching with matching::hide()
+    bool encrypted = false;               // Encrypted and authenticated after the codec with cipher::encrypt()
+    bool shard = false;                   // Holds one shard of a message split with shards::hide()
+    std::optional<ecc::Params> ecc;       // Applied after the codec and encryption with ecc::encode()
+    u8 matrix = 0;                        // k of matrix::hide(), 0 for LSB replacement
+    u32 crc = 0;                          // CRC-32C of the message after the codec and encryption
+};
+
+// Layout: magic "STG", version, length (u64 little endian), bpp, codec, channels, flags, ECC block size and parity
+// (0 without ECC), matrix embedding k, CRC-32C (u32 little endian), then Reed-Solomon parity so the header survives a
+// few flipped bits
+inline constexpr u8 keyedFlag = 1;
+inline constexpr u8 matchingFlag = 2;
+inline constexpr u8 encryptedFlag = 4;
+inline constexpr u8 shardFlag = 8;
+inline constexpr std::array<u8, 3> magic = {'S', 'T', 'G'};
+inline constexpr u8 version = 3;
+inline constexpr size_t headerDataSize = 23;
+inline constexpr size_t headerSize = 36;
+
+// How to hide a payload, the header is filled in from these
+struct Options {
+    size_t bpp = 1;
+    Codec codec = Codec::None;
+    ChannelMask channels = channels::all;
+    size_t threads = 1;
+    std::optional<u64> key; // Hide in the keyed order for this key, see keyed::deriveKey(). With matching, it only
+                            // keys the signs of the changes and the order stays sequential.
+    std::optional<ecc::Params> ecc;
+    size_t matrix = 0;     // Hide with matrix::hide() and this k, which only uses the least significant bit
+    bool matching = false; // Hide with matching::hide(), which only uses the least significant bit
+    std::optional<std::string> encryption; // Encrypt with a key derived from this passphrase, see cipher::encrypt()
+    bool shard = false; // Mark the message as a shard of shards::hide(), which reveal() refuses on its own
+};
+
+// The codec for RLE with countBytes bytes per run count, 0 for LEB128 counts of as many bytes as each needs
+constexpr Codec rleCodec(u32 countBytes)
+{
+    switch (countBytes) {
+    case 0:
+        return Codec::RleVarint;
+    case 1:
+        return Codec::Rle8;
+    case 2:
+        return Codec::Rle16;
+    case 4:
+        return Codec::Rle32;
+    case 8:
+        return Codec::Rle64;
+    }
+    return Codec::None;
+}
+
+// Apply a codec to a message
+inline std::string encode(std::string_view data, Codec codec)
+{
+    switch (codec) {
+    case Codec::None:
+        break;
+    case Codec::Rle8:
+        return rle::compress<u8>(data);
+    case Codec::Rle16:
+        return rle::compress<u16>(data);
+    case Codec::Rle32:
+        return rle::compress<u32>(data);
+    case Codec::Rle64:
+        return rle::compress<u64>(data);
+    case Codec::RleVarint:
+        return rle::compress<rle::Varint>(data);
+    case Codec::Packed:
+        return rle::pack(data);
+    }
+    return std::string(data);
+}
+
+// Undo encode() with the same codec, or tell why the data is not something it encoded
+inline std::expected<std::string, std::string> decode(std::string_view data, Codec codec)
+{
+    switch (codec) {
+    case Codec::None:
+        break;
+    case Codec::Rle8:
+        return rle::extract<u8>(data);
+    case Codec::Rle16:
+        return rle::extract<u16>(data);
+    case Codec::Rle32:
+        return rle::extract<u32>(data);
+    case Codec::Rle64:
+        return rle::extract<u64>(data);
+    case Codec::RleVarint:
+        return rle::extract<rle::Varint>(data);
+    case Codec::Packed:
+        return rle::unpack(data);
+    }
+    return std::string(data);
+}
+
+// Number of bytes decode() produces, or why the data can not be decoded
+inline std::expected<size_t, std::string> decodedSize(std::string_view data, Codec codec)
+{
+    switch (codec) {
+    case Codec::None:
+        break;
+    case Codec::Rle8:
+        return rle::extractedSize<u8>(data);
+    case Codec::Rle16:
+        return rle::extractedSize<u16>(data);
+    case Codec::Rle32:
+        return rle::extractedSize<u32>(data);
+    case Codec::Rle64:
+        return rle::extractedSize<u64>(data);
+    case Codec::RleVarint:
+        return rle::extractedSize<rle::Varint>(data);
+    case Codec::Packed:
+        return rle::unpackedSize(data);
+    }
+    return data.size();
+}
+
+// Undo encode() into a buffer, from byte `skip` of the decoded message on. Returns how many bytes were written.
+inline size_t decode(std::string_view data, Codec codec, std::span<char> output, size_t skip = 0)
+{
+    switch (codec) {
+    case Codec::None:
+        break;
+    case Codec::Rle8:
+        return rle::extract<u8>(data, output, skip);
+    case Codec::Rle16:
+        return rle::extract<u16>(data, output, skip);
+    case Codec::Rle32:
+        return rle::extract<u32>(data, output, skip);
+    case Codec::Rle64:
+        return rle::extract<u64>(data, output, skip);
+    case Codec::RleVarint:
+        return rle::extract<rle::Varint>(data, output, skip);
+    case Codec::Packed:
+        return rle::unpack(data, output, skip);
+    }
+    const std::string_view rest = data.substr(std::min(skip, data.size()));
+    const size_t size = std::min(output.size(), rest.size());
+    std::copy_n(rest.data(), size, output.data());
+    return size;
+}
+
+inline std::array<u8, headerSize> encodeHeader(const Header& header)
+{
+    std::array<u8, headerSize> result{};
+    std::copy(magic.begin(), magic.end(), result.begin());
+    result[3] = version;
+    for (size_t i = 0; i < 8; ++i) {
+        result[4 + i] = static_cast<u8>(header.length >> (8 * i));
+    }
+    result[12] = header.bpp;
+    result[13] = static_cast<u8>(header.codec);
+    result[14] = header.channels;
+    result[15] = (header.keyed ? keyedFlag : 0) | (header.matching ? matchingFlag : 0)
+                 | (header.encrypted ? encryptedFlag : 0) | (header.shard ? shardFlag : 0);
+    result[16] = header.ecc ? header.ecc->blockSize : 0;
+    result[17] = header.ecc ? header.ecc->parity : 0;
+    result[18] = header.matrix;
+    for (size_t i = 0; i < 4; ++i) {
+        result[19 + i] = static_cast<u8>(header.crc >> (8 * i));
+    }
+
+    const auto gen = ecc::detail::generator(headerSize - headerDataSize);
+    ecc::detail::encodeScalar(result.data(), headerDataSize, gen, result.data() + headerDataSize, 1);
+    return result;
+}
+
+inline std::expected<Header, std::string> decodeHeader(std::span<const u8, headerSize> received)
+{
+    std::array<u8, headerSize> bytes;
+    std::copy(received.begin(), received.end(), bytes.begin());
+    std::array<u8, headerSize - headerDataSize> syndromes;
+    if (ecc::detail::syndromesScalar(bytes.data(), headerSize, syndromes.size(), 1, syndromes.data())
+        && !ecc::detail::correct(bytes.data(), headerSize, syndromes.size(), 1, syndromes.data())) {
+        return std::unexpected("No hidden payload header found");
+    }
+
+    if (!std::equal(magic.begin(), magic.end(), bytes.begin())) {
+        return std::unexpected("No hidden payload header found");
+    }
+    if (bytes[3] != version) {
+        return std::unexpected(std::format("Unsupported payload header version {}", bytes[3]));
+    }
+
+    Header header;
+    for (size_t i = 0; i < 8; ++i) {
+        header.length |= static_cast<u64>(bytes[4 + i]) << (8 * i);
+    }
+    header.bpp = bytes[12];
+    header.codec = static_cast<Codec>(bytes[13]);
+    header.channels = bytes[14];
+    header.keyed = bytes[15] & keyedFlag;
+    header.matching = bytes[15] & matchingFlag;
+    header.encrypted = bytes[15] & encryptedFlag;
+    header.shard = bytes[15] & shardFlag;
+    if (bytes[17] != 0) {
+        header.ecc = ecc::Params{.blockSize = bytes[16], .parity = bytes[17]};
+    }
+    header.matrix = bytes[18];
+    for (size_t i = 0; i < 4; ++i) {
+        header.crc |= static_cast<u32>(bytes[19 + i]) << (8 * i);
+    }
+
+    if (header.bpp < 1 || header.bpp > 8) {
+        return std::unexpected(std::format("Invalid bpp {} in payload header", header.bpp));
+    }
+    if (header.codec > Codec::Packed) {
+        return std::unexpected(std::format("Unknown codec {} in payload header", bytes[13]));
+    }
+    if (bytes[15] & ~(keyedFlag | matchingFlag | encryptedFlag | shardFlag)) {
+        return std::unexpected(std::format("Unknown flags {:#x} in payload header", bytes[15]));
+    }
+    if (header.ecc && !ecc::validate(*header.ecc)) {
+        return std::unexpected(std::format("Invalid error correction with {} parity bytes in blocks of {} bytes in "
+                                           "payload header",
+                                           bytes[17], bytes[16]));
+    }
+    if (header.matching && (header.bpp != 1 || header.keyed || header.matrix)) {
+        return std::unexpected("Invalid LSB matching in payload header");
+    }
+    if (header.matrix > matrix::maxK || (header.matrix && (header.bpp != 1 || header.keyed))) {
+        return std::unexpected(std::format("Invalid matrix embedding with k = {} in payload header", bytes[18]));
+    }
+    return header;
+}
+
+namespace detail {
+
+// The header is hidden at 1 bpp in the color channels, leaving alpha alone
+inline ChannelMask headerChannels(int channelCount)
+{
+    const bool alpha = channelCount == 2 || channelCount == 4;
+    return channels::normalize(channels::all, alpha ? channelCount - 1 : channelCount);
+}
+
+// Number of pixels at the start of the image that hold the header
+inline size_t headerPixels(int channelCount)
+{
+    const size_t perPixel = std::popcount(headerChannels(channelCount));
+    return (headerSize * 8 + perPixel - 1) / perPixel;
+}
+
+// The pixels holding the header, or the ones after them holding the payload, as an image without its own data
+inline std::expected<Image, std::string> region(const Image& plainsight, bool header)
+{
+    const size_t pixels = static_cast<size_t>(plainsight.x) * plainsight.y;
+    const size_t reserved = headerPixels(plainsight.channels);
+    if (pixels < reserved) {
+        return std::unexpected(
+            std::format("Image of {} pixels is too small for a payload header of {} pixels", pixels, reserved));
+    }
+
+    Image result;
+    result.x = static_cast<int>(header ? reserved : pixels - reserved);
+    result.y = 1;
+    result.channels = plainsight.channels;
+    result.data = plainsight.data + (header ? 0 : reserved * plainsight.channels);
+    return result;
+}
+
+inline std::expected<void, std::string> writeHeader(Image& plainsight, const Header& header)
+{
+    auto headerRegion = region(plainsight, true);
+    if (!headerRegion) {
+        return std::unexpected(headerRegion.error());
+    }
+
+    const auto bytes = encodeHeader(header);
+    const std::string_view message(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+    return ::hide<1>(*headerRegion, message, 1, headerChannels(plainsight.channels));
+}
+
+inline std::string mismatch(u32 crc, u32 expected)
+{
+    return std::format("The revealed payload is damaged or was not hidden like the header says: its CRC-32C is "
+                       "{:#010x} instead of {:#010x}",
+                       crc, expected);
+}
+
+// Check a revealed message, after error correction and before it is decrypted and its codec is undone, against the
+// CRC in its header. The CRC of a ciphertext tells nothing about its plaintext.
+inline std::expected<void, std::string> check(std::string_view message, const Header& header, size_t threads)
+{
+    if (const u32 crc = checksum::crc32c(message, threads); crc != header.crc) {
+        return std::unexpected(mismatch(crc, header.crc));
+    }
+    return {};
+}
+
+}
+
+// Read the header of a payload hidden with hide() or hideStream()
+inline std::expected<Header, std::string> readHeader(const Image& plainsight)
+{
+    auto headerRegion = detail::region(plainsight, true);
+    if (!headerRegion) {
+        return std::unexpected(headerRegion.error());
+    }
+
+    std::array<u8, headerSize> bytes;
+    auto result = ::reveal<1>(*headerRegion, headerSize, bytes, 1, detail::headerChannels(plainsight.channels));
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+
+    auto header = decodeHeader(bytes);
+    if (!header) {
+        return header;
+    }
+
+    // Checked here so a damaged header can not make reveal() allocate more than the image could hold
+    const auto body = detail::region(plainsight, false);
+    const size_t capacity = header->matrix ? matrix::capacity(*body, header->matrix, header->channels)
+                                           : ::detail::carrierSize(*body, header->channels) * header->bpp / 8;
+    if (header->length > capacity) {
+        return std::unexpected(std::format("Payload header claims {} bytes, but the image can only hold {}",
+                                           header->length, capacity));
+    }
+    return header;
+}
+
+// Bytes of message that fit after the header in an image of x * y pixels with channelCount channels when hidden with
+// these options, less what encryption adds. Codecs can change the size of the message, so this is before the codec.
+inline size_t capacity(int x, int y, int channelCount, const Options& options = {})
+{
+    const size_t pixels = static_cast<size_t>(x) * y;
+    const size_t reserved = detail::headerPixels(channelCount);
+    if (pixels <= reserved) {
+        return 0;
+    }
+
+    const size_t carrierSize = (pixels - reserved) * std::popcount(channels::normalize(options.channels, channelCount));
+    const size_t hidden = options.matrix ? carrierSize / matrix::blockSize(options.matrix) * options.matrix / 8
+                                         : carrierSize * options.bpp / 8;
+    const size_t data = options.ecc ? ecc::dataCapacity(hidden, *options.ecc) : hidden;
+    if (options.encryption) {
+        return data > cipher::overhead ? data - cipher::overhead : 0;
+    }
+    return data;
+}
+
+// Hide a message after a header describing how it was hidden, returning the header
+inline std::expected<Header, std::string> hide(Image& plainsight, std::string_view message,
+                                               const Options& options = {})
+{
+    auto body = detail::region(plainsight, false);
+    if (!body) {
+        return std::unexpected(body.error());
+    }
+
+    if (options.ecc) {
+        if (auto valid = ecc::validate(*options.ecc); !valid) {
+            return std::unexpected(valid.error());
+        }
+    }
+    if (options.matrix && (options.bpp != 1 || options.key)) {
+        return std::unexpected("Matrix embedding only uses the least significant bit in sequential order, it needs "
+                               "bpp 1 and no key");
+    }
+    if (options.matching && (options.bpp != 1 || options.matrix)) {
+        return std::unexpected("LSB matching only uses the least significant bit in sequential order, it needs bpp 1 "
+                               "and no matrix embedding");
+    }
+
+    std::string encoded = encode(message, options.codec);
+    if (options.encryption) {
+        encoded = cipher::encrypt(encoded, *options.encryption, options.threads);
+    }
+    const u32 crc = checksum::crc32c(encoded, options.threads);
+    if (options.ecc) {
+        encoded = ecc::encode(encoded, *options.ecc, options.threads);
+    }
+    std::expected<void, std::string> result;
+    if (options.matrix) {
+        auto changed = matrix::hide(*body, encoded, options.matrix, options.threads, options.channels);
+        if (!changed) {
+            result = std::unexpected(changed.error());
+        }
+    }
+    else if (options.matching) {
+        // reveal() does not use the signs, they only need to look random. Drawn from the key and the CRC, which
+        // covers the salt and nonce of an encrypted payload, the same payload and key always change the carrier the
+        // same way, and without the key the signs can not be predicted.
+        const u64 drawn = keyed::detail::mix((static_cast<u64>(crc) << 32) ^ encoded.size());
+        const u64 seed = keyed::detail::mix(options.key.value_or(0) ^ drawn);
+        result = matching::hide(*body, encoded, seed, options.threads, options.channels);
+    }
+    else if (options.key) {
+        result = keyed::hide(*body, encoded, *options.key, options.bpp, options.threads, options.channels);
+    }
+    else {
+        result = ::hide(*body, encoded, options.bpp, options.threads, options.channels);
+    }
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+
+    const Header header{
+        .length = encoded.size(),
+        .bpp = static_cast<u8>(options.bpp),
+        .codec = options.codec,
+        .channels = channels::normalize(options.channels, plainsight.channels),
+        .keyed = options.key.has_value() && !options.matching,
+        .matching = options.matching,
+        .encrypted = options.encryption.has_value(),
+        .shard = options.shard,
+        .ecc = options.ecc,
+        .matrix = static_cast<u8>(options.matrix),
+        .crc = crc,
+    };
+    if (auto written = detail::writeHeader(plainsight, header); !written) {
+        return std::unexpected(written.error());
+    }
+    return header;
+}
+
+// Hide everything that can be read from a stream after a header, written once the length is known. Codecs and
+// keyed orders, encryption, error correction, matrix embedding and LSB matching need the whole message, so
+// options.codec must be None, options.key, options.encryption and options.ecc empty, options.matrix 0 and
+// options.matching and options.shard false. A stream that can seek is checked against the capacity before anything
+// is written. One that can not, like a pipe, is only measured as it is read, so when it does not fit the carrier body
+// is left partly overwritten under its old header.
+inline std::expected<Header, std::string> hideStream(Image& plainsight, std::istream& input,
+                                                     const Options& options = {})
+{
+    if (options.codec != Codec::None) {
+        return std::unexpected("Can not apply a codec to a streamed payload");
+    }
+    if (options.key) {
+        return std::unexpected("Can not hide a streamed payload in a keyed order");
+    }
+    if (options.ecc) {
+        return std::unexpected("Can not add error correction to a streamed payload");
+    }
+    if (options.matrix) {
+        return std::unexpected("Can not hide a streamed payload with matrix embedding");
+    }
+    if (options.matching) {
+        return std::unexpected("Can not hide a streamed payload by LSB matching");
+    }
+    if (options.encryption) {
+        return std::unexpected("Can not encrypt a streamed payload");
+    }
+    if (options.shard) {
+        return std::unexpected("Can not hide a shard as a streamed payload");
+    }
+    auto body = detail::region(plainsight, false);
+    if (!body) {
+        return std::unexpected(body.error());
+    }
+    const size_t fits = capacity(plainsight.x, plainsight.y, plainsight.channels, options);
+    if (const auto size = ::detail::remaining(input); size && *size > fits) {
+        return std::unexpected(std::format("Could not fit message ({} bytes) in image ({} bytes)", *size, fits));
+    }
+
+    u32 crc = 0;
+    const PayloadReader read = [&](u8* buffer, size_t size) {
+        input.read(reinterpret_cast<char*>(buffer), static_cast<std::streamsize>(size));
+        const size_t count = static_cast<size_t>(input.gcount());
+        crc = checksum::crc32c(buffer, count, crc);
+        return count;
+    };
+    auto length = ::hideStream(*body, read, options.bpp, options.channels);
+    if (!length) {
+        return std::unexpected(length.error());
+    }
+
+    const Header header{
+        .length = *length,
+        .bpp = static_cast<u8>(options.bpp),
+        .codec = Codec::None,
+        .channels = channels::normalize(options.channels, plainsight.channels),
+        .crc = crc,
+    };
+    if (auto written = detail::writeHeader(plainsight, header); !written) {
+        return std::unexpected(written.error());
+    }
+    return header;
+}
+
+namespace detail {
+
+// Everything reveal() does but undoing the codec. Returns the header with the still encoded message.
+inline std::expected<std::pair<Header, std::string>, std::string>
+revealEncoded(const Image& plainsight, size_t threads, std::optional<u64> key,
+              const std::optional<std::string>& passphrase)
+{
+    const auto header = readHeader(plainsight);
+    if (!header) {
+        return std::unexpected(header.error());
+    }
+    if (header->keyed && !key) {
+        return std::unexpected("The payload is hidden in a keyed order, it needs a key to reveal");
+    }
+    if (header->encrypted && !passphrase) {
+        return std::unexpected("The payload is encrypted, it needs a passphrase to reveal");
+    }
+    auto body = detail::region(plainsight, false);
+
+    std::string message(header->length, 0);
+    const std::span<u8> output(reinterpret_cast<u8*>(message.data()), message.size());
+    auto result =
+        header->matrix ? matrix::reveal(*body, header->length, output, header->matrix, threads, header->channels)
+        : header->keyed ? keyed::reveal(*body, header->length, output, *key, header->bpp, threads, header->channels)
+                        : ::reveal(*body, header->length, output, header->bpp, threads, header->channels);
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+
+    if (header->ecc) {
+        auto corrected = ecc::decode(message, *header->ecc, threads);
+        if (!corrected) {
+            return std::unexpected(corrected.error());
+        }
+        message = std::move(*corrected);
+    }
+    if (auto checked = detail::check(message, *header, threads); !checked) {
+        return std::unexpected(checked.error());
+    }
+    if (header->encrypted) {
+        auto decrypted = cipher::decrypt(message, *passphrase, threads);
+        if (!decrypted) {
+            return std::unexpected(decrypted.error());
+        }
+        message = std::move(*decrypted);
+    }
+    return std::pair(*header, std::move(message));
+}
+
+// A shard starts with its index, data shard count and parity shard count after 4 bytes, see shards::encodeHeader()
+inline std::string shardError(std::string_view shard)
+{
+    if (shard.size() < 10) {
+        return "The image holds a shard of a message split over several images, pass all images";
+    }
+    const auto get = [&](size_t at) { return static_cast<u8>(shard[at]) | static_cast<u8>(shard[at + 1]) << 8; };
+    return std::format("The image holds shard {} of {}, pass all images", get(4), get(6) + get(8));
+}
+
+}
+
+// Extract a payload hidden with hide() or hideStream() in one pass into an exactly sized buffer, correct errors,
+// check it against its CRC, decrypt it and undo its codec.
+// Payloads hidden in a keyed order need the same key, encrypted ones the same passphrase. A shard of shards::hide()
+// is refused, it is only part of the message.
+inline std::expected<std::string, std::string> reveal(const Image& plainsight, size_t threads = 1,
+                                                      std::optional<u64> key = {},
+                                                      const std::optional<std::string>& passphrase = {})
+{
+    auto revealed = detail::revealEncoded(plainsight, threads, key, passphrase);
+    if (!revealed) {
+        return std::unexpected(revealed.error());
+    }
+    auto& [header, message] = *revealed;
+    if (header.shard) {
+        return std::unexpected(detail::shardError(message));
+    }
+    if (header.codec != Codec::None) {
+        return decode(message, header.codec);
+    }
+    return std::move(message);
+}
+
+// Extract a payload holding an image encoded with Image::encodeString(), like reveal(). A compressed image is
+// expanded straight into its pixels instead of into a string that is then copied.
+inline std::expected<Image, std::string> revealImage(const Image& plainsight, size_t threads = 1,
+                                                     std::optional<u64> key = {},
+                                                     const std::optional<std::string>& passphrase = {})
+{
+    auto revealed = detail::revealEncoded(plainsight, threads, key, passphrase);
+    if (!revealed) {
+        return std::unexpected(revealed.error());
+    }
+    const auto& [header, message] = *revealed;
+    if (header.shard) {
+        return std::unexpected(detail::shardError(message));
+    }
+    if (header.codec == Codec::None) {
+        return Image::decodeString(message);
+    }
+
+    const auto total = decodedSize(message, header.codec);
+    if (!total) {
+        return std::unexpected(total.error());
+    }
+    std::array<char, 12> size{};
+    if (decode(message, header.codec, size) < size.size()) {
+        return std::unexpected("Not enough data in string for image size");
+    }
+    const auto dimensions = Image::decodeHeader(std::string_view(size.data(), size.size()));
+    if (!dimensions) {
+        return std::unexpected(dimensions.error());
+    }
+    if (*total - size.size() < dimensions->size()) {
+        return std::unexpected("Not enough data in string to decode image");
+    }
+    Image result(dimensions->x, dimensions->y, dimensions->channels);
+    decode(message, header.codec, std::span(reinterpret_cast<char*>(result.data), result.size()), size.size());
+    return result;
+}
+
+// Extract a payload hidden with hide() or hideStream() to a stream, without holding all of it unless it has a codec,
+// a keyed order, encryption, error correction or matrix embedding
+inline std::expected<Header, std::string> revealStream(const Image& plainsight, std::ostream& output,
+                                                       size_t threads = 1, std::optional<u64> key = {},
+                                                       const std::optional<std::string>& passphrase = {})
+{
+    const auto header = readHeader(plainsight);
+    if (!header) {
+        return std::unexpected(header.error());
+    }
+
+    if (header->codec != Codec::None || header->keyed || header->encrypted || header->ecc || header->matrix
+        || header->shard) {
+        auto message = payload::reveal(plainsight, threads, key, passphrase);
+        if (!message) {
+            return std::unexpected(message.error());
+        }
+        if (!(output << *message)) {
+            return std::unexpected("Could not write the extracted message");
+        }
+        return header;
+    }
+
+    // Written before it can be checked, a mismatch is reported once it all is
+    u32 crc = 0;
+    const PayloadWriter write = [&](const u8* data, size_t size) {
+        crc = checksum::crc32c(data, size, crc);
+        output.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    auto body = detail::region(plainsight, false);
+    auto result = ::revealStream(*body, header->length, write, header->bpp, header->channels);
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+    if (!output) {
+        return std::unexpected("Could not write the extracted message");
+    }
+    if (crc != header->crc) {
+        return std::unexpected(detail::mismatch(crc, header->crc));
+    }
+    return header;
+}
+
+}
+
+#endif // STEGANOGRAPHER_PAYLOAD_HPP
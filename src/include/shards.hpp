@@ -0,0 +1,496 @@
+#ifndef STEGANOGRAPHER_SHARDS_HPP
+#define STEGANOGRAPHER_SHARDS_HPP
+
+#include "ecc.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "payload.hpp"
+#include "thread_pool.hpp"
+
+#include <algorithm>
+#include <array>
+#include <expected>
+#include <format>
+#include <optional>
+#include <random>
+#include <span>
+#include <string>
+#include <string_view>
+#include <vector>
+
+
+// Payloads split over several carrier images. Each image holds a payload (see payload::hide()) made of a small shard
+// header and its slice of the message after its codec, so capacity adds up over the images and every image is
+// handled by its own task on the thread pool. With parity shards, the slices all have the same size and the message
+// can be put back together from any `count` of the images (see ecc::combineShards()).
+namespace shards {
+
+struct Header {
+    u32 set = 0;    // Random, the same for all shards of one message
+    u16 index = 0;  // Data shards first, then parity shards
+    u16 count = 0;  // Data shards
+    u16 parity = 0; // Parity shards
+    u64 offset = 0; // Where the slice of this shard starts in the message, 0 with parity shards
+    u64 total = 0;  // Bytes in the whole message after its codec
+    // Applied to the whole message before it was split
+    payload::Codec codec = payload::Codec::None;
+};
+
+// Layout: set, index, count, parity, offset and total, all little endian, then the codec
+inline constexpr size_t headerSize = 27;
+
+// Bytes of each shard of a message with parity shards, the last data shards are padded with zeroes
+constexpr size_t erasureSize(u64 total, size_t count)
+{
+    return static_cast<size_t>((total + count - 1) / count);
+}
+
+inline std::array<u8, headerSize> encodeHeader(const Header& header)
+{
+    std::array<u8, headerSize> result{};
+    const auto put = [&](size_t at, u64 value, size_t bytes) {
+        for (size_t i = 0; i < bytes; ++i) {
+            result[at + i] = static_cast<u8>(value >> (8 * i));
+        }
+    };
+    put(0, header.set, 4);
+    put(4, header.index, 2);
+    put(6, header.count, 2);
+    put(8, header.parity, 2);
+    put(10, header.offset, 8);
+    put(18, header.total, 8);
+    put(26, static_cast<u8>(header.codec), 1);
+    return result;
+}
+
+// Read the header at the start of a revealed shard
+inline std::expected<Header, std::string> decodeHeader(std::string_view shard)
+{
+    if (shard.size() < headerSize) {
+        return std::unexpected(std::format("Shard of {} bytes is too small for a shard header", shard.size()));
+    }
+    const auto get = [&](size_t at, size_t bytes) {
+        u64 value = 0;
+        for (size_t i = 0; i < bytes; ++i) {
+            value |= static_cast<u64>(static_cast<u8>(shard[at + i])) << (8 * i);
+        }
+        return value;
+    };
+
+    const Header header{
+        .set = static_cast<u32>(get(0, 4)),
+        .index = static_cast<u16>(get(4, 2)),
+        .count = static_cast<u16>(get(6, 2)),
+        .parity = static_cast<u16>(get(8, 2)),
+        .offset = get(10, 8),
+        .total = get(18, 8),
+        .codec = static_cast<payload::Codec>(get(26, 1)),
+    };
+    const size_t size = shard.size() - headerSize;
+    const bool valid = header.parity == 0
+                           ? header.index < header.count && header.offset <= header.total
+                                 && size <= header.total - header.offset
+                           : header.count > 0 && header.index < header.count + header.parity
+                                 && header.count + header.parity <= ecc::maxShards && header.offset == 0
+                                 && size == erasureSize(header.total, header.count);
+    if (!valid || header.codec > payload::Codec::Packed) {
+        return std::unexpected("Invalid shard header");
+    }
+    return header;
+}
+
+namespace detail {
+
+// Image dimensions, known before the pixels are
+struct Layout {
+    int x = 0;
+    int y = 0;
+    int channels = 0;
+};
+
+// The headers for splitting `total` bytes of a message after the codec of options over carriers, the last `parity` of
+// which hold parity shards. Without parity shards the slices are in proportion to what each carrier can hold, with
+// them they all have the same size.
+inline std::expected<std::vector<Header>, std::string> plan(size_t total, std::span<const Layout> layouts,
+                                                            const payload::Options& options, size_t parity)
+{
+    if (layouts.size() <= parity || layouts.size() > (parity ? ecc::maxShards : 0xFFFF)) {
+        return std::unexpected(
+            std::format("Can not split a message over {} images with {} parity images", layouts.size(), parity));
+    }
+    const size_t count = layouts.size() - parity;
+
+    std::vector<size_t> capacities;
+    size_t capacity = 0;
+    for (const Layout& layout : layouts) {
+        const size_t bytes = payload::capacity(layout.x, layout.y, layout.channels, options);
+        capacities.push_back(bytes > headerSize ? bytes - headerSize : 0);
+        capacity += capacities.back();
+    }
+
+    std::random_device random;
+    const u32 set = random();
+    std::vector<Header> headers;
+    if (parity > 0) {
+        const size_t size = erasureSize(total, count);
+        const size_t smallest = *std::min_element(capacities.begin(), capacities.end());
+        if (size > smallest) {
+            return std::unexpected(std::format("Could not fit message ({} bytes) in {} images with {} parity images, "
+                                               "each needs {} bytes but one only fits {}",
+                                               total, layouts.size(), parity, size, smallest));
+        }
+        for (size_t i = 0; i < layouts.size(); ++i) {
+            headers.push_back({.set = set,
+                               .index = static_cast<u16>(i),
+                               .count = static_cast<u16>(count),
+                               .parity = static_cast<u16>(parity),
+                               .total = total,
+                               .codec = options.codec});
+        }
+        return headers;
+    }
+
+    if (total > capacity) {
+        return std::unexpected(std::format("Could not fit message ({} bytes) in {} images ({} bytes)", total,
+                                           layouts.size(), capacity));
+    }
+    u64 offset = 0;
+    u64 available = capacity;
+    for (size_t i = 0; i < layouts.size(); ++i) {
+        // Share what is left among what is left, rounding up so that the last carriers are never overfilled
+        const u64 remaining = total - offset;
+        const size_t size = available == 0 ? 0
+                                           : std::min<u64>(capacities[i],
+                                                           (remaining * capacities[i] + available - 1) / available);
+        headers.push_back({.set = set,
+                           .index = static_cast<u16>(i),
+                           .count = static_cast<u16>(count),
+                           .offset = offset,
+                           .total = total,
+                           .codec = options.codec});
+        offset += size;
+        available -= capacities[i];
+    }
+    return headers;
+}
+
+// The shards of a message, each built by the task that hides it so that parity is computed alongside the embedding
+// and saving of the other carriers
+class Splitter {
+  public:
+    Splitter(std::string_view message, std::vector<Header> headers) : message(message), headers(std::move(headers))
+    {
+        const Header& first = this->headers.front();
+        if (first.parity == 0) {
+            return;
+        }
+
+        // Data shards past the end of the message are padded with zeroes in a copy of its tail
+        const size_t size = erasureSize(first.total, first.count);
+        const size_t whole = size == 0 ? first.count : message.size() / size;
+        tail.assign((first.count - whole) * size, 0);
+        std::copy(message.begin() + static_cast<ptrdiff_t>(whole * size), message.end(), tail.begin());
+        for (size_t d = 0; d < first.count; ++d) {
+            data.push_back(d < whole ? reinterpret_cast<const u8*>(message.data()) + d * size
+                                     : tail.data() + (d - whole) * size);
+        }
+    }
+
+    size_t size() const { return headers.size(); }
+
+    // The header and slice of shard i
+    std::string shard(size_t i) const
+    {
+        const Header& header = headers[i];
+        const auto prefix = encodeHeader(header);
+        std::string result(prefix.begin(), prefix.end());
+        if (header.parity == 0) {
+            const size_t end = i + 1 < headers.size() ? headers[i + 1].offset : header.total;
+            result.append(message.substr(header.offset, end - header.offset));
+            return result;
+        }
+
+        const size_t size = erasureSize(header.total, header.count);
+        result.resize(headerSize + size);
+        u8* out = reinterpret_cast<u8*>(result.data()) + headerSize;
+        if (i < header.count) {
+            std::copy_n(data[i], size, out);
+        }
+        else {
+            ecc::combineShards(data, ecc::parityRow(i - header.count, header.count), size, out);
+        }
+        return result;
+    }
+
+  private:
+    std::string_view message;
+    std::vector<Header> headers;
+    std::vector<u8> tail;
+    std::vector<const u8*> data; // Each data shard with parity shards
+};
+
+// Hide shard i in one carrier, with a single thread since every carrier has its own task. The codec was already
+// applied to the whole message.
+inline std::expected<void, std::string> hideShard(Image& plainsight, const Splitter& splitter, size_t i,
+                                                  payload::Options options)
+{
+    options.threads = 1;
+    options.codec = payload::Codec::None;
+    options.shard = true;
+    auto hidden = payload::hide(plainsight, splitter.shard(i), options);
+    if (!hidden) {
+        return std::unexpected(std::format("Shard {}: {}", i, hidden.error()));
+    }
+    return {};
+}
+
+// Reveal the shard, its header and slice, hidden in one carrier, with a single thread like hideShard()
+inline std::expected<std::string, std::string> revealShard(const Image& plainsight, std::optional<u64> key,
+                                                           const std::optional<std::string>& passphrase)
+{
+    auto revealed = payload::detail::revealEncoded(plainsight, 1, key, passphrase);
+    if (!revealed) {
+        return std::unexpected(revealed.error());
+    }
+    if (!revealed->first.shard) {
+        return std::unexpected("The image holds a whole message, not a shard");
+    }
+    return std::move(revealed->second);
+}
+
+// Run fn(i) for every shard on the shared thread pool, returning the first error
+template<typename F>
+std::expected<void, std::string> forEachShard(size_t count, F&& fn)
+{
+    std::vector<std::expected<void, std::string>> results(count);
+    ThreadPool::shared().parallelFor(count, [&](size_t i) { results[i] = fn(i); });
+    for (const auto& result : results) {
+        if (!result) {
+            return result;
+        }
+    }
+    return {};
+}
+
+// Put a message with parity shards back together from at least `count` of its shards, by index, recovering the
+// missing data shards from the first `count` there are
+inline std::expected<std::string, std::string> recover(std::span<const std::string* const> byIndex,
+                                                       const Header& header)
+{
+    const size_t n = header.count;
+    const size_t size = erasureSize(header.total, n);
+    std::vector<size_t> used;
+    std::vector<const u8*> sources;
+    for (size_t i = 0; i < byIndex.size() && used.size() < n; ++i) {
+        if (byIndex[i]) {
+            used.push_back(i);
+            sources.push_back(reinterpret_cast<const u8*>(byIndex[i]->data()) + headerSize);
+        }
+    }
+    if (used.size() < n) {
+        return std::unexpected(std::format("Only {} of the {} shards needed are left", used.size(), n));
+    }
+
+    std::vector<std::vector<u8>> inverse;
+    if (used.back() >= n) {
+        auto matrix = ecc::recoveryMatrix(used, n);
+        if (!matrix) {
+            return std::unexpected(matrix.error());
+        }
+        inverse = std::move(*matrix);
+    }
+
+    std::string message(header.total, 0);
+    ThreadPool::shared().parallelFor(n, [&](size_t d) {
+        const size_t begin = std::min<size_t>(d * size, header.total);
+        const size_t end = std::min<size_t>(begin + size, header.total);
+        if (begin == end) {
+            return;
+        }
+        std::vector<u8> recovered;
+        const u8* slice = byIndex[d] ? reinterpret_cast<const u8*>(byIndex[d]->data()) + headerSize : nullptr;
+        if (!slice) {
+            recovered.resize(size);
+            ecc::combineShards(sources, inverse[d], size, recovered.data());
+            slice = recovered.data();
+        }
+        std::copy(slice, slice + (end - begin), message.begin() + static_cast<ptrdiff_t>(begin));
+    });
+    return message;
+}
+
+// Put the message back together from revealed shards, each a shard header and its slice, and undo its codec. With
+// parity shards, shards that could not be revealed are left out, otherwise every shard is needed.
+inline std::expected<std::string, std::string> assemble(std::span<const std::expected<std::string, std::string>> shards)
+{
+    std::vector<Header> headers;
+    std::vector<const std::string*> valid;
+    std::string error;
+    for (const auto& shard : shards) {
+        if (!shard) {
+            error = error.empty() ? shard.error() : error;
+            continue;
+        }
+        auto header = decodeHeader(*shard);
+        if (!header) {
+            error = error.empty() ? header.error() : error;
+            continue;
+        }
+        headers.push_back(*header);
+        valid.push_back(&*shard);
+    }
+    if (valid.empty()) {
+        return std::unexpected(error.empty() ? "No images to reveal shards from" : error);
+    }
+    const Header& first = headers.front();
+    if (first.parity == 0 && !error.empty()) {
+        return std::unexpected(error);
+    }
+
+    std::vector<const std::string*> byIndex(first.count + first.parity);
+    for (size_t i = 0; i < headers.size(); ++i) {
+        const Header& header = headers[i];
+        if (header.set != first.set || header.count != first.count || header.parity != first.parity
+            || header.total != first.total || header.codec != first.codec) {
+            return std::unexpected("The images hold shards of different messages");
+        }
+        if (byIndex[header.index]) {
+            return std::unexpected(std::format("Shard {} appears twice", header.index));
+        }
+        byIndex[header.index] = valid[i];
+    }
+    if (first.parity > 0) {
+        auto message = recover(byIndex, first);
+        if (!message || first.codec == payload::Codec::None) {
+            return message;
+        }
+        return payload::decode(*message, first.codec);
+    }
+
+    // The slices must follow each other and add up to the whole message
+    u64 offset = 0;
+    for (size_t index = 0; index < byIndex.size(); ++index) {
+        if (!byIndex[index]) {
+            return std::unexpected(std::format("Shard {} of {} is missing", index, first.count));
+        }
+        if (decodeHeader(*byIndex[index])->offset != offset) {
+            return std::unexpected(std::format("Shard {} does not continue where shard {} ends", index, index - 1));
+        }
+        offset += byIndex[index]->size() - headerSize;
+    }
+    if (offset != first.total) {
+        return std::unexpected(std::format("Shards hold {} bytes of a message of {} bytes", offset, first.total));
+    }
+
+    std::string message(first.total, 0);
+    ThreadPool::shared().parallelFor(byIndex.size(), [&](size_t index) {
+        const std::string& shard = *byIndex[index];
+        std::copy(shard.begin() + headerSize, shard.end(),
+                  message.begin() + static_cast<ptrdiff_t>(decodeHeader(shard)->offset));
+    });
+    if (first.codec != payload::Codec::None) {
+        return payload::decode(message, first.codec);
+    }
+    return message;
+}
+
+}
+
+// Hide a message split over several images, each in its own task on the shared thread pool, with the options except
+// threads. The codec is applied once to the whole message before it is split. Without parity, every image holds a
+// slice in proportion to its capacity. With parity, the last `parity` images hold Reed-Solomon parity shards instead,
+// so that any carriers.size() - parity images give back the message.
+inline std::expected<void, std::string> hide(std::span<Image> carriers, std::string_view message,
+                                             const payload::Options& options = {}, size_t parity = 0)
+{
+    std::vector<detail::Layout> layouts;
+    for (const Image& carrier : carriers) {
+        layouts.push_back({carrier.x, carrier.y, carrier.channels});
+    }
+    const std::string encoded =
+        options.codec == payload::Codec::None ? std::string() : payload::encode(message, options.codec);
+    const std::string_view data = options.codec == payload::Codec::None ? message : encoded;
+    auto headers = detail::plan(data.size(), layouts, options, parity);
+    if (!headers) {
+        return std::unexpected(headers.error());
+    }
+
+    const detail::Splitter splitter(data, std::move(*headers));
+    return detail::forEachShard(carriers.size(),
+                                [&](size_t i) { return detail::hideShard(carriers[i], splitter, i, options); });
+}
+
+// Hide a message split over the images at `inputs` and save them to `outputs`, like hide(). Reading, hiding (with
+// computing its parity) and saving each image is one task on the shared thread pool, so the images are encoded
+// concurrently and never all held at once.
+inline std::expected<void, std::string> hideFiles(std::span<const std::string> inputs,
+                                                  std::span<const std::string> outputs, std::string_view message,
+                                                  const payload::Options& options = {}, size_t parity = 0)
+{
+    if (inputs.size() != outputs.size()) {
+        return std::unexpected(std::format("Got {} output paths for {} images", outputs.size(), inputs.size()));
+    }
+
+    // The dimensions are in the file headers, no need to decode anything to plan the split
+    std::vector<detail::Layout> layouts(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        detail::Layout& layout = layouts[i];
+        if (!stbi_info(inputs[i].c_str(), &layout.x, &layout.y, &layout.channels)) {
+            return std::unexpected(std::format("Could not read image '{}'", inputs[i]));
+        }
+    }
+    const std::string encoded =
+        options.codec == payload::Codec::None ? std::string() : payload::encode(message, options.codec);
+    const std::string_view data = options.codec == payload::Codec::None ? message : encoded;
+    auto headers = detail::plan(data.size(), layouts, options, parity);
+    if (!headers) {
+        return std::unexpected(headers.error());
+    }
+
+    const detail::Splitter splitter(data, std::move(*headers));
+    return detail::forEachShard(inputs.size(), [&](size_t i) -> std::expected<void, std::string> {
+        Image image(inputs[i].c_str());
+        if (!image.data) {
+            return std::unexpected(std::format("Could not read image '{}'", inputs[i]));
+        }
+        if (auto hidden = detail::hideShard(image, splitter, i, options); !hidden) {
+            return hidden;
+        }
+        return image.save(outputs[i].c_str());
+    });
+}
+
+// Reassemble a message from the images it was split over with hide() or hideFiles(), in any order. Each image is
+// revealed by its own task on the shared thread pool. Without parity every image is needed, with parity any images
+// past the number of data shards, including ones that could not be revealed, may be left out.
+inline std::expected<std::string, std::string> reveal(std::span<const Image> carriers, std::optional<u64> key = {},
+                                                      const std::optional<std::string>& passphrase = {})
+{
+    std::vector<std::expected<std::string, std::string>> shards(carriers.size());
+    ThreadPool::shared().parallelFor(carriers.size(),
+                                     [&](size_t i) { shards[i] = detail::revealShard(carriers[i], key, passphrase); });
+    return detail::assemble(shards);
+}
+
+inline std::expected<std::string, std::string> revealFiles(std::span<const std::string> paths,
+                                                           std::optional<u64> key = {},
+                                                           const std::optional<std::string>& passphrase = {})
+{
+    std::vector<std::expected<std::string, std::string>> shards(paths.size());
+    ThreadPool::shared().parallelFor(paths.size(), [&](size_t i) {
+        const Image image(paths[i].c_str());
+        if (!image.data) {
+            shards[i] = std::unexpected(std::format("Could not read image '{}'", paths[i]));
+            return;
+        }
+        shards[i] = detail::revealShard(image, key, passphrase);
+        if (!shards[i]) {
+            shards[i] = std::unexpected(std::format("{}: {}", paths[i], shards[i].error()));
+        }
+    });
+    return detail::assemble(shards);
+}
+
+}
+
+#endif // STEGANOGRAPHER_SHARDS_HPP
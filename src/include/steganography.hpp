@@ -1,83 +1,468 @@
 #ifndef STEGANOGRAPHER_STEGANOGRAPHY_HPP
 #define STEGANOGRAPHER_STEGANOGRAPHY_HPP
 
+#include "channels.hpp"
 #include "image.hpp"
+#include "kernels.hpp"
+#include "thread_pool.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
 #include <expected>
+#include <functional>
+#include <future>
+#include <istream>
+#include <optional>
+#include <ostream>
+#include <span>
 #include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
 
 
-std::expected<void, std::string> hide(Image& plainsight, std::string_view message, size_t bpp = 1)
+namespace detail {
+
+// Number of carrier bytes that data can be hidden in with a channel mask
+inline size_t carrierSize(const Image& plainsight, ChannelMask mask)
+{
+    return static_cast<size_t>(plainsight.x) * plainsight.y * std::popcount(channels::normalize(mask, plainsight.channels));
+}
+
+// Payload bytes per chunk boundary for forEachChunk(): whole groups of Bpp bytes covering 64 carrier bytes, or 64
+// pixels with a channel mask
+template<size_t Bpp>
+size_t chunkAlignment(const Image& plainsight, ChannelMask mask)
 {
-    if (bpp > 8) {
-        throw std::invalid_argument(std::format("Invalid bpp: {}, must be 0-7", bpp));
+    if (channels::isAll(mask, plainsight.channels)) {
+        return 8 * Bpp;
     }
+    return 8 * Bpp * std::popcount(channels::normalize(mask, plainsight.channels));
+}
 
-    if (message.size() * 8 > plainsight.size() * bpp) {
-        return std::unexpected(
-            std::format("Could not fit message ({} bytes) in image ({} bytes) using {} LSB",
-            message.size(), plainsight.size(), bpp));
+// Split `size` payload bytes into chunks for up to `threads` threads (0 for one per hardware thread), and call
+// fn(offset, size) for each chunk on the shared thread pool. Chunk boundaries are multiples of `alignment`, see
+// chunkAlignment(), so chunks never share a cache line or pixel of the carrier.
+template<typename F>
+void forEachChunk(size_t size, size_t threads, size_t alignment, F&& fn)
+{
+    constexpr size_t minChunkSize = 1 << 16; // Smaller chunks are not worth handing to another thread
+
+    if (threads == 0) {
+        threads = ThreadPool::shared().size();
+    }
+    if (threads <= 1 || size < 2 * minChunkSize) {
+        fn(0, size);
+        return;
     }
 
-    size_t globalBitIndex = 0; // Which bit we are at in the input string
+    size_t chunkSize = std::max((size + threads - 1) / threads, minChunkSize);
+    chunkSize = (chunkSize + alignment - 1) / alignment * alignment;
+    const size_t chunks = (size + chunkSize - 1) / chunkSize;
+
+    ThreadPool::shared().parallelFor(chunks, [&](size_t i) {
+        const size_t offset = i * chunkSize;
+        fn(offset, std::min(chunkSize, size - offset));
+    });
+}
+
+// Extract `size` payload bytes starting at any bit of the payload, one bit at a time
+template<size_t Bpp>
+void revealBits(const u8* carrier, size_t bitOffset, u8* payload, size_t size)
+{
+    size_t globalBitIndex = bitOffset;
+
+    for (size_t i = 0; i < size; ++i) {
+        u8 c = 0;
+        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex, ++globalBitIndex) {
+            c |= ((carrier[globalBitIndex / Bpp] >> (globalBitIndex % Bpp)) & 1) << bitIndex;
+        }
+        payload[i] = c;
+    }
+}
 
-    for (char c : message) { // For each char in input string
-        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex) { // For every bit in current char
-            const size_t pixelIndex = globalBitIndex / bpp; // Which pixel this bit should be in
-            const size_t bitInPixel = globalBitIndex % bpp; // Which index in the pixel this bit belongs to
+// Call fn(done, carrier, count) for blocks of the bytes in the channels selected by a normalized mask, covering
+// `size` of them from selected byte `first` on. The bytes of each block are gathered into contiguous memory at
+// `carrier`, `done` is the number of bytes in earlier blocks and blocks after the first start at a multiple of 8
+// bytes from `first`. Changes to the gathered bytes are scattered back unless the pixels are const.
+template<typename Pixel, typename F>
+void forEachMaskedBlock(Pixel* data, int channelCount, ChannelMask mask, size_t first, size_t size, F&& fn)
+{
+    constexpr size_t blockPixels = 2048;
+    const size_t perPixel = std::popcount(mask);
+    const size_t blockSize = blockPixels * perPixel;
 
-            // Extract value of current bit in input string
-            const bool bitValue = (c >> bitIndex) & 1;
+    // A block may start and end in the middle of a pixel, so it can touch one pixel more
+    std::array<u8, (blockPixels + 1) * 4 + channels::padding> buffer;
 
-            // Set the bit at bitInPixel to bitValue in the pixel
-            u8& pixel = plainsight.data[pixelIndex];
-            pixel = (pixel & ~(1 << bitInPixel)) | (bitValue << bitInPixel);
+    for (size_t done = 0; done < size;) {
+        const size_t position = first + done;
+        const size_t skip = position % perPixel; // Selected bytes of the first pixel before the block
+        const size_t count = std::min(blockSize, size - done);
+        const size_t pixels = (skip + count + perPixel - 1) / perPixel;
+        Pixel* pixelData = data + position / perPixel * channelCount;
 
-            globalBitIndex++;
+        channels::gather(pixelData, pixels, channelCount, mask, buffer.data());
+        fn(done, buffer.data() + skip, count);
+        if constexpr (!std::is_const_v<Pixel>) {
+            channels::scatter(buffer.data(), pixels, channelCount, mask, pixelData);
         }
+
+        done += count;
+    }
+}
+
+// Hide `size` payload bytes as the bytes at `offset` of the message, which must be a multiple of Bpp so that they
+// start at a carrier byte boundary
+template<size_t Bpp>
+void hideAt(Image& plainsight, ChannelMask mask, size_t offset, const u8* payload, size_t size)
+{
+    const kernels::HideFn kernel = kernels::active(Bpp).hide[Bpp - 1];
+    if (channels::isAll(mask, plainsight.channels)) {
+        kernel(plainsight.data + offset * 8 / Bpp, payload, size);
+        return;
     }
 
+    forEachMaskedBlock(plainsight.data, plainsight.channels, channels::normalize(mask, plainsight.channels),
+                       offset * 8 / Bpp, (size * 8 + Bpp - 1) / Bpp, [&](size_t done, u8* carrier, size_t count) {
+        const size_t start = done * Bpp / 8;
+        kernel(carrier, payload + start, std::min(count * Bpp / 8, size - start));
+    });
+}
+
+// Extract `size` payload bytes at `offset` of the message, which must be a multiple of Bpp
+template<size_t Bpp>
+void revealAt(const Image& plainsight, ChannelMask mask, size_t offset, u8* payload, size_t size)
+{
+    const kernels::RevealFn kernel = kernels::active(Bpp).reveal[Bpp - 1];
+    if (channels::isAll(mask, plainsight.channels)) {
+        kernel(plainsight.data + offset * 8 / Bpp, payload, size);
+        return;
+    }
+
+    const u8* data = plainsight.data;
+    forEachMaskedBlock(data, plainsight.channels, channels::normalize(mask, plainsight.channels),
+                       offset * 8 / Bpp, (size * 8 + Bpp - 1) / Bpp, [&](size_t done, u8* carrier, size_t count) {
+        const size_t start = done * Bpp / 8;
+        kernel(carrier, payload + start, std::min(count * Bpp / 8, size - start));
+    });
+}
+
+// Extract `size` payload bytes at any `offset` of the message, one bit at a time
+template<size_t Bpp>
+void revealBitsAt(const Image& plainsight, ChannelMask mask, size_t offset, u8* payload, size_t size)
+{
+    if (channels::isAll(mask, plainsight.channels)) {
+        revealBits<Bpp>(plainsight.data, offset * 8, payload, size);
+        return;
+    }
+
+    const u8* data = plainsight.data;
+    const size_t first = offset * 8 / Bpp;
+    const size_t last = ((offset + size) * 8 + Bpp - 1) / Bpp;
+    forEachMaskedBlock(data, plainsight.channels, channels::normalize(mask, plainsight.channels), first, last - first,
+                       [&](size_t, u8* carrier, size_t) { revealBits<Bpp>(carrier, offset * 8 % Bpp, payload, size); });
+}
+
+}
+
+// Reads up to `size` bytes of payload into `buffer` and returns how many were read, 0 once the payload has ended
+using PayloadReader = std::function<size_t(u8* buffer, size_t size)>;
+
+// Receives the next `size` bytes of an extracted payload
+using PayloadWriter = std::function<void(const u8* data, size_t size)>;
+
+// Hide a message in the Bpp least significant bits of each byte of an image, split over up to `threads`
+// threads (0 for one per hardware thread). Only the bytes of the channels in `mask` are used.
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<void, std::string> hide(Image& plainsight, std::string_view message, size_t threads = 1,
+                                      ChannelMask mask = channels::all)
+{
+    const size_t carrierSize = detail::carrierSize(plainsight, mask);
+    if (message.size() * 8 > carrierSize * Bpp) {
+        return std::unexpected(
+            std::format("Could not fit message ({} bytes) in image ({} bytes) using {} LSB",
+            message.size(), carrierSize, Bpp));
+    }
+
+    // Bit k of the message goes to bit k % Bpp of carrier byte k / Bpp, the kernel for this bpp does it in bulk
+    const u8* payload = reinterpret_cast<const u8*>(message.data());
+    detail::forEachChunk(message.size(), threads, detail::chunkAlignment<Bpp>(plainsight, mask),
+                         [&](size_t offset, size_t size) {
+        detail::hideAt<Bpp>(plainsight, mask, offset, payload + offset, size);
+    });
+
     return {};
 }
 
-std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, size_t bpp = 1)
+// Extract the bytes starting at byte `offset` of a message hidden with hide<Bpp>() into `output`, without touching
+// the pixels of the bytes before it. Returns the number of bytes written, which is all of output.
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<size_t, std::string> revealRange(const Image& plainsight, size_t offset, std::span<u8> output,
+                                               size_t threads = 1, ChannelMask mask = channels::all)
 {
-    if (bpp > 8) {
-        throw std::invalid_argument(std::format("Invalid bpp: {}, must be 0-7", bpp));
+    const size_t length = output.size();
+    const size_t carrierSize = detail::carrierSize(plainsight, mask);
+    if ((offset + length) * 8 > carrierSize * Bpp) {
+        return std::unexpected(
+            std::format("Can not extract bytes {}-{} of a message from image of {} bytes using {} LSB",
+                        offset, offset + length, carrierSize, Bpp));
     }
 
-    if (messageLength * 8 > plainsight.size() * bpp) {
+    // Bytes before the next group of Bpp bytes start in the middle of a pixel, so take them one bit at a time
+    const size_t head = std::min(length, (Bpp - offset % Bpp) % Bpp);
+    detail::revealBitsAt<Bpp>(plainsight, mask, offset, output.data(), head);
+
+    // The rest starts at a carrier byte boundary, where the kernels can take over
+    const size_t start = offset + head;
+    u8* payload = output.data() + head;
+    detail::forEachChunk(length - head, threads, detail::chunkAlignment<Bpp>(plainsight, mask),
+                         [&](size_t chunkOffset, size_t size) {
+        detail::revealAt<Bpp>(plainsight, mask, start + chunkOffset, payload + chunkOffset, size);
+    });
+
+    return length;
+}
+
+// Extract `length` bytes starting at byte `offset` of a message hidden with hide<Bpp>()
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<std::string, std::string> revealRange(const Image& plainsight, size_t offset, size_t length,
+                                                    size_t threads = 1, ChannelMask mask = channels::all)
+{
+    std::string message(length, 0);
+    const std::span<u8> output(reinterpret_cast<u8*>(message.data()), length);
+    auto result = revealRange<Bpp>(plainsight, offset, output, threads, mask);
+    if (!result) {
+        return std::unexpected(result.error());
+    }
+    return message;
+}
+
+// Extract a message of messageLength bytes hidden with hide<Bpp>() into the start of a caller owned buffer, which
+// can be reused between calls. Returns the number of bytes written.
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<size_t, std::string> reveal(const Image& plainsight, size_t messageLength, std::span<u8> output,
+                                          size_t threads = 1, ChannelMask mask = channels::all)
+{
+    if (output.size() < messageLength) {
         return std::unexpected(
-            std::format("Can not extract message of {} bytes from image of {} bytes using {} LSB",
-                        messageLength, plainsight.size(), bpp));
+            std::format("Can not extract message of {} bytes into buffer of {} bytes", messageLength, output.size()));
     }
+    return revealRange<Bpp>(plainsight, 0, output.first(messageLength), threads, mask);
+}
 
-    std::string message;
-    message.reserve(messageLength);
+// Extract a message of messageLength bytes hidden with hide<Bpp>()
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, size_t threads = 1,
+                                               ChannelMask mask = channels::all)
+{
+    return revealRange<Bpp>(plainsight, 0, messageLength, threads, mask);
+}
 
-    size_t globalBitIndex = 0; // Which bit we are at in the input string
-    char currentChar = 0;
+// Hide everything read from a reader in the Bpp least significant bits of each byte of an image, one chunk at a
+// time so that the payload never has to be in memory all at once. Returns the number of bytes hidden. How long the
+// payload is only shows once it has been read, so when it does not fit the carrier keeps the part that did.
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<size_t, std::string> hideStream(Image& plainsight, const PayloadReader& read,
+                                              ChannelMask mask = channels::all)
+{
+    constexpr size_t chunkSize = Bpp << 16; // Whole groups of Bpp bytes, so every chunk starts at a pixel boundary
+    const size_t carrierSize = detail::carrierSize(plainsight, mask);
+    const size_t capacity = carrierSize * Bpp / 8;
 
-    for (size_t i = 0; i < messageLength; ++i) {
-        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex) {
-            const size_t pixelIndex = globalBitIndex / bpp;
-            const size_t bitInPixel = globalBitIndex % bpp;
+    std::vector<u8> buffer(chunkSize);
+    size_t offset = 0; // Where in the payload the current chunk starts
 
-            // Extract the bit at bitInPixel from the pixel
-            const u8 pixel = plainsight.data[pixelIndex];
-            const bool bitValue = (pixel >> bitInPixel) & 1;
+    while (true) {
+        // Fill the whole chunk unless the payload ends, since a short chunk would leave the next one misaligned
+        size_t size = 0;
+        while (size < chunkSize) {
+            const size_t bytesRead = read(buffer.data() + size, chunkSize - size);
+            if (bytesRead == 0) {
+                break;
+            }
+            size += bytesRead;
+        }
 
-            // Set the bit at bitIndex in currentChar to bitValue
-            currentChar = (currentChar & ~(1 << bitIndex)) | (bitValue << bitIndex);
+        if (offset + size > capacity) {
+            return std::unexpected(
+                std::format("Could not fit message (more than {} bytes) in image ({} bytes) using {} LSB",
+                            capacity, carrierSize, Bpp));
+        }
+
+        detail::hideAt<Bpp>(plainsight, mask, offset, buffer.data(), size);
+        offset += size;
 
-            globalBitIndex++;
+        if (size < chunkSize) {
+            return offset;
         }
+    }
+}
 
-        message += currentChar;
-        currentChar = 0;
+// Extract a message of messageLength bytes hidden with hide<Bpp>(), passing it on to a writer one chunk at a time.
+// Writing a chunk runs on the shared thread pool while the next one is extracted, with at most two chunks in memory.
+template<size_t Bpp>
+requires(Bpp >= 1 && Bpp <= 8)
+std::expected<void, std::string> revealStream(const Image& plainsight, size_t messageLength, const PayloadWriter& write,
+                                              ChannelMask mask = channels::all)
+{
+    const size_t carrierSize = detail::carrierSize(plainsight, mask);
+    if (messageLength * 8 > carrierSize * Bpp) {
+        return std::unexpected(
+            std::format("Can not extract message of {} bytes from image of {} bytes using {} LSB",
+                        messageLength, carrierSize, Bpp));
     }
 
-    return message;
+    constexpr size_t chunkSize = Bpp << 16;
+
+    std::array<std::vector<u8>, 2> buffers{std::vector<u8>(chunkSize), std::vector<u8>(chunkSize)};
+    std::future<void> writing; // The write of the previous chunk, from the other buffer
+
+    for (size_t offset = 0, chunk = 0; offset < messageLength; offset += chunkSize, ++chunk) {
+        std::vector<u8>& buffer = buffers[chunk % 2];
+        const size_t size = std::min(chunkSize, messageLength - offset);
+        detail::revealAt<Bpp>(plainsight, mask, offset, buffer.data(), size);
+
+        if (writing.valid()) {
+            writing.get(); // Keep writes in order, and make sure the other buffer is free for the next chunk
+        }
+        writing = ThreadPool::shared().submit([&write, &buffer, size] { write(buffer.data(), size); });
+    }
+
+    if (writing.valid()) {
+        writing.get();
+    }
+    return {};
+}
+
+namespace detail {
+
+// Call f.template operator()<Bpp>() for the compile time Bpp equal to a runtime bpp, through a table of the
+// instantiations for bpp 1-8
+template<typename F>
+decltype(auto) withBpp(size_t bpp, F&& f)
+{
+    if (bpp == 0 || bpp > 8) {
+        throw std::invalid_argument(std::format("Invalid bpp: {}, must be 1-8", bpp));
+    }
+
+    using Fn = std::remove_reference_t<F>;
+    using Result = decltype(f.template operator()<1>());
+    constexpr auto table = []<size_t... I>(std::index_sequence<I...>) {
+        return std::array<Result (*)(Fn&), 8>{[](Fn& fn) -> Result { return fn.template operator()<I + 1>(); }...};
+    }(std::make_index_sequence<8>{});
+
+    return table[bpp - 1](f);
+}
+
+}
+
+std::expected<void, std::string> hide(Image& plainsight, std::string_view message, size_t bpp = 1, size_t threads = 1,
+                                      ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() { return hide<Bpp>(plainsight, message, threads, mask); });
+}
+
+std::expected<std::string, std::string> reveal(const Image& plainsight, size_t messageLength, size_t bpp = 1,
+                                               size_t threads = 1, ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() { return reveal<Bpp>(plainsight, messageLength, threads, mask); });
+}
+
+std::expected<size_t, std::string> hideStream(Image& plainsight, const PayloadReader& read, size_t bpp = 1,
+                                              ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() { return hideStream<Bpp>(plainsight, read, mask); });
+}
+
+namespace detail {
+
+// Bytes left in a stream that can seek, like a file, nothing for one that can not, like a pipe
+inline std::optional<size_t> remaining(std::istream& input)
+{
+    const std::istream::pos_type start = input.tellg();
+    if (start == std::istream::pos_type(-1)) {
+        return {};
+    }
+    input.seekg(0, std::ios::end);
+    const std::istream::pos_type end = input.tellg();
+    input.clear();
+    input.seekg(start);
+    if (end == std::istream::pos_type(-1) || !input) {
+        input.clear();
+        return {};
+    }
+    return static_cast<size_t>(end - start);
+}
+
+}
+
+// Hide everything that can be read from an input stream. A stream that can seek is checked against the capacity
+// first, so the carrier is left alone if it does not fit, otherwise see the PayloadReader overload.
+std::expected<size_t, std::string> hideStream(Image& plainsight, std::istream& input, size_t bpp = 1,
+                                              ChannelMask mask = channels::all)
+{
+    if (const auto size = detail::remaining(input); size && *size * 8 > detail::carrierSize(plainsight, mask) * bpp) {
+        return std::unexpected(std::format("Could not fit message ({} bytes) in image ({} bytes) using {} LSB", *size,
+                                           detail::carrierSize(plainsight, mask), bpp));
+    }
+    const PayloadReader read = [&input](u8* buffer, size_t size) {
+        input.read(reinterpret_cast<char*>(buffer), static_cast<std::streamsize>(size));
+        return static_cast<size_t>(input.gcount());
+    };
+    return hideStream(plainsight, read, bpp, mask);
+}
+
+std::expected<size_t, std::string> reveal(const Image& plainsight, size_t messageLength, std::span<u8> output,
+                                          size_t bpp = 1, size_t threads = 1, ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() {
+        return reveal<Bpp>(plainsight, messageLength, output, threads, mask);
+    });
+}
+
+std::expected<size_t, std::string> revealRange(const Image& plainsight, size_t offset, std::span<u8> output,
+                                               size_t bpp = 1, size_t threads = 1, ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() {
+        return revealRange<Bpp>(plainsight, offset, output, threads, mask);
+    });
+}
+
+std::expected<std::string, std::string> revealRange(const Image& plainsight, size_t offset, size_t length,
+                                                    size_t bpp = 1, size_t threads = 1,
+                                                    ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() {
+        return revealRange<Bpp>(plainsight, offset, length, threads, mask);
+    });
+}
+
+std::expected<void, std::string> revealStream(const Image& plainsight, size_t messageLength, const PayloadWriter& write,
+                                              size_t bpp = 1, ChannelMask mask = channels::all)
+{
+    return detail::withBpp(bpp, [&]<size_t Bpp>() { return revealStream<Bpp>(plainsight, messageLength, write, mask); });
+}
+
+// Extract a message to an output stream
+std::expected<void, std::string> revealStream(const Image& plainsight, size_t messageLength, std::ostream& output,
+                                              size_t bpp = 1, ChannelMask mask = channels::all)
+{
+    const PayloadWriter write = [&output](const u8* data, size_t size) {
+        output.write(reinterpret_cast<const char*>(data), static_cast<std::streamsize>(size));
+    };
+    auto result = revealStream(plainsight, messageLength, write, bpp, mask);
+    if (result && !output) {
+        return std::unexpected("Could not write the extracted message");
+    }
+    return result;
 }
 
 #endif // STEGANOGRAPHER_STEGANOGRAPHY_HPP
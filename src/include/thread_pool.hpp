@@ -0,0 +1,118 @@
+#ifndef STEGANOGRAPHER_THREAD_POOL_HPP
+#define STEGANOGRAPHER_THREAD_POOL_HPP
+
+#include <algorithm>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+
+// A fixed set of worker threads running submitted tasks in order
+class ThreadPool {
+  public:
+    explicit ThreadPool(size_t threads = std::max(1u, std::thread::hardware_concurrency())) {
+        workers.reserve(threads);
+        for (size_t i = 0; i < threads; ++i) {
+            workers.emplace_back([this](std::stop_token stop) { work(stop); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            // Under the lock so no worker can miss the notification between checking for work and waiting
+            std::lock_guard lock(mutex);
+            for (std::jthread& worker : workers) {
+                worker.request_stop();
+            }
+        }
+        available.notify_all();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    // A pool with one thread per hardware thread, shared by everything that does not need its own
+    static ThreadPool& shared() {
+        static ThreadPool pool;
+        return pool;
+    }
+
+    size_t size() const { return workers.size(); }
+
+    // Queue a task, the returned future gives its result or rethrows its exception
+    template<typename F>
+    std::future<std::invoke_result_t<F>> submit(F&& f) {
+        std::packaged_task<std::invoke_result_t<F>()> task(std::forward<F>(f));
+        auto future = task.get_future();
+        {
+            std::lock_guard lock(mutex);
+            tasks.emplace(std::move(task));
+        }
+        available.notify_one();
+        return future;
+    }
+
+    // Run fn(i) for every i in [0, count), with the calling thread taking part, and wait for all of them.
+    // Tasks must not wait for other tasks in the same pool, since that could leave no worker to run them.
+    template<typename F>
+    void parallelFor(size_t count, F&& fn) {
+        std::vector<std::future<void>> futures;
+        futures.reserve(count);
+        for (size_t i = 1; i < count; ++i) {
+            futures.push_back(submit([&fn, i] { fn(i); }));
+        }
+
+        // Every task must be finished before returning, even if one throws, since they all reference fn
+        std::exception_ptr error;
+        try {
+            if (count > 0) {
+                fn(0);
+            }
+        }
+        catch (...) {
+            error = std::current_exception();
+        }
+        for (auto& future : futures) {
+            try {
+                future.get();
+            }
+            catch (...) {
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+  private:
+    void work(std::stop_token stop) {
+        while (true) {
+            std::move_only_function<void()> task;
+            {
+                std::unique_lock lock(mutex);
+                available.wait(lock, [&] { return stop.stop_requested() || !tasks.empty(); });
+                if (tasks.empty()) {
+                    return; // Stopping, and nothing left to do
+                }
+                task = std::move(tasks.front());
+                tasks.pop();
+            }
+            task();
+        }
+    }
+
+    std::mutex mutex;
+    std::condition_variable available;
+    std::queue<std::move_only_function<void()>> tasks;
+    std::vector<std::jthread> workers;
+};
+
+#endif // STEGANOGRAPHER_THREAD_POOL_HPP
@@ -0,0 +1,184 @@
+#ifndef STEGANOGRAPHER_WATERMARK_HPP
+#define STEGANOGRAPHER_WATERMARK_HPP
+
+#include "cpu.hpp"
+#include "image.hpp"
+#include "int_types.hpp"
+#include "payload.hpp"
+#include "steganography.hpp"
+
+#include <algorithm>
+#include <expected>
+#include <format>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#ifdef STEG_X86
+#include <immintrin.h>
+#endif
+
+
+// Hiding the same payload in many images of the same dimensions. The payload is compiled once into the bits every
+// carrier byte keeps and the bits it gets, so hiding it is a single pass of (pixel & mask) | value.
+namespace watermark {
+
+namespace detail {
+
+inline void applyScalar(u8* pixels, const u8* mask, const u8* value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i) {
+        pixels[i] = (pixels[i] & mask[i]) | value[i];
+    }
+}
+
+#ifdef STEG_X86
+STEG_TARGET("sse2")
+inline size_t applySse2(u8* pixels, const u8* mask, const u8* value, size_t size)
+{
+    size_t i = 0;
+    for (; i + 16 <= size; i += 16) {
+        const __m128i p = _mm_loadu_si128(reinterpret_cast<const __m128i*>(pixels + i));
+        const __m128i m = _mm_loadu_si128(reinterpret_cast<const __m128i*>(mask + i));
+        const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(value + i));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(pixels + i), _mm_or_si128(_mm_and_si128(p, m), v));
+    }
+    return i;
+}
+
+STEG_TARGET("avx2")
+inline size_t applyAvx2(u8* pixels, const u8* mask, const u8* value, size_t size)
+{
+    size_t i = 0;
+    for (; i + 32 <= size; i += 32) {
+        const __m256i p = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(pixels + i));
+        const __m256i m = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(mask + i));
+        const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(value + i));
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(pixels + i), _mm256_or_si256(_mm256_and_si256(p, m), v));
+    }
+    return i;
+}
+
+// One ternary logic instruction per 64 bytes, 0xEA is (a & b) | c
+STEG_TARGET("avx512f")
+inline size_t applyAvx512(u8* pixels, const u8* mask, const u8* value, size_t size)
+{
+    size_t i = 0;
+    for (; i + 64 <= size; i += 64) {
+        const __m512i p = _mm512_loadu_si512(pixels + i);
+        const __m512i m = _mm512_loadu_si512(mask + i);
+        const __m512i v = _mm512_loadu_si512(value + i);
+        _mm512_storeu_si512(pixels + i, _mm512_ternarylogic_epi32(p, m, v, 0xEA));
+    }
+    return i;
+}
+#endif
+
+inline void apply(u8* pixels, const u8* mask, const u8* value, size_t size)
+{
+    size_t done = 0;
+#ifdef STEG_X86
+    if (cpu::features().avx512bw) {
+        done = applyAvx512(pixels, mask, value, size);
+    }
+    else if (cpu::features().avx2) {
+        done = applyAvx2(pixels, mask, value, size);
+    }
+    else if (cpu::features().sse2) {
+        done = applySse2(pixels, mask, value, size);
+    }
+#endif
+    applyScalar(pixels + done, mask + done, value + done, size - done);
+}
+
+}
+
+// A payload compiled for images of one size and channel count
+class Plane {
+  public:
+    // Compile a message hidden like payload::hide() with these options in an image of x * y pixels with
+    // channelCount channels. Matrix embedding and LSB matching depend on the pixels and encryption on a random salt
+    // and nonce, so they can not be compiled.
+    static std::expected<Plane, std::string> compile(std::string_view message, int x, int y, int channelCount,
+                                                     const payload::Options& options = {})
+    {
+        if (options.matrix || options.matching) {
+            return std::unexpected("Matrix embedding and LSB matching depend on the carrier, they can not be "
+                                   "compiled into a watermark");
+        }
+        if (options.encryption) {
+            return std::unexpected("Encryption uses a fresh salt and nonce every time, it can not be compiled into "
+                                   "a watermark");
+        }
+
+        // Hidden in an image of zeroes and one of ones, the bits that were written are the same in both and the
+        // others differ
+        Plane plane;
+        plane.x = x;
+        plane.y = y;
+        plane.channels = channelCount;
+        const size_t size = static_cast<size_t>(x) * y * channelCount;
+        plane.value.assign(size, 0);
+        plane.mask.assign(size, 0xFF);
+        for (std::vector<u8>* bytes : {&plane.value, &plane.mask}) {
+            Image image;
+            image.x = x;
+            image.y = y;
+            image.channels = channelCount;
+            image.data = bytes->data();
+            if (auto hidden = payload::hide(image, message, options); !hidden) {
+                return std::unexpected(hidden.error());
+            }
+        }
+        for (size_t i = 0; i < size; ++i) {
+            plane.mask[i] = plane.value[i] ^ plane.mask[i];
+        }
+
+        // Only the bytes up to the last one the payload touches need to be applied
+        const auto last = std::find_if(plane.mask.rbegin(), plane.mask.rend(), [](u8 m) { return m != 0xFF; });
+        const size_t used = static_cast<size_t>(plane.mask.rend() - last);
+        plane.mask.resize(used);
+        plane.value.resize(used);
+        plane.mask.shrink_to_fit();
+        plane.value.shrink_to_fit();
+        return plane;
+    }
+
+    // Check if the plane was compiled for images like this one
+    bool matches(const Image& plainsight) const
+    {
+        return plainsight.x == x && plainsight.y == y && plainsight.channels == channels;
+    }
+
+    // Hide the compiled payload in an image, split over up to `threads` threads (0 for one per hardware thread). The
+    // result is the same as hiding it with payload::hide().
+    std::expected<void, std::string> apply(Image& plainsight, size_t threads = 1) const
+    {
+        if (!matches(plainsight)) {
+            return std::unexpected(std::format("Watermark compiled for {}x{}x{} images can not be applied to a "
+                                               "{}x{}x{} image",
+                                               x, y, channels, plainsight.x, plainsight.y, plainsight.channels));
+        }
+
+        ::detail::forEachChunk(mask.size(), threads, 64, [&](size_t offset, size_t size) {
+            detail::apply(plainsight.data + offset, mask.data() + offset, value.data() + offset, size);
+        });
+        return {};
+    }
+
+    // Bytes at the start of the image that apply() changes
+    size_t size() const { return mask.size(); }
+
+  private:
+    Plane() = default;
+
+    int x = 0;
+    int y = 0;
+    int channels = 0;
+    std::vector<u8> mask;  // Bits of each byte of the image to keep
+    std::vector<u8> value; // Bits to set after masking
+};
+
+}
+
+#endif // STEGANOGRAPHER_WATERMARK_HPP
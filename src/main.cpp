@@ -1,12 +1,25 @@
-#include "include/compression.hpp"
+#include "include/channels.hpp"
+#include "include/ecc.hpp"
 #include "include/image.hpp"
 #include "include/int_types.hpp"
+#include "include/kernels.hpp"
+#include "include/keyed.hpp"
+#include "include/matrix.hpp"
+#include "include/payload.hpp"
+#include "include/shards.hpp"
 #include "include/steganography.hpp"
+#include "include/watermark.hpp"
 
 #include <argparse.hpp>
 
+#include <filesystem>
 #include <format>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <map>
+#include <tuple>
+#include <vector>
 
 
 int main(int argc, char* argv[])
@@ -17,49 +30,161 @@ int main(int argc, char* argv[])
     parser.add_subparser(hideParser);
     hideParser.add_description("Hide something in an image");
     hideParser.add_argument("file")
-        .help("Path to image to hide data in")
+        .help("Path to image to hide data in. With several images the message is split over all of them, each saved "
+              "as '<input>_out.png'")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .required();
     auto& inputGroup = hideParser.add_mutually_exclusive_group(true);
     inputGroup.add_argument("-s", "--string")
         .help("A message string to hide");
     inputGroup.add_argument("-i", "--image")
         .help("Path to an image to hide in the original image");
+    inputGroup.add_argument("-f", "--file")
+        .help("Path to a file to hide, or - for stdin. The file is streamed into the image unless --rle, --pack, "
+              "--key, --encrypt, --ecc, --matrix or --matching is used");
     hideParser.add_argument("-o", "--output")
         .help("Path to output image, default is '<input>_out.png'");
     hideParser.add_argument("--bpp")
         .help("The number of least significant bits to use in each pixel of the image")
         .scan<'u', size_t>()
         .default_value<size_t>(1);
-    hideParser.add_argument("--rle")
-        .help("Apply run length encoding using the specified number of bytes to store the count "
-              "of each character to input before storing it")
+    hideParser.add_argument("--channels")
+        .help("The channels of each pixel to hide data in, any of r, g, b and a, like 'rgb' to skip alpha. "
+              "Default is all channels")
+        .default_value(std::string(""));
+    hideParser.add_argument("--key")
+        .help("Hide the data in a pseudorandom order of the pixels that depends on this passphrase. With "
+              "--matching, the passphrase picks the signs of the changes instead and is not needed to reveal");
+    hideParser.add_argument("--encrypt")
+        .help("Encrypt and authenticate the data with ChaCha20-Poly1305 under a key derived from this passphrase "
+              "with PBKDF2");
+    auto& hideCodec = hideParser.add_mutually_exclusive_group();
+    hideCodec.add_argument("--rle")
+        .help("Apply run length encoding to the input before storing it, with the count of each run stored in the "
+              "specified number of bytes, or 0 for as few bytes as each count needs")
         .scan<'u', u32>()
-        .choices(1u, 2u, 4u, 8u);
+        .choices(0u, 1u, 2u, 4u, 8u);
+    hideCodec.add_argument("--pack")
+        .help("Apply run length encoding that keeps bytes which do not repeat as they are to the input before "
+              "storing it, so it grows by at most a few bytes when nothing repeats")
+        .flag();
+    hideParser.add_argument("--ecc")
+        .help("Add this many Reed-Solomon parity bytes to each block, so that up to half as many damaged bytes per "
+              "block can be corrected when revealing")
+        .scan<'u', u32>();
+    hideParser.add_argument("--ecc-block")
+        .help("The size of the error correction blocks in bytes, including the parity bytes")
+        .scan<'u', u32>()
+        .default_value(255u);
+    hideParser.add_argument("--matrix")
+        .help("Hide k bits in each block of 2^k - 1 bytes by changing at most one least significant bit of the block "
+              "(matrix embedding), which changes fewer bytes but holds less. Needs --bpp 1")
+        .scan<'u', size_t>();
+    hideParser.add_argument("--matching")
+        .help("Add or subtract 1 at random to fix the least significant bit of a byte instead of replacing it (LSB "
+              "matching), which leaves no trace in the histogram. Needs --bpp 1")
+        .flag();
+    hideParser.add_argument("--parity")
+        .help("With several images, hide Reed-Solomon parity in this many of them (the last ones) instead of the "
+              "message, so that it can be revealed from any of the images but that many")
+        .scan<'u', size_t>()
+        .default_value<size_t>(0);
+    hideParser.add_argument("--kernel")
+        .help("Override the automatically selected embedding kernel")
+        .default_value(std::string("auto"))
+        .choices("auto", "scalar", "swar", "sse2", "bmi2", "avx2", "avx512");
+    hideParser.add_argument("--threads")
+        .help("The number of threads to hide the data with, 0 to use all hardware threads")
+        .scan<'u', size_t>()
+        .default_value<size_t>(1);
 
     argparse::ArgumentParser revealParser("reveal");
     parser.add_subparser(revealParser);
     revealParser.add_description("Extract a hidden message from an image");
     revealParser.add_argument("file")
-        .help("Path to an image to extract data from")
+        .help("Path to an image to extract data from. With several images, a message split over them is put back "
+              "together")
+        .nargs(argparse::nargs_pattern::at_least_one)
         .required();
     revealParser.add_argument("-t", "--type")
         .help("If the extracted data should be printed directly (string) or saved as an image")
         .default_value(std::string("string"))
         .choices("string", "image");
     revealParser.add_argument("-l", "--length")
-        .help("The number of bytes to extract from the image (not needed with --type image)")
-        .scan<'u', size_t>()
-        .default_value<size_t>(0);
+        .help("The number of bytes of raw data to extract, for data hidden without a payload header. "
+              "--bpp, --channels, --matrix and --rle then tell how it was hidden, otherwise the header does")
+        .scan<'u', size_t>();
     revealParser.add_argument("-o", "--output")
-        .help("Path to output image, default is '<input>_out.png'");
+        .help("Path to output image, default is '<input>_out.png'. With --type string, a file to write the message "
+              "to instead of printing it, or - for stdout");
     revealParser.add_argument("--bpp")
-        .help("The number of least significant bits to use in each pixel of the image")
+        .help("With --length, the number of least significant bits used in each pixel of the image")
+        .scan<'u', size_t>()
+        .default_value<size_t>(1);
+    revealParser.add_argument("--channels")
+        .help("With --length, the channels of each pixel the data is in, any of r, g, b and a. "
+              "Default is all channels")
+        .default_value(std::string(""));
+    revealParser.add_argument("--matrix")
+        .help("With --length, the k the data was hidden with using matrix embedding")
+        .scan<'u', size_t>();
+    revealParser.add_argument("--key")
+        .help("The passphrase the data was hidden with, if it was hidden with --key");
+    revealParser.add_argument("--decrypt")
+        .help("The passphrase the data was encrypted with, if it was hidden with --encrypt");
+    auto& revealCodec = revealParser.add_mutually_exclusive_group();
+    revealCodec.add_argument("--rle")
+        .help("With --length, extract run length encoded data with the count of each run stored in the specified "
+              "number of bytes, or 0 for as few bytes as each count needs")
+        .scan<'u', u32>()
+        .choices(0u, 1u, 2u, 4u, 8u);
+    revealCodec.add_argument("--pack")
+        .help("With --length, extract data hidden with --pack")
+        .flag();
+    revealParser.add_argument("--kernel")
+        .help("Override the automatically selected embedding kernel")
+        .default_value(std::string("auto"))
+        .choices("auto", "scalar", "swar", "sse2", "bmi2", "avx2", "avx512");
+    revealParser.add_argument("--threads")
+        .help("The number of threads to extract the data with, 0 to use all hardware threads")
+        .scan<'u', size_t>()
+        .default_value<size_t>(1);
+
+    argparse::ArgumentParser watermarkParser("watermark");
+    parser.add_subparser(watermarkParser);
+    watermarkParser.add_description("Hide the same message in many images, compiling it once per image size");
+    watermarkParser.add_argument("files")
+        .help("Paths to images to hide the message in, each saved as '<input>_out.png'")
+        .nargs(argparse::nargs_pattern::at_least_one)
+        .required();
+    auto& watermarkInput = watermarkParser.add_mutually_exclusive_group(true);
+    watermarkInput.add_argument("-s", "--string")
+        .help("A message string to hide");
+    watermarkInput.add_argument("-f", "--file")
+        .help("Path to a file to hide");
+    watermarkParser.add_argument("--bpp")
+        .help("The number of least significant bits to use in each pixel of the images")
         .scan<'u', size_t>()
         .default_value<size_t>(1);
-    revealParser.add_argument("--rle")
-        .help("Extract run length encoded data the specified number of bytes to store the count of each character")
+    watermarkParser.add_argument("--channels")
+        .help("The channels of each pixel to hide data in, any of r, g, b and a. Default is all channels")
+        .default_value(std::string(""));
+    watermarkParser.add_argument("--key")
+        .help("Hide the data in a pseudorandom order of the pixels that depends on this passphrase");
+    auto& watermarkCodec = watermarkParser.add_mutually_exclusive_group();
+    watermarkCodec.add_argument("--rle")
+        .help("Apply run length encoding to the input before storing it, with the count of each run stored in the "
+              "specified number of bytes, or 0 for as few bytes as each count needs")
         .scan<'u', u32>()
-        .choices(1u, 2u, 4u, 8u);
+        .choices(0u, 1u, 2u, 4u, 8u);
+    watermarkCodec.add_argument("--pack")
+        .help("Apply run length encoding that keeps bytes which do not repeat as they are to the input before "
+              "storing it, so it grows by at most a few bytes when nothing repeats")
+        .flag();
+    watermarkParser.add_argument("--threads")
+        .help("The number of threads to apply the message with, 0 to use all hardware threads")
+        .scan<'u', size_t>()
+        .default_value<size_t>(1);
 
     try {
         parser.parse_args(argc, argv);
@@ -70,34 +195,127 @@ int main(int argc, char* argv[])
         return 1;
     }
 
+    // The codec chosen with --rle or --pack
+    const auto codec = [](const argparse::ArgumentParser& subparser) {
+        if (subparser.get<bool>("--pack")) {
+            return payload::Codec::Packed;
+        }
+        return subparser.present<u32>("--rle").transform(payload::rleCodec).value_or(payload::Codec::None);
+    };
+
+    // Select the embedding kernel, keeping the automatically detected one for "auto"
+    for (const argparse::ArgumentParser* subparser : {&hideParser, &revealParser}) {
+        if (!parser.is_subcommand_used(*subparser)) {
+            continue;
+        }
+        if (const auto kernel = kernels::parse(subparser->get("--kernel"))) {
+            if (auto result = kernels::select(*kernel); !result) {
+                std::print(std::cerr, "{}\n", result.error());
+                return 1;
+            }
+        }
+    }
+
+    // Report the kernel once the bpp is known. One chosen with --kernel needs a path for it, or comparing kernels
+    // would measure another one.
+    const auto useKernel = [](const argparse::ArgumentParser& subparser, size_t bpp, bool matching) {
+        if (bpp < 1 || bpp > 8) {
+            return true;
+        }
+        if (const auto kernel = kernels::parse(subparser.get("--kernel"))) {
+            const kernels::KernelInfo& selected = kernels::info(*kernel);
+            if (matching ? !selected.match : !selected.hide[bpp - 1]) {
+                std::print(std::cerr, "Kernel {} has no {} path\n", selected.name,
+                           matching ? "LSB matching" : std::format("bpp {}", bpp));
+                return false;
+            }
+        }
+        std::print(std::cerr, "Using {} kernel\n", kernels::active(bpp).name);
+        return true;
+    };
+
     if (parser.is_subcommand_used("hide")) {
-        const std::string path = hideParser.get("file");
-        Image image(path.c_str());
-        std::print(std::cerr, "Read image '{}' with dimensions {}x{}x{}={}\n",
-                   path, image.x, image.y, image.channels, image.x * image.y * image.channels);
+        const auto paths = hideParser.get<std::vector<std::string>>("file");
+        const std::string& path = paths.front();
+        const bool sharded = paths.size() > 1;
 
-        if (auto msg = hideParser.present("--string")) {
-            std::string message = *msg;
-            std::print(std::cerr, "Message size: {}\n", message.size());
+        // Split over several images, each read by its own task once the message is known
+        Image image = sharded ? Image() : Image(path.c_str());
+        int channelCount = image.channels;
+        if (sharded) {
+            int x = 0;
+            int y = 0;
+            if (!stbi_info(path.c_str(), &x, &y, &channelCount)) {
+                std::print(std::cerr, "Could not read image '{}'\n", path);
+                return 1;
+            }
+            if (hideParser.present("--output")) {
+                std::print(std::cerr, "--output can not be used with several images\n");
+                return 1;
+            }
+            std::print(std::cerr, "Splitting message over {} images\n", paths.size());
+        }
+        else {
+            std::print(std::cerr, "Read image '{}' with dimensions {}x{}x{}={}\n",
+                       path, image.x, image.y, image.channels, image.x * image.y * image.channels);
+        }
 
-            if (auto rleBytes = hideParser.present<u32>("--rle")) {
-                if (*rleBytes == 1) {
-                    message = rle::compress<u8>(message);
-                }
-                else if (*rleBytes == 2) {
-                    message = rle::compress<u16>(message);
-                }
-                else if (*rleBytes == 4) {
-                    message = rle::compress<u32>(message);
-                }
-                else if (*rleBytes == 8) {
-                    message = rle::compress<u64>(message);
+        const auto mask = channels::parse(hideParser.get("--channels"), channelCount);
+        if (!mask) {
+            std::print(std::cerr, "{}\n", mask.error());
+            return 1;
+        }
+        std::optional<ecc::Params> eccParams;
+        if (auto parity = hideParser.present<u32>("--ecc")) {
+            const u32 blockSize = hideParser.get<u32>("--ecc-block");
+            if (*parity > 255 || blockSize > 255) {
+                std::print(std::cerr, "Error correction blocks can have at most 255 bytes\n");
+                return 1;
+            }
+            eccParams = ecc::Params{.blockSize = static_cast<u8>(blockSize), .parity = static_cast<u8>(*parity)};
+        }
+        const payload::Options options{
+            .bpp = hideParser.get<size_t>("--bpp"),
+            .codec = codec(hideParser),
+            .channels = *mask,
+            .threads = hideParser.get<size_t>("--threads"),
+            .key = hideParser.present("--key").transform(keyed::deriveKey),
+            .ecc = eccParams,
+            .matrix = hideParser.present<size_t>("--matrix").value_or(0),
+            .matching = hideParser.get<bool>("--matching"),
+            .encryption = hideParser.present("--encrypt"),
+        };
+        if (!useKernel(hideParser, options.bpp, options.matching)) {
+            return 1;
+        }
+        const auto printSize = [&](const payload::Header& header) {
+            if (options.ecc) {
+                std::print(std::cerr, "Size with error correction: {}\n", header.length);
+            }
+            else if (options.codec != payload::Codec::None) {
+                std::print(std::cerr, "Size after RLE compression: {}\n", header.length);
+            }
+        };
+        const auto hideMessage = [&](std::string_view message) -> std::expected<void, std::string> {
+            if (sharded) {
+                std::vector<std::string> outpaths;
+                for (const std::string& input : paths) {
+                    outpaths.push_back(input.substr(0, input.find_last_of('.')) + "_out.png");
                 }
-                std::print(std::cerr, "Size after RLE compression: {}\n", message.size());
+                return shards::hideFiles(paths, outpaths, message, options, hideParser.get<size_t>("--parity"));
             }
-
-            auto result = hide(image, message, hideParser.get<size_t>("--bpp"));
+            auto result = payload::hide(image, message, options);
             if (!result) {
+                return std::unexpected(result.error());
+            }
+            printSize(*result);
+            return {};
+        };
+
+        if (auto msg = hideParser.present("--string")) {
+            std::print(std::cerr, "Message size: {}\n", msg->size());
+
+            if (auto result = hideMessage(*msg); !result) {
                 std::print(std::cerr, "Could not hide string: {}\n", result.error());
                 return 1;
             }
@@ -107,31 +325,47 @@ int main(int argc, char* argv[])
             std::print(std::cerr, "Read image '{}' with dimensions {}x{}x{}={}\n",
                        *hidepath, hidden.x, hidden.y, hidden.channels, hidden.x * hidden.y * hidden.channels);
 
-            std::string message = hidden.encodeString();
-
-            if (auto rleBytes = hideParser.present<u32>("--rle")) {
-                if (*rleBytes == 1) {
-                    message = rle::compress<u8>(message);
-                }
-                else if (*rleBytes == 2) {
-                    message = rle::compress<u16>(message);
-                }
-                else if (*rleBytes == 4) {
-                    message = rle::compress<u32>(message);
-                }
-                else if (*rleBytes == 8) {
-                    message = rle::compress<u64>(message);
+            if (auto result = hideMessage(hidden.encodeString()); !result) {
+                std::print(std::cerr, "Could not hide image: {}\n", result.error());
+                return 1;
+            }
+        }
+        else if (auto filepath = hideParser.present("--file")) {
+            std::ifstream file;
+            if (*filepath != "-") {
+                file.open(*filepath, std::ios::binary);
+                if (!file) {
+                    std::print(std::cerr, "Could not open file '{}'\n", *filepath);
+                    return 1;
                 }
-                std::print(std::cerr, "Size after RLE compression: {}\n", message.size());
             }
+            std::istream& input = *filepath == "-" ? std::cin : file;
 
-            auto result = hide(image, message, hideParser.get<size_t>("--bpp"));
-            if (!result) {
-                std::print(std::cerr, "Could not hide image: {}\n", result.error());
-                return 1;
+            if (options.codec != payload::Codec::None || options.key || options.encryption || options.ecc
+                || options.matrix || options.matching || sharded) {
+                // Everything but plain LSB replacement in one image needs the whole input at once
+                const std::string message(std::istreambuf_iterator<char>(input), {});
+                std::print(std::cerr, "Message size: {}\n", message.size());
+
+                if (auto result = hideMessage(message); !result) {
+                    std::print(std::cerr, "Could not hide file: {}\n", result.error());
+                    return 1;
+                }
+            }
+            else {
+                auto result = payload::hideStream(image, input, options);
+                if (!result) {
+                    std::print(std::cerr, "Could not hide file: {}\n", result.error());
+                    return 1;
+                }
+                std::print(std::cerr, "Message size: {}\n", result->length);
             }
         }
 
+        if (sharded) {
+            std::print(std::cerr, "Saved {} modified images as '<input>_out.png'\n", paths.size());
+            return 0;
+        }
         std::string outpath = hideParser.present("--output")
                                   ? *hideParser.present("--output")
                                   : path.substr(0, path.find_last_of('.')) + "_out.png";
@@ -140,85 +374,251 @@ int main(int argc, char* argv[])
     }
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
     else if (parser.is_subcommand_used("reveal")) {
-        const std::string path = revealParser.get("file");
-        const Image image(path.c_str());
-        std::print(std::cerr, "Read image '{}' with dimensions {}x{}x{}={}\n",
-                   path, image.x, image.y, image.channels, image.x * image.y * image.channels);
-        const size_t bpp = revealParser.get<size_t>("--bpp");
-
-        if (revealParser.get("--type") == "string") {
-            const size_t length = revealParser.get<size_t>("--length");
-            const auto revealed = reveal(image, length, bpp);
-            if (!revealed) {
-                std::print(std::cerr, "Could not extract string from image: {}\n", revealed.error());
-            }
-            std::string message = *revealed;
-            std::print(std::cerr, "Extracted message size: {}\n", message.size());
+        const auto paths = revealParser.get<std::vector<std::string>>("file");
+        const std::string& path = paths.front();
+        const bool sharded = paths.size() > 1;
+        const Image image = sharded ? Image() : Image(path.c_str());
+        if (!sharded) {
+            std::print(std::cerr, "Read image '{}' with dimensions {}x{}x{}={}\n",
+                       path, image.x, image.y, image.channels, image.x * image.y * image.channels);
+        }
+        const size_t threads = revealParser.get<size_t>("--threads");
+        const auto outpath = revealParser.present("--output");
+        const bool toImage = revealParser.get("--type") == "image";
+        const std::optional<u64> key = revealParser.present("--key").transform(keyed::deriveKey);
+        const std::optional<std::string> passphrase = revealParser.present("--decrypt");
 
-            if (auto rleBytes = revealParser.present<u32>("--rle")) {
-                if (*rleBytes == 1) {
-                    message = rle::extract<u8>(message);
-                }
-                else if (*rleBytes == 2) {
-                    message = rle::extract<u16>(message);
-                }
-                else if (*rleBytes == 4) {
-                    message = rle::extract<u32>(message);
+        // The kernel follows the bpp in the payload header, a header that can not be read is reported by the reveal
+        const auto useHeaderKernel = [&](const Image& carrier) {
+            const auto header = payload::readHeader(carrier);
+            return !header || useKernel(revealParser, header->bpp, false);
+        };
+        const bool raw = revealParser.present("--length").has_value();
+        if (!(sharded ? useHeaderKernel(Image(path.c_str()))
+              : raw   ? useKernel(revealParser, revealParser.get<size_t>("--bpp"), false)
+                      : useHeaderKernel(image))) {
+            return 1;
+        }
+
+        // The message goes to a file next to the output, renamed over it once all of it was written, so a failed
+        // reveal leaves what was there. Devices and pipes are written directly.
+        std::ofstream file;
+        std::string partpath;
+        std::ostream& output = outpath && *outpath == "-" ? std::cout : file;
+        const auto openOutput = [&] {
+            if (*outpath == "-") {
+                return true;
+            }
+            std::error_code error;
+            const bool direct =
+                std::filesystem::exists(*outpath, error) && !std::filesystem::is_regular_file(*outpath, error);
+            partpath = direct ? std::string() : *outpath + ".part";
+            file.open(direct ? *outpath : partpath, std::ios::binary);
+            if (!file) {
+                std::print(std::cerr, "Could not open output file '{}'\n", *outpath);
+                return false;
+            }
+            return true;
+        };
+        // Buffered writes only fail for sure once flushed, e.g. on a full disk
+        const auto closeOutput = [&](bool written) {
+            if (!file.is_open()) {
+                return written && static_cast<bool>(output.flush());
+            }
+            file.close();
+            written = written && !file.fail();
+            if (!partpath.empty()) {
+                std::error_code error;
+                if (written) {
+                    std::filesystem::rename(partpath, *outpath, error);
+                    written = !error;
                 }
-                else if (*rleBytes == 8) {
-                    message = rle::extract<u64>(message);
+                if (!written) {
+                    std::filesystem::remove(partpath, error);
                 }
-                std::print(std::cerr, "Size after RLE extraction: {}\n", message.size());
             }
+            return written;
+        };
+
+        const auto saveImage = [&](Image& revealedImage) {
+            std::print(std::cerr, "Read image size {}x{}x{}\n", revealedImage.x, revealedImage.y,
+                       revealedImage.channels);
 
-            std::print(std::cerr, "Extracted message: '{}'\n", message);
+            std::string imagepath = outpath ? *outpath : path.substr(0, path.find_last_of('.')) + "_out.png";
+            revealedImage.save(imagepath.c_str());
+            std::print(std::cerr, "Saved modified image to {}\n", imagepath);
+        };
+
+        std::string message;
+        if (sharded) {
+            if (revealParser.present("--length")) {
+                std::print(std::cerr, "--length can not be used with several images\n");
+                return 1;
+            }
+            auto revealed = shards::revealFiles(paths, key, passphrase);
+            if (!revealed) {
+                std::print(std::cerr, "Could not extract data from images: {}\n", revealed.error());
+                return 1;
+            }
+            message = std::move(*revealed);
+            std::print(std::cerr, "Extracted message size: {} from {} images\n", message.size(), paths.size());
         }
-        else if (revealParser.get("--type") == "image") {
-            const size_t bytesForImageSize = 12 * bpp; // 3 i32s = 12 bytes
-            const auto imageSizeInfo = reveal(image, bytesForImageSize, bpp);
-            if (!imageSizeInfo) {
-                std::print(std::cerr, "Could not extract image size: {}\n", imageSizeInfo.error());
+        else if (const auto length = revealParser.present<size_t>("--length")) {
+            // Raw data without a payload header, the options tell how it was hidden
+            const auto mask = channels::parse(revealParser.get("--channels"), image.channels);
+            if (!mask) {
+                std::print(std::cerr, "{}\n", mask.error());
                 return 1;
             }
 
-            const i32* ints = reinterpret_cast<const i32*>(imageSizeInfo->data());
-            const size_t imageSize = ints[0] * ints[1] * ints[2];
-            std::print(std::cerr, "Read image size {}x{}x{}={}\n", ints[0], ints[1], ints[2], imageSize);
+            const size_t bpp = revealParser.get<size_t>("--bpp");
+            const auto k = revealParser.present<size_t>("--matrix");
+            const auto revealed = k     ? matrix::reveal(image, *length, *k, threads, *mask)
+                                  : key ? keyed::reveal(image, *length, *key, bpp, threads, *mask)
+                                        : reveal(image, *length, bpp, threads, *mask);
+            if (!revealed) {
+                std::print(std::cerr, "Could not extract data from image: {}\n", revealed.error());
+                return 1;
+            }
+            message = *revealed;
+            std::print(std::cerr, "Extracted message size: {}\n", message.size());
 
-            auto revealedImageData = reveal(image, imageSize, bpp);
-            if (!revealedImageData) {
-                std::print(std::cerr, "Could not extract image data: {}\n", revealedImageData.error());
+            if (const payload::Codec rle = codec(revealParser); rle != payload::Codec::None) {
+                auto decoded = payload::decode(message, rle);
+                if (!decoded) {
+                    std::print(std::cerr, "Could not extract RLE data: {}\n", decoded.error());
+                    return 1;
+                }
+                message = std::move(*decoded);
+                std::print(std::cerr, "Size after RLE extraction: {}\n", message.size());
+            }
+        }
+        else if (!toImage && outpath) {
+            // Write it out as it is extracted instead of holding all of it
+            if (!openOutput()) {
+                return 1;
+            }
+            const auto header = payload::revealStream(image, output, threads, key, passphrase);
+            const bool written = closeOutput(header.has_value());
+            if (!header) {
+                std::print(std::cerr, "Could not extract data from image: {}\n", header.error());
                 return 1;
             }
-            std::string message = *revealedImageData;
+            if (!written) {
+                std::print(std::cerr, "Could not write the extracted message to {}\n", *outpath);
+                return 1;
+            }
+            std::print(std::cerr, "Wrote extracted message of {} bytes hidden with {} bpp to {}\n",
+                       header->length, header->bpp, *outpath);
+            return 0;
+        }
+        else if (toImage) {
+            // A compressed image is expanded straight into its pixels
+            auto revealedImage = payload::revealImage(image, threads, key, passphrase);
+            if (!revealedImage) {
+                std::print(std::cerr, "Could not extract image from image: {}\n", revealedImage.error());
+                return 1;
+            }
+            saveImage(*revealedImage);
+            return 0;
+        }
+        else {
+            auto revealed = payload::reveal(image, threads, key, passphrase);
+            if (!revealed) {
+                std::print(std::cerr, "Could not extract data from image: {}\n", revealed.error());
+                return 1;
+            }
+            message = std::move(*revealed);
+            std::print(std::cerr, "Extracted message size: {}\n", message.size());
+        }
 
-            if (auto rleBytes = revealParser.present<u32>("--rle")) {
-                if (*rleBytes == 1) {
-                    message = rle::extract<u8>(message);
+        if (!toImage) {
+            if (outpath) {
+                if (!openOutput()) {
+                    return 1;
                 }
-                else if (*rleBytes == 2) {
-                    message = rle::extract<u16>(message);
+                output << message;
+                if (!closeOutput(true)) {
+                    std::print(std::cerr, "Could not write the extracted message to {}\n", *outpath);
+                    return 1;
                 }
-                else if (*rleBytes == 4) {
-                    message = rle::extract<u32>(message);
+                std::print(std::cerr, "Wrote extracted message to {}\n", *outpath);
+            }
+            else {
+                std::print(std::cerr, "Extracted message: '{}'\n", message);
+            }
+        }
+        else {
+            auto revealedImage = Image::decodeString(message);
+            if (!revealedImage) {
+                std::print(std::cerr, "Could not decode image: {}\n", revealedImage.error());
+                return 1;
+            }
+            saveImage(*revealedImage);
+        }
+    }
+    ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
+    else if (parser.is_subcommand_used("watermark")) {
+        std::string message;
+        if (auto msg = watermarkParser.present("--string")) {
+            message = *msg;
+        }
+        else {
+            const std::string filepath = watermarkParser.get("--file");
+            std::ifstream file(filepath, std::ios::binary);
+            if (!file) {
+                std::print(std::cerr, "Could not open file '{}'\n", filepath);
+                return 1;
+            }
+            message.assign(std::istreambuf_iterator<char>(file), {});
+        }
+        std::print(std::cerr, "Message size: {}\n", message.size());
+
+        const size_t threads = watermarkParser.get<size_t>("--threads");
+        std::map<std::tuple<int, int, int>, watermark::Plane> planes; // By image dimensions
+        for (const std::string& path : watermarkParser.get<std::vector<std::string>>("files")) {
+            Image image(path.c_str());
+            if (!image.data) {
+                std::print(std::cerr, "Could not read image '{}'\n", path);
+                return 1;
+            }
+
+            const auto layout = std::make_tuple(image.x, image.y, image.channels);
+            auto plane = planes.find(layout);
+            if (plane == planes.end()) {
+                const auto mask = channels::parse(watermarkParser.get("--channels"), image.channels);
+                if (!mask) {
+                    std::print(std::cerr, "{}\n", mask.error());
+                    return 1;
                 }
-                else if (*rleBytes == 8) {
-                    message = rle::extract<u64>(message);
+                const payload::Options options{
+                    .bpp = watermarkParser.get<size_t>("--bpp"),
+                    .codec = codec(watermarkParser),
+                    .channels = *mask,
+                    .threads = threads,
+                    .key = watermarkParser.present("--key").transform(keyed::deriveKey),
+                };
+                auto compiled = watermark::Plane::compile(message, image.x, image.y, image.channels, options);
+                if (!compiled) {
+                    std::print(std::cerr, "Could not hide message in {}x{}x{} images: {}\n", image.x, image.y,
+                               image.channels, compiled.error());
+                    return 1;
                 }
-                std::print(std::cerr, "Size after RLE extraction: {}\n", message.size());
+                std::print(std::cerr, "Compiled message for {}x{}x{} images, changing the first {} bytes\n",
+                           image.x, image.y, image.channels, compiled->size());
+                plane = planes.emplace(layout, std::move(*compiled)).first;
             }
 
-            Image revealedImage;
-            revealedImage.data = reinterpret_cast<u8*>(message.data());
-            revealedImage.x = ints[0];
-            revealedImage.y = ints[1];
-            revealedImage.channels = ints[2];
-
-            std::string outpath = revealParser.present("--output")
-                                      ? *revealParser.present("--output")
-                                      : path.substr(0, path.find_last_of('.')) + "_out.png";
-            revealedImage.save(outpath.c_str());
-            std::print(std::cerr, "Saved modified image to {}\n", outpath);
+            if (auto applied = plane->second.apply(image, threads); !applied) {
+                std::print(std::cerr, "{}\n", applied.error());
+                return 1;
+            }
+            const std::string outpath = path.substr(0, path.find_last_of('.')) + "_out.png";
+            if (auto saved = image.save(outpath.c_str()); !saved) {
+                std::print(std::cerr, "{}\n", saved.error());
+                return 1;
+            }
+            std::print(std::cerr, "Saved watermarked image to {}\n", outpath);
         }
     }
     ///////////////////////////////////////////////////////////////////////////////////////////////////////////////////
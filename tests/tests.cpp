@@ -1,9 +1,27 @@
 #define DOCTEST_CONFIG_IMPLEMENT_WITH_MAIN
 #include "doctest.h"
 
+#include <channels.hpp>
+#include <checksum.hpp>
+#include <cipher.hpp>
 #include <compression.hpp>
+#include <ecc.hpp>
 #include <image.hpp>
 #include <int_types.hpp>
+#include <kernels.hpp>
+#include <keyed.hpp>
+#include <matching.hpp>
+#include <matrix.hpp>
+#include <payload.hpp>
+#include <shards.hpp>
+#include <steganography.hpp>
+#include <watermark.hpp>
+
+#include <algorithm>
+#include <bit>
+#include <sstream>
+#include <tuple>
+#include <vector>
 
 
 // For printing in tests
@@ -15,14 +33,46 @@ std::ostream& operator<<(std::ostream& os, const Image& img)
     return os;
 }
 
+// Reference bit-by-bit LSB embedding that the optimized paths must match exactly
+void referenceHide(u8* pixels, std::string_view message, size_t bpp)
+{
+    size_t globalBitIndex = 0;
+    for (char c : message) {
+        for (size_t bitIndex = 0; bitIndex < 8; ++bitIndex) {
+            u8& pixel = pixels[globalBitIndex / bpp];
+            const size_t bitInPixel = globalBitIndex % bpp;
+            pixel = (pixel & ~(1 << bitInPixel)) | (((c >> bitIndex) & 1) << bitInPixel);
+            globalBitIndex++;
+        }
+    }
+}
 
-TEST_CASE("Image encode and decode")
+// An image over a buffer the test owns
+Image makeImage(int x, int y, int channels, u8* data)
 {
     Image img;
-    img.x = 123;
-    img.y = 456;
-    img.channels = 1;
-    img.data = new u8[123 * 456];
+    img.x = x;
+    img.y = y;
+    img.channels = channels;
+    img.data = data;
+    return img;
+}
+
+// Deterministic pseudo-random bytes for carriers and payloads
+std::vector<u8> noise(size_t size, u32 seed)
+{
+    std::vector<u8> result(size);
+    for (u8& b : result) {
+        seed = seed * 1664525 + 1013904223;
+        b = static_cast<u8>(seed >> 24);
+    }
+    return result;
+}
+
+
+TEST_CASE("Image encode and decode")
+{
+    Image img(123, 456, 1);
     std::fill(img.data, img.data + img.size(), 123);
 
     auto encoded = img.encodeString();
@@ -44,4 +94,1359 @@ TEST_CASE("RLE compression")
     CHECK(rle::extract<u8>(rle::compress<u8>("aaaabbbbbccccc")) == "aaaabbbbbccccc");
     CHECK(rle::extract<u16>(rle::compress<u16>("aaaabbbbbccccc")) == "aaaabbbbbccccc");
     CHECK(rle::extract<u32>(rle::compress<u32>("aaaabbbbbccccc")) == "aaaabbbbbccccc");
+
+    // Runs ending on and around every vector width, checked against every run scanner
+    std::string runs;
+    for (size_t length : {1, 2, 15, 16, 17, 31, 32, 33, 63, 64, 65, 127, 128, 129, 1000}) {
+        runs += std::string(length, static_cast<char>('a' + runs.size() % 26));
+    }
+    CHECK(rle::extract(rle::compress(runs)) == runs);
+    CHECK(rle::compress(runs).size() == 15 * 3);
+
+    // Runs too long for the count are split, LEB128 counts grow with the run
+    CHECK(rle::compress<u8>(runs).size() == (14 + 4) * 2);
+    CHECK(rle::extract<u8>(rle::compress<u8>(runs)) == runs);
+    CHECK(rle::compress<rle::Varint>(runs).size() == 12 * 2 + 3 * 3);
+    CHECK(rle::extract<rle::Varint>(rle::compress<rle::Varint>(runs)) == runs);
+    const std::string longRun(100000, 'x');
+    CHECK(rle::compress<rle::Varint>(longRun) == std::string("\xA0\x8D\x06x"));
+    CHECK(rle::extract<u16>(rle::compress<u16>(longRun + "y")) == longRun + "y");
+    CHECK(rle::compress<u16>(longRun).size() == 2 * 3);
+    const auto random = noise(5000, 24);
+    const std::string unordered(random.begin(), random.end());
+    CHECK(rle::extract<rle::Varint>(rle::compress<rle::Varint>(unordered)) == unordered);
+    CHECK(rle::extract<rle::Varint>(rle::compress<rle::Varint>(runs + unordered + runs)) == runs + unordered + runs);
+
+    // A count longer than a u64 or cut off, in the tail and in the unchecked blocks
+    const std::string varints = rle::compress<rle::Varint>(runs + unordered);
+    CHECK_FALSE(rle::extract<rle::Varint>(std::string(10, '\x80') + "\x01x").has_value());
+    CHECK_FALSE(rle::extract<rle::Varint>(std::string(9, '\xFF') + "\x02x").has_value());
+    CHECK_FALSE(rle::extract<rle::Varint>(varints + "\x85").has_value());
+    CHECK_FALSE(rle::extract<rle::Varint>(varints.substr(0, varints.size() - 1)).has_value());
+    CHECK_FALSE(rle::extract<rle::Varint>(std::string(200, '\xFF')).has_value());
+
+    const std::string compressed = rle::compress(runs);
+
+    // Malformed and truncated data is an error, also when it is long enough for the unchecked blocks
+    CHECK_FALSE(rle::extract(compressed.substr(0, compressed.size() - 1)).has_value());
+    CHECK_FALSE(rle::extract<u32>(compressed.substr(1)).has_value());
+    CHECK_FALSE(rle::extract(std::string("\x02\x00" "a" "\x00\x00" "b", 6)).has_value());
+    std::string zeroRun = rle::compress(runs + runs + runs);
+    REQUIRE(zeroRun.size() > 40 * 3);
+    zeroRun[20 * 3] = 0;
+    zeroRun[20 * 3 + 1] = 0;
+    CHECK(rle::extract(zeroRun.substr(0, 20 * 3)).has_value());
+    CHECK_FALSE(rle::extract(zeroRun).has_value());
+    const std::string huge(9, '\xFF');
+    CHECK_FALSE(rle::extract<u64>(huge + huge).has_value());
+    CHECK(rle::extract(std::string()).value().empty());
+
+    // Extracting a range into a buffer of its own size, leaving the bytes around it alone
+    CHECK(rle::extractedSize(compressed) == runs.size());
+    for (size_t skip : {0, 1, 16, 100, 2000}) {
+        for (size_t size : {0, 1, 5, 40, 300}) {
+            CAPTURE(skip);
+            CAPTURE(size);
+            std::string buffer(size + 2, '#');
+            const size_t written = rle::extract(compressed, std::span(buffer.data() + 1, size), skip);
+            CHECK(written == std::min(size, runs.size() - std::min(skip, runs.size())));
+            CHECK(buffer.substr(1, written) == runs.substr(std::min(skip, runs.size()), written));
+            CHECK(buffer.back() == '#');
+        }
+    }
+
+    const u8* bytes = reinterpret_cast<const u8*>(runs.data());
+    for (size_t i = 0; i < runs.size(); ++i) {
+        CAPTURE(i);
+        const size_t expected = rle::detail::runPortable(bytes + i, runs.size() - i);
+#ifdef STEG_X86
+        CHECK(rle::detail::runSse2(bytes + i, runs.size() - i) == expected);
+        if (cpu::features().avx2) {
+            CHECK(rle::detail::runAvx2(bytes + i, runs.size() - i) == expected);
+        }
+        if (cpu::features().avx512bw) {
+            CHECK(rle::detail::runAvx512(bytes + i, runs.size() - i) == expected);
+        }
+#endif
+    }
+}
+
+TEST_CASE("Packed RLE keeps bytes that do not repeat as they are")
+{
+    const auto random = noise(100000, 25);
+    const std::string unordered(random.begin(), random.end());
+    std::string runs;
+    for (size_t length : {1, 2, 3, 4, 5, 15, 16, 17, 63, 64, 65, 66, 8192, 8193, 20000}) {
+        runs += std::string(length, static_cast<char>('a' + runs.size() % 26));
+    }
+    std::string mixed;
+    for (size_t i = 0; i < 3000; ++i) {
+        mixed += unordered.substr(i * 7, i % 50);
+        mixed += std::string(i % 9, 'z');
+    }
+
+    for (const std::string& data : {std::string(), std::string("a"), std::string("aaaa"), std::string("abcabc"),
+                                    unordered, runs, mixed, runs + unordered + runs}) {
+        CAPTURE(data.size());
+        const std::string packed = rle::pack(data);
+        CHECK(rle::unpack(packed) == data);
+        CHECK(rle::unpackedSize(packed) == data.size());
+        CHECK(packed.size() <= data.size() + data.size() / 8192 + 3);
+
+        for (size_t skip : {0, 3, 70, 9000}) {
+            std::string buffer(500, '#');
+            const size_t written = rle::unpack(packed, std::span(buffer.data(), 400), skip);
+            CHECK(written == std::min<size_t>(400, data.size() - std::min(skip, data.size())));
+            CHECK(buffer.substr(0, written) == data.substr(std::min(skip, data.size()), written));
+            CHECK(buffer[400] == '#');
+        }
+    }
+    CHECK(rle::pack(unordered).size() == unordered.size() + 3);
+    CHECK(rle::pack(std::string(300, 'x')) == std::string("\xD6\x04x"));
+    CHECK(rle::pack("abcccc") == std::string("\x03" "ab" "\x06" "c"));
+
+    // A literal longer than what is left, a header cut off or too long
+    const std::string packed = rle::pack(mixed);
+    CHECK_FALSE(rle::unpack(packed.substr(0, packed.size() - 1)).has_value());
+    CHECK_FALSE(rle::unpack(std::string("\x09" "abcd")).has_value());
+    CHECK_FALSE(rle::unpack(packed + "\x80").has_value());
+    CHECK_FALSE(rle::unpack(std::string(20, '\xFF') + packed).has_value());
+
+    // Every literal scanner finds the same first run of four
+    const u8* bytes = reinterpret_cast<const u8*>(mixed.data());
+    for (size_t i = 0; i < 2000; ++i) {
+        CAPTURE(i);
+        const size_t size = std::min<size_t>(mixed.size() - i, 150);
+        const size_t expected = rle::detail::literalPortable(bytes + i, size);
+#ifdef STEG_X86
+        CHECK(rle::detail::literalSse2(bytes + i, size) == expected);
+        if (cpu::features().avx2) {
+            CHECK(rle::detail::literalAvx2(bytes + i, size) == expected);
+        }
+        if (cpu::features().avx512bw) {
+            CHECK(rle::detail::literalAvx512(bytes + i, size) == expected);
+        }
+#endif
+    }
+}
+
+TEST_CASE("Hide and reveal match the reference bit loop")
+{
+    const auto bytes = noise(1000, 1);
+    const std::string message(bytes.begin(), bytes.end());
+
+    for (size_t bpp = 1; bpp <= 8; ++bpp) {
+        CAPTURE(bpp);
+        std::vector<u8> expected = noise(8000, 2);
+        std::vector<u8> pixels = expected;
+        referenceHide(expected.data(), message, bpp);
+
+        Image img = makeImage(8000, 1, 1, pixels.data());
+
+        CHECK(hide(img, message, bpp).has_value());
+        CHECK(pixels == expected);
+
+        const auto revealed = reveal(img, message.size(), bpp);
+        REQUIRE(revealed.has_value());
+        CHECK(*revealed == message);
+    }
+}
+
+TEST_CASE("All supported kernels match the scalar kernel")
+{
+    const auto payload = noise(1003, 3); // Odd size to exercise the tail handling of every kernel
+    const auto carrier = noise(payload.size() * 8, 4);
+
+    for (size_t bpp = 1; bpp <= 8; ++bpp) {
+        CAPTURE(bpp);
+        std::vector<u8> expected = carrier;
+        kernels::info(kernels::Kernel::Scalar).hide[bpp - 1](expected.data(), payload.data(), payload.size());
+
+        for (const kernels::KernelInfo& kernel : kernels::all) {
+            if (!kernels::supported(kernel.kernel) || !kernel.hide[bpp - 1]) {
+                continue;
+            }
+            CAPTURE(kernel.name);
+
+            std::vector<u8> pixels = carrier;
+            kernel.hide[bpp - 1](pixels.data(), payload.data(), payload.size());
+            CHECK(pixels == expected);
+
+            std::vector<u8> revealed(payload.size());
+            kernel.reveal[bpp - 1](pixels.data(), revealed.data(), revealed.size());
+            CHECK(revealed == payload);
+        }
+    }
+}
+
+TEST_CASE("All LSB matching kernels match the scalar kernel")
+{
+    const auto payload = noise(1003, 5);
+    auto carrier = noise(payload.size() * 8, 6);
+    std::fill_n(carrier.begin(), 64, u8{0}); // Saturation at both ends
+    std::fill_n(carrier.begin() + 64, 64, u8{255});
+
+    std::vector<u8> expected = carrier;
+    kernels::info(kernels::Kernel::Scalar).match(expected.data(), payload.data(), payload.size(), 7, 3);
+
+    bool onlyOffByOne = true;
+    size_t up = 0, down = 0;
+    for (size_t i = 0; i < carrier.size(); ++i) {
+        onlyOffByOne &= std::abs(expected[i] - carrier[i]) <= 1;
+        up += expected[i] > carrier[i];
+        down += expected[i] < carrier[i];
+    }
+    CHECK(onlyOffByOne);
+    CHECK(up > carrier.size() / 5);
+    CHECK(down > carrier.size() / 5);
+
+    for (const kernels::KernelInfo& kernel : kernels::all) {
+        if (!kernels::supported(kernel.kernel) || !kernel.match) {
+            continue;
+        }
+        CAPTURE(kernel.name);
+
+        std::vector<u8> pixels = carrier;
+        kernel.match(pixels.data(), payload.data(), payload.size(), 7, 3);
+        CHECK(pixels == expected);
+
+        std::vector<u8> revealed(payload.size());
+        kernels::info(kernels::Kernel::Scalar).reveal[0](pixels.data(), revealed.data(), revealed.size());
+        CHECK(revealed == payload);
+    }
+
+    // Any split of the payload at units of 64 carrier bytes gives the same result
+    std::vector<u8> pixels = carrier;
+    kernels::activeMatch()(pixels.data(), payload.data(), 40, 7, 3);
+    kernels::activeMatch()(pixels.data() + 320, payload.data() + 40, payload.size() - 40, 7, 8);
+    CHECK(pixels == expected);
+}
+
+TEST_CASE("Compile time bpp matches runtime bpp")
+{
+    const std::string message = "The quick brown fox jumps over the lazy dog";
+    std::vector<u8> runtimePixels = noise(400, 5);
+    std::vector<u8> templatePixels = runtimePixels;
+
+    Image runtimeImg = makeImage(400, 1, 1, runtimePixels.data());
+
+    Image templateImg = makeImage(400, 1, 1, templatePixels.data());
+
+    CHECK(hide(runtimeImg, message, 3).has_value());
+    CHECK(hide<3>(templateImg, message).has_value());
+    CHECK(runtimePixels == templatePixels);
+    CHECK(reveal<3>(templateImg, message.size()).value() == message);
+
+    CHECK_FALSE(hide<1>(templateImg, std::string(51, 'x')).has_value()); // 408 bits do not fit in 400 bytes
+    CHECK_THROWS_AS(hide(runtimeImg, message, 0), std::invalid_argument);
+}
+
+TEST_CASE("Multithreaded hide and reveal match single threaded")
+{
+    const auto bytes = noise(300001, 6); // Large enough to be split into several chunks
+    const std::string message(bytes.begin(), bytes.end());
+
+    for (size_t bpp : {1, 3, 8}) {
+        CAPTURE(bpp);
+        std::vector<u8> singlePixels = noise(message.size() * 8 / bpp + 1, 7);
+        std::vector<u8> multiPixels = singlePixels;
+
+        Image single = makeImage(static_cast<int>(singlePixels.size()), 1, 1, singlePixels.data());
+
+        Image multi = makeImage(static_cast<int>(multiPixels.size()), 1, 1, multiPixels.data());
+
+        CHECK(hide(single, message, bpp, 1).has_value());
+        CHECK(hide(multi, message, bpp, 4).has_value());
+        CHECK(singlePixels == multiPixels);
+        CHECK(reveal(multi, message.size(), bpp, 0).value() == message);
+    }
+}
+
+TEST_CASE("Streaming hide matches hide")
+{
+    const auto bytes = noise(200003, 8); // Several chunks and a partial last one
+    const std::string message(bytes.begin(), bytes.end());
+
+    for (size_t bpp : {1, 5}) {
+        CAPTURE(bpp);
+        std::vector<u8> expected = noise(message.size() * 8 / bpp + 8, 9);
+        std::vector<u8> pixels = expected;
+
+        Image expectedImg = makeImage(static_cast<int>(expected.size()), 1, 1, expected.data());
+        CHECK(hide(expectedImg, message, bpp).has_value());
+
+        Image img = makeImage(static_cast<int>(pixels.size()), 1, 1, pixels.data());
+
+        // Short reads must not shift the payload
+        size_t position = 0;
+        const PayloadReader read = [&](u8* buffer, size_t size) {
+            const size_t n = std::min({size, size_t{1000}, message.size() - position});
+            std::copy_n(message.data() + position, n, buffer);
+            position += n;
+            return n;
+        };
+        const auto hidden = hideStream(img, read, bpp);
+        REQUIRE(hidden.has_value());
+        CHECK(*hidden == message.size());
+        CHECK(pixels == expected);
+
+        // A stream that can seek is measured first and leaves the carrier alone
+        std::istringstream input(message);
+        const std::vector<u8> small = noise(message.size() * 8 / bpp - 8, 12);
+        std::vector<u8> tooSmall = small;
+        img.x = static_cast<int>(tooSmall.size());
+        img.data = tooSmall.data();
+        CHECK_FALSE(hideStream(img, input, bpp).has_value());
+        CHECK(tooSmall == small);
+
+        // A reader is only measured as it goes, so the carrier keeps the chunks of bpp << 16 bytes before the one
+        // that did not fit
+        position = 0;
+        CHECK_FALSE(hideStream(img, read, bpp).has_value());
+        CHECK((tooSmall != small) == (message.size() > (bpp << 16)));
+    }
+
+    // So is a payload stream
+    std::vector<u8> pixels = noise(5000, 13);
+    Image img = makeImage(5000, 1, 1, pixels.data());
+    REQUIRE(payload::hide(img, "already here").has_value());
+    const std::vector<u8> before = pixels;
+    std::istringstream input(std::string(payload::capacity(5000, 1, 1) + 1, 'x'));
+    CHECK_FALSE(payload::hideStream(img, input).has_value());
+    CHECK(pixels == before);
+    CHECK(payload::reveal(img).value() == "already here");
+}
+
+TEST_CASE("Streaming reveal matches reveal")
+{
+    const auto bytes = noise(300007, 10);
+    const std::string message(bytes.begin(), bytes.end());
+    std::vector<u8> pixels = noise(message.size() * 8 / 3 + 8, 11);
+
+    Image img = makeImage(static_cast<int>(pixels.size()), 1, 1, pixels.data());
+    REQUIRE(hide(img, message, 3).has_value());
+
+    std::string written;
+    size_t writes = 0;
+    const PayloadWriter write = [&](const u8* data, size_t size) {
+        written.append(reinterpret_cast<const char*>(data), size);
+        writes++;
+    };
+    CHECK(revealStream(img, message.size(), write, 3).has_value());
+    CHECK(writes > 1);
+    CHECK(written == message);
+
+    std::ostringstream output;
+    CHECK(revealStream(img, message.size(), output, 3).has_value());
+    CHECK(output.str() == message);
+
+    CHECK_FALSE(revealStream(img, message.size() * 2, output, 3).has_value());
+
+    // A failed write, e.g. to a full disk, is an error
+    std::ostringstream failed;
+    failed.setstate(std::ios::badbit);
+    CHECK_FALSE(revealStream(img, message.size(), failed, 3).has_value());
+}
+
+TEST_CASE("Reveal a range of a message")
+{
+    const auto bytes = noise(5000, 12);
+    const std::string message(bytes.begin(), bytes.end());
+
+    for (size_t bpp = 1; bpp <= 8; ++bpp) {
+        CAPTURE(bpp);
+        std::vector<u8> pixels = noise(message.size() * 8 / bpp + 8, 13);
+
+        Image img = makeImage(static_cast<int>(pixels.size()), 1, 1, pixels.data());
+        REQUIRE(hide(img, message, bpp).has_value());
+
+        for (size_t offset : {0, 1, 7, 12, 1001}) {
+            for (size_t length : {0, 1, 3, 12, 2000}) {
+                CAPTURE(offset);
+                CAPTURE(length);
+                CHECK(revealRange(img, offset, length, bpp).value() == message.substr(offset, length));
+            }
+        }
+        CHECK_FALSE(revealRange(img, message.size() - 10, pixels.size(), bpp).has_value());
+    }
+}
+
+TEST_CASE("Reveal into a caller provided buffer")
+{
+    const std::string message = "Reuse this buffer for every image";
+    std::vector<u8> pixels = noise(1000, 14);
+
+    Image img = makeImage(static_cast<int>(pixels.size()), 1, 1, pixels.data());
+    REQUIRE(hide(img, message, 2).has_value());
+
+    std::vector<u8> buffer(100, 0xAA);
+    const auto written = reveal(img, message.size(), buffer, 2);
+    REQUIRE(written.has_value());
+    CHECK(*written == message.size());
+    CHECK(std::string(buffer.begin(), buffer.begin() + message.size()) == message);
+    CHECK(buffer[message.size()] == 0xAA); // Nothing written past the message
+
+    std::array<u8, 4> part;
+    CHECK(revealRange(img, 6, part, 2).value() == part.size());
+    CHECK(std::string(part.begin(), part.end()) == "this");
+
+    std::array<u8, 10> tooSmall;
+    CHECK_FALSE(reveal(img, message.size(), tooSmall, 2).has_value());
+}
+
+TEST_CASE("Channel gather and scatter match the scalar loops")
+{
+    for (int channelCount = 1; channelCount <= 4; ++channelCount) {
+        for (ChannelMask mask = 1; mask < (1 << channelCount); ++mask) {
+            CAPTURE(channelCount);
+            CAPTURE(mask);
+            const size_t pixels = 77;
+            const auto src = noise(pixels * channelCount, 15);
+            const size_t selected = pixels * std::popcount(mask);
+
+            std::vector<u8> expected(selected);
+            channels::detail::gatherScalar(src.data(), pixels, channelCount, mask, expected.data());
+            std::vector<u8> gathered(selected + channels::padding);
+            channels::gather(src.data(), pixels, channelCount, mask, gathered.data());
+            CHECK(std::equal(expected.begin(), expected.end(), gathered.begin()));
+
+            const auto bytes = noise(selected + channels::padding, 16);
+            std::vector<u8> expectedPixels = src;
+            channels::detail::scatterScalar(bytes.data(), pixels, channelCount, mask, expectedPixels.data());
+            std::vector<u8> scattered = src;
+            channels::scatter(bytes.data(), pixels, channelCount, mask, scattered.data());
+            CHECK(scattered == expectedPixels);
+        }
+    }
+}
+
+TEST_CASE("Hide and reveal in selected channels")
+{
+    CHECK(channels::parse("rgb", 4).value() == 0b0111);
+    CHECK(channels::parse("a", 4).value() == 0b1000);
+    CHECK(channels::parse("r", 1).value() == 0b0001);
+    CHECK_FALSE(channels::parse("a", 3).has_value());
+    CHECK_FALSE(channels::parse("x", 4).has_value());
+
+    const auto bytes = noise(200000, 17);
+    const std::string message(bytes.begin(), bytes.end());
+
+    for (auto [channelCount, spec] : {std::pair{4, "rgb"}, {4, "a"}, {3, "rb"}, {2, "a"}}) {
+        for (size_t bpp : {1, 3, 8}) {
+            CAPTURE(spec);
+            CAPTURE(bpp);
+            const ChannelMask mask = channels::parse(spec, channelCount).value();
+            const size_t perPixel = std::popcount(mask);
+            const size_t pixelCount = (message.size() * 8 / bpp + perPixel - 1) / perPixel + 3;
+            const std::vector<u8> original = noise(pixelCount * channelCount, 18);
+            std::vector<u8> pixels = original;
+
+            Image img = makeImage(static_cast<int>(pixelCount), 1, channelCount, pixels.data());
+            REQUIRE(hide(img, message, bpp, 4, mask).has_value());
+
+            // The selected bytes hold the message as if they were the whole image, the others are untouched
+            std::vector<u8> expected(pixelCount * perPixel);
+            channels::detail::gatherScalar(original.data(), pixelCount, channelCount, mask, expected.data());
+            referenceHide(expected.data(), message, bpp);
+            std::vector<u8> selected(pixelCount * perPixel);
+            channels::detail::gatherScalar(pixels.data(), pixelCount, channelCount, mask, selected.data());
+            CHECK(selected == expected);
+            for (size_t i = 0; i < pixels.size(); ++i) {
+                if (!((mask >> (i % channelCount)) & 1) && pixels[i] != original[i]) {
+                    FAIL("Unselected channel changed at byte " << i);
+                }
+            }
+
+            CHECK(reveal(img, message.size(), bpp, 4, mask).value() == message);
+            CHECK(revealRange(img, 12345, 1000, bpp, 1, mask).value() == message.substr(12345, 1000));
+
+            std::ostringstream output;
+            CHECK(revealStream(img, message.size(), output, bpp, mask).has_value());
+            CHECK(output.str() == message);
+
+            CHECK_FALSE(hide(img, message + std::string(pixelCount, 'x'), bpp, 1, mask).has_value());
+        }
+    }
+}
+
+TEST_CASE("CRC-32C matches the bytewise definition")
+{
+    CHECK(checksum::crc32c(std::string_view("123456789")) == 0xE3069283);
+    CHECK(checksum::crc32c(std::string_view()) == 0);
+
+    const std::vector<u8> bytes = noise(100000, 25);
+    for (size_t size : {1, 7, 8, 100, 3 * 4096 - 1, 3 * 4096, 3 * 4096 + 9, 50000, 100000}) {
+        CAPTURE(size);
+        const u32 expected = ~checksum::detail::updateScalar(~0u, bytes.data(), size);
+        CHECK(checksum::crc32c(bytes.data(), size) == expected);
+
+        // In two pieces, continued or combined
+        const size_t split = size / 3;
+        const u32 first = checksum::crc32c(bytes.data(), split);
+        const u32 second = checksum::crc32c(bytes.data() + split, size - split);
+        CHECK(checksum::crc32c(bytes.data() + split, size - split, first) == expected);
+        CHECK(checksum::combine(first, second, size - split) == expected);
+    }
+
+    std::string large(5 << 20, 0);
+    std::copy(bytes.begin(), bytes.end(), large.begin() + 12345);
+    CHECK(checksum::crc32c(large, 0) == checksum::crc32c(large));
+    CHECK(checksum::crc32c(large, 3) == checksum::crc32c(large));
+}
+
+TEST_CASE("Payloads describe how they were hidden")
+{
+    const std::string message = "aaaaaaaaaabbbbbbbbbbbbcdddddddddddddddd A self describing payload";
+    std::vector<u8> pixels = noise(4000 * 4, 19);
+
+    Image img = makeImage(4000, 1, 4, pixels.data());
+
+    for (auto codec : {payload::Codec::None, payload::Codec::Rle8, payload::Codec::Rle32, payload::Codec::RleVarint,
+                       payload::Codec::Packed}) {
+        for (size_t bpp : {1, 2, 7}) {
+            CAPTURE(static_cast<int>(codec));
+            CAPTURE(bpp);
+            const payload::Options options{.bpp = bpp, .codec = codec, .channels = 0b0111};
+            const auto hidden = payload::hide(img, message, options);
+            REQUIRE(hidden.has_value());
+
+            const auto header = payload::readHeader(img);
+            REQUIRE(header.has_value());
+            CHECK(header->length == payload::encode(message, codec).size());
+            CHECK(header->length == hidden->length);
+            CHECK(header->bpp == bpp);
+            CHECK(header->codec == codec);
+            CHECK(header->channels == 0b0111);
+            CHECK(header->crc == checksum::crc32c(payload::encode(message, codec)));
+
+            CHECK(payload::reveal(img).value() == message);
+            std::ostringstream output;
+            CHECK(payload::revealStream(img, output).has_value());
+            CHECK(output.str() == message);
+
+            std::ostringstream failed;
+            failed.setstate(std::ios::badbit);
+            CHECK_FALSE(payload::revealStream(img, failed).has_value());
+        }
+    }
+
+    // Neither the header nor the payload touched alpha
+    const std::vector<u8> original = noise(4000 * 4, 19);
+    bool alphaUntouched = true;
+    for (size_t i = 3; i < pixels.size(); i += 4) {
+        alphaUntouched &= pixels[i] == original[i];
+    }
+    CHECK(alphaUntouched);
+
+    std::istringstream input(message);
+    REQUIRE(payload::hideStream(img, input, {.bpp = 3}).has_value());
+    CHECK(payload::reveal(img, 4).value() == message);
+
+    // Only the payload was hidden in the carrier, nothing describes it
+    std::vector<u8> plain = noise(4000, 20);
+    Image raw = makeImage(4000, 1, 1, plain.data());
+    REQUIRE(hide(raw, message).has_value());
+    CHECK_FALSE(payload::readHeader(raw).has_value());
+    CHECK_FALSE(payload::reveal(raw).has_value());
+
+    // A header claiming more than the image can hold
+    REQUIRE(payload::hide(raw, message, {.bpp = 1}).has_value());
+    auto bytes = payload::encodeHeader({.length = 1000, .bpp = 1});
+    REQUIRE(hide(raw, std::string_view(reinterpret_cast<const char*>(bytes.data()), bytes.size())).has_value());
+    CHECK_FALSE(payload::reveal(raw).has_value());
+
+    raw.x = 100;
+    CHECK_FALSE(payload::hide(raw, "too small").has_value());
+}
+
+TEST_CASE("Images in payloads expand straight into their pixels")
+{
+    // Bands of one color compress well
+    std::vector<u8> bands(40 * 30 * 3);
+    for (size_t i = 0; i < bands.size(); ++i) {
+        bands[i] = static_cast<u8>(i / 200 * 40);
+    }
+    Image hidden = makeImage(40, 30, 3, bands.data());
+
+    std::vector<u8> pixels = noise(300 * 300 * 4, 23);
+    Image img = makeImage(300, 300, 4, pixels.data());
+
+    for (auto codec : {payload::Codec::None, payload::Codec::Rle8, payload::Codec::Rle16, payload::Codec::Rle64,
+                       payload::Codec::RleVarint, payload::Codec::Packed}) {
+        CAPTURE(static_cast<int>(codec));
+        REQUIRE(payload::hide(img, hidden.encodeString(), {.codec = codec}).has_value());
+        const auto revealed = payload::revealImage(img, 2);
+        REQUIRE(revealed.has_value());
+        CHECK(*revealed == hidden);
+    }
+
+    REQUIRE(payload::hide(img, hidden.encodeString().substr(0, 1000), {.codec = payload::Codec::Rle8}).has_value());
+    CHECK_FALSE(payload::revealImage(img).has_value());
+    REQUIRE(payload::hide(img, "short", {.codec = payload::Codec::Rle8}).has_value());
+    CHECK_FALSE(payload::revealImage(img).has_value());
+}
+
+TEST_CASE("Payloads with damaged bodies fail their integrity check")
+{
+    const std::vector<u8> bytes = noise(2000, 26);
+    const std::string message(bytes.begin(), bytes.end());
+    std::vector<u8> pixels = noise(200 * 100 * 3, 27);
+    Image img = makeImage(200, 100, 3, pixels.data());
+
+    for (const payload::Options& options : std::vector<payload::Options>{{}, {.codec = payload::Codec::Rle8}}) {
+        REQUIRE(payload::hide(img, message, options).has_value());
+        CHECK(payload::reveal(img).value() == message);
+
+        // One flipped bit in the body, well past the header
+        pixels[5000] ^= 1;
+        CHECK_FALSE(payload::reveal(img).has_value());
+        std::ostringstream output;
+        CHECK_FALSE(payload::revealStream(img, output).has_value());
+    }
+
+    // Error correction repairs the body before it is checked
+    REQUIRE(payload::hide(img, message, {.ecc = ecc::Params{.parity = 8}}).has_value());
+    pixels[5000] ^= 1;
+    CHECK(payload::reveal(img).value() == message);
+
+    // A junk image size is rejected before anything is allocated for it
+    std::string junk(12, '\xFF');
+    CHECK_FALSE(Image::decodeString(junk).has_value());
+}
+
+TEST_CASE("Keyed permutations are bijections")
+{
+    for (u64 size : {1, 2, 3, 1000, 3072, 4096, 5000}) {
+        CAPTURE(size);
+        const keyed::Permutation permutation(keyed::deriveKey("key"), size);
+        std::vector<bool> seen(size);
+        bool bijection = true;
+        for (u64 i = 0; i < size; ++i) {
+            const u64 j = permutation(i);
+            bijection &= j < size && !seen[j];
+            seen[j % size] = true;
+        }
+        CHECK(bijection);
+    }
+}
+
+TEST_CASE("Hide and reveal in a keyed order")
+{
+    const auto bytes = noise(300000, 21);
+    const std::string message(bytes.begin(), bytes.end());
+    const u64 key = keyed::deriveKey("correct horse");
+
+    for (auto [channelCount, mask] : {std::pair{1, ChannelMask{0}}, {4, ChannelMask{0}}, {4, ChannelMask{0b0111}},
+                                      {3, ChannelMask{0b0100}}}) {
+        for (size_t bpp : {1, 3, 8}) {
+            CAPTURE(channelCount);
+            CAPTURE(mask);
+            CAPTURE(bpp);
+            const size_t perPixel = std::popcount(channels::normalize(mask, channelCount));
+            const size_t pixelCount = (message.size() * 8 / bpp + perPixel - 1) / perPixel + 777;
+            const std::vector<u8> original = noise(pixelCount * channelCount, 22);
+            std::vector<u8> pixels = original;
+
+            Image img = makeImage(static_cast<int>(pixelCount), 1, channelCount, pixels.data());
+            REQUIRE(keyed::hide(img, message, key, bpp, 4, mask).has_value());
+            CHECK(keyed::reveal(img, message.size(), key, bpp, 4, mask).value() == message);
+            CHECK(keyed::reveal(img, message.size(), key, bpp, 1, mask).value() == message);
+            CHECK(keyed::reveal(img, message.size(), key + 1, bpp, 1, mask).value() != message);
+            CHECK(reveal(img, message.size(), bpp, 1, mask).value() != message);
+
+            bool unselectedUntouched = true;
+            const ChannelMask selected = channels::normalize(mask, channelCount);
+            for (size_t i = 0; i < pixels.size(); ++i) {
+                unselectedUntouched &= ((selected >> (i % channelCount)) & 1) || pixels[i] == original[i];
+            }
+            CHECK(unselectedUntouched);
+        }
+    }
+
+    // A short payload is spread over every tile, not packed into the first
+    const std::vector<u8> original = noise(5 * keyed::detail::tilePixels, 24);
+    std::vector<u8> spread = original;
+    Image tiled = makeImage(static_cast<int>(spread.size()), 1, 1, spread.data());
+    REQUIRE(keyed::hide(tiled, message.substr(0, 100), key).has_value());
+    CHECK(keyed::reveal(tiled, 100, key).value() == message.substr(0, 100));
+    std::vector<bool> touched(5);
+    for (size_t i = 0; i < spread.size(); ++i) {
+        if (spread[i] != original[i]) {
+            touched[i / keyed::detail::tilePixels] = true;
+        }
+    }
+    CHECK(std::count(touched.begin(), touched.end(), true) == 5);
+
+    std::vector<u8> pixels = noise(20000, 23);
+    Image img = makeImage(20000, 1, 1, pixels.data());
+    REQUIRE(payload::hide(img, "Somewhere in here", {.bpp = 2, .key = key}).has_value());
+    CHECK(payload::readHeader(img).value().keyed);
+    CHECK_FALSE(payload::reveal(img).has_value());
+    CHECK(payload::reveal(img, 1, key).value() == "Somewhere in here");
+}
+
+// Damage `errors` bytes of every codeword in the output of ecc::encode()
+void damageCodewords(std::string& encoded, const ecc::Params& params, size_t errors, u32 seed)
+{
+    const size_t n = params.blockSize;
+    const size_t codewords = encoded.size() / n;
+    for (size_t c = 0; c < codewords; ++c) {
+        const size_t group = c / ecc::lanes;
+        const size_t count = std::min(ecc::lanes, codewords - group * ecc::lanes);
+        const std::vector<u8> offsets = noise(errors + 1, seed + static_cast<u32>(c));
+        for (size_t e = 0; e < errors; ++e) {
+            // Distinct bytes of the codeword, which are interleaved with the others of its group
+            const size_t i = (offsets[0] + e * (n / errors)) % n;
+            encoded[group * ecc::lanes * n + i * count + c % ecc::lanes] ^= static_cast<char>(offsets[e + 1] | 1);
+        }
+    }
+}
+
+TEST_CASE("Reed-Solomon codes correct up to half their parity bytes")
+{
+    for (const ecc::Params params : {ecc::Params{}, ecc::Params{255, 2}, ecc::Params{64, 16}, ecc::Params{20, 7}}) {
+        for (size_t size : {0, 1, 100, 60000}) {
+            CAPTURE(static_cast<int>(params.blockSize));
+            CAPTURE(static_cast<int>(params.parity));
+            CAPTURE(size);
+            const std::vector<u8> bytes = noise(size, 31);
+            const std::string data(bytes.begin(), bytes.end());
+
+            std::string encoded = ecc::encode(data, params, 4);
+            CHECK(encoded.size() == ecc::encodedSize(size, params));
+            CHECK(encoded == ecc::encode(data, params, 1));
+            CHECK(ecc::decode(encoded, params, 4).value() == data);
+
+            damageCodewords(encoded, params, params.parity / 2, 32);
+            CHECK(ecc::decode(encoded, params, 1).value() == data);
+            CHECK(ecc::decode(encoded, params, 4).value() == data);
+        }
+    }
+
+    const ecc::Params params{};
+    const std::vector<u8> bytes = noise(10000, 33);
+    std::string encoded = ecc::encode(std::string(bytes.begin(), bytes.end()), params);
+    damageCodewords(encoded, params, params.parity / 2 + 1, 34);
+    CHECK_FALSE(ecc::decode(encoded, params).has_value());
+
+    CHECK_FALSE(ecc::validate({.blockSize = 10, .parity = 10}).has_value());
+    CHECK_FALSE(ecc::validate({.blockSize = 255, .parity = 1}).has_value());
+    CHECK_FALSE(ecc::decode("not a multiple of the block size", params).has_value());
+}
+
+TEST_CASE("Error corrected payloads survive flipped bits")
+{
+    const std::vector<u8> bytes = noise(3000, 35);
+    const std::string message(bytes.begin(), bytes.end());
+    std::vector<u8> pixels = noise(40000 * 3, 36);
+
+    Image img = makeImage(40000, 1, 3, pixels.data());
+
+    const payload::Options options{.bpp = 2, .codec = payload::Codec::Rle8, .ecc = ecc::Params{.parity = 16}};
+    const auto hidden = payload::hide(img, message, options);
+    REQUIRE(hidden.has_value());
+    CHECK(hidden->length == ecc::encodedSize(payload::encode(message, options.codec).size(), *options.ecc));
+
+    // A few flipped bits in the header and scattered over the payload
+    for (size_t i : {0, 5, 40, 1000, 5001, 9999, 20000}) {
+        pixels[i] ^= 1;
+    }
+    const auto header = payload::readHeader(img);
+    REQUIRE(header.has_value());
+    CHECK(header->ecc.value().parity == 16);
+    CHECK(header->ecc.value().blockSize == 255);
+    CHECK(payload::reveal(img, 4).value() == message);
+    std::ostringstream output;
+    CHECK(payload::revealStream(img, output).has_value());
+    CHECK(output.str() == message);
+
+    CHECK_FALSE(payload::hide(img, message, {.ecc = ecc::Params{.blockSize = 8, .parity = 8}}).has_value());
+    std::istringstream input(message);
+    CHECK_FALSE(payload::hideStream(img, input, {.ecc = ecc::Params{}}).has_value());
+}
+
+TEST_CASE("Matrix embedding changes at most one byte per block")
+{
+    for (size_t k : {1, 2, 3, 5, 8, 12}) {
+        for (ChannelMask mask : {channels::all, ChannelMask{0b101}}) {
+            CAPTURE(k);
+            CAPTURE(static_cast<int>(mask));
+            const std::vector<u8> original = noise(150000 * 3, 40);
+            std::vector<u8> pixels = original;
+            Image img = makeImage(150000, 1, 3, pixels.data());
+
+            const size_t length = std::min<size_t>(matrix::capacity(img, k, mask), 20000);
+            const std::vector<u8> bytes = noise(length, 41);
+            const std::string message(bytes.begin(), bytes.end());
+            const auto changed = matrix::hide(img, message, k, 4, mask);
+            REQUIRE(changed.has_value());
+
+            // Reference: the syndrome of each block is the XOR of the 1-based positions of its odd bytes
+            const size_t n = matrix::blockSize(k);
+            const ChannelMask selected = channels::normalize(mask, 3);
+            std::vector<u8> carrier, before;
+            for (size_t i = 0; i < pixels.size(); ++i) {
+                if ((selected >> (i % 3)) & 1) {
+                    carrier.push_back(pixels[i]);
+                    before.push_back(original[i]);
+                }
+            }
+            bool syndromesMatch = true;
+            bool oneChangePerBlock = true;
+            size_t differences = 0;
+            const size_t blocks = (length * 8 + k - 1) / k;
+            for (size_t b = 0; b < blocks; ++b) {
+                u32 syndrome = 0;
+                size_t blockChanges = 0;
+                for (size_t i = 0; i < n; ++i) {
+                    syndrome ^= (carrier[b * n + i] & 1) * static_cast<u32>(i + 1);
+                    blockChanges += carrier[b * n + i] != before[b * n + i];
+                }
+                u32 expected = 0;
+                for (size_t j = 0; j < k && (b * k + j) / 8 < length; ++j) {
+                    expected |= ((bytes[(b * k + j) / 8] >> ((b * k + j) % 8)) & 1) << j;
+                }
+                syndromesMatch &= syndrome == expected;
+                oneChangePerBlock &= blockChanges <= 1;
+                differences += blockChanges;
+            }
+            CHECK(syndromesMatch);
+            CHECK(oneChangePerBlock);
+            CHECK(differences == *changed);
+            CHECK(std::equal(carrier.begin() + blocks * n, carrier.end(), before.begin() + blocks * n));
+
+            CHECK(matrix::reveal(img, length, k, 1, mask).value() == message);
+            CHECK(matrix::reveal(img, length, k, 4, mask).value() == message);
+        }
+    }
+
+    std::vector<u8> pixels = noise(30000, 42);
+    Image img = makeImage(10000, 1, 3, pixels.data());
+    CHECK_FALSE(matrix::hide(img, std::string(matrix::capacity(img, 4) + 1, 'x'), 4).has_value());
+    CHECK_FALSE(matrix::hide(img, "k is too large", matrix::maxK + 1).has_value());
+
+    const payload::Options options{.codec = payload::Codec::Rle8, .matrix = 4};
+    REQUIRE(payload::hide(img, "A matrix embedded payload", options).has_value());
+    CHECK(payload::readHeader(img).value().matrix == 4);
+    CHECK(payload::reveal(img, 2).value() == "A matrix embedded payload");
+    CHECK_FALSE(payload::hide(img, "x", {.bpp = 2, .matrix = 4}).has_value());
+}
+
+TEST_CASE("LSB matching hides what reveal reads")
+{
+    for (ChannelMask mask : {channels::all, ChannelMask{0b0111}}) {
+        CAPTURE(static_cast<int>(mask));
+        const std::vector<u8> original = noise(100000 * 4, 50);
+        std::vector<u8> pixels = original;
+        Image img = makeImage(100000, 1, 4, pixels.data());
+
+        const std::vector<u8> bytes = noise(30000, 51);
+        const std::string message(bytes.begin(), bytes.end());
+        REQUIRE(matching::hide(img, message, 52, 4, mask).has_value());
+        CHECK(reveal(img, message.size(), 1, 1, mask).value() == message);
+
+        // The same signs whatever the number of threads
+        std::vector<u8> single = original;
+        img.data = single.data();
+        REQUIRE(matching::hide(img, message, 52, 1, mask).has_value());
+        CHECK(single == pixels);
+
+        const ChannelMask selected = channels::normalize(mask, 4);
+        bool changesAllowed = true;
+        for (size_t i = 0; i < pixels.size(); ++i) {
+            const int change = std::abs(pixels[i] - original[i]);
+            changesAllowed &= ((selected >> (i % 4)) & 1) ? change <= 1 : change == 0;
+        }
+        CHECK(changesAllowed);
+    }
+
+    const std::vector<u8> original = noise(20000, 53);
+    std::vector<u8> pixels = original;
+    Image img = makeImage(20000, 1, 1, pixels.data());
+    REQUIRE(payload::hide(img, "Matched, not replaced", {.matching = true}).has_value());
+    CHECK(payload::readHeader(img).value().matching);
+    CHECK(payload::reveal(img).value() == "Matched, not replaced");
+
+    // The signs follow the payload, so hiding it again gives the same image
+    std::vector<u8> again = original;
+    Image copy = makeImage(20000, 1, 1, again.data());
+    REQUIRE(payload::hide(copy, "Matched, not replaced", {.matching = true}).has_value());
+    CHECK(again == pixels);
+
+    // A key picks other signs, which only the same key gives again, and the payload reveals without it
+    std::vector<std::vector<u8>> keyedPixels;
+    for (const char* passphrase : {"first", "second", "first"}) {
+        keyedPixels.push_back(original);
+        Image keyedImg = makeImage(20000, 1, 1, keyedPixels.back().data());
+        const payload::Options options{.key = keyed::deriveKey(passphrase), .matching = true};
+        REQUIRE(payload::hide(keyedImg, "Matched, not replaced", options).has_value());
+        CHECK_FALSE(payload::readHeader(keyedImg).value().keyed);
+        CHECK(payload::reveal(keyedImg).value() == "Matched, not replaced");
+    }
+    CHECK(keyedPixels[0] != keyedPixels[1]);
+    CHECK(keyedPixels[0] != pixels);
+    CHECK(keyedPixels[0] == keyedPixels[2]);
+    CHECK_FALSE(payload::hide(img, "x", {.bpp = 2, .matching = true}).has_value());
+    CHECK_FALSE(matching::hide(img, std::string(20000 / 8 + 1, 'x'), 1).has_value());
+}
+
+TEST_CASE("Compiled watermarks match hiding the payload")
+{
+    const std::string message = "(c) Watermarked by the steganographer, aaaaaaaaaaaaaaaaaaaaaaaaaaaaaa";
+    const std::vector<payload::Options> optionSets = {
+        {},
+        {.bpp = 3, .channels = 0b0111},
+        {.bpp = 2, .codec = payload::Codec::Rle8, .threads = 4, .key = keyed::deriveKey("key")},
+        {.ecc = ecc::Params{.parity = 8}},
+    };
+    for (const payload::Options& options : optionSets) {
+        CAPTURE(options.bpp);
+        const auto plane = watermark::Plane::compile(message, 300, 200, 4, options);
+        REQUIRE(plane.has_value());
+        CHECK(plane->size() <= 300 * 200 * 4);
+
+        for (u32 seed : {60, 61}) {
+            std::vector<u8> expected = noise(300 * 200 * 4, seed);
+            std::vector<u8> pixels = expected;
+            Image img = makeImage(300, 200, 4, expected.data());
+            REQUIRE(payload::hide(img, message, options).has_value());
+
+            img.data = pixels.data();
+            REQUIRE(plane->apply(img, 4).has_value());
+            CHECK(pixels == expected);
+            CHECK(payload::reveal(img, 1, options.key).value() == message);
+        }
+    }
+
+    // Plain hiding only touches the start of the image
+    const auto plane = watermark::Plane::compile(message, 300, 200, 3);
+    CHECK(plane.value().size() < 1000);
+
+    std::vector<u8> pixels = noise(200 * 300 * 3, 62);
+    Image img = makeImage(200, 300, 3, pixels.data());
+    CHECK_FALSE(plane->matches(img));
+    CHECK_FALSE(plane->apply(img).has_value());
+    CHECK_FALSE(watermark::Plane::compile(message, 300, 200, 3, {.matching = true}).has_value());
+    CHECK_FALSE(watermark::Plane::compile(message, 10, 10, 3).has_value());
+}
+
+TEST_CASE("Parity shards recover any lost data shards")
+{
+    for (const auto [n, k] : {std::pair<size_t, size_t>{1, 1}, {4, 2}, {10, 4}, {200, 56}}) {
+        CAPTURE(n);
+        const size_t size = 1000;
+        std::vector<std::vector<u8>> shards;
+        std::vector<const u8*> data;
+        for (size_t d = 0; d < n; ++d) {
+            shards.push_back(noise(size, 90 + static_cast<u32>(d)));
+            data.push_back(shards.back().data());
+        }
+        for (size_t j = 0; j < k; ++j) {
+            const std::vector<u8> row = ecc::parityRow(j, n);
+            std::vector<u8> parity(size);
+            ecc::combineShards(data, row, size, parity.data());
+
+            std::vector<u8> expected(size, 0);
+            for (size_t d = 0; d < n; ++d) {
+                ecc::detail::mulAddScalar(expected.data(), data[d], size, row[d]);
+            }
+            CHECK(parity == expected);
+            shards.push_back(std::move(parity));
+        }
+
+        // Lose the first k shards, or every other one up to k
+        for (bool spread : {false, true}) {
+            std::vector<size_t> used;
+            std::vector<const u8*> sources;
+            for (size_t i = 0; i < n + k; ++i) {
+                if (spread ? i % 2 == 0 || i / 2 >= k : i >= k) {
+                    used.push_back(i);
+                }
+            }
+            used.resize(n);
+            for (size_t index : used) {
+                sources.push_back(shards[index].data());
+            }
+
+            const auto inverse = ecc::recoveryMatrix(used, n);
+            REQUIRE(inverse.has_value());
+            for (size_t d = 0; d < n; ++d) {
+                std::vector<u8> recovered(size);
+                ecc::combineShards(sources, (*inverse)[d], size, recovered.data());
+                CHECK(recovered == shards[d]);
+            }
+        }
+    }
+
+    const std::vector<size_t> repeated = {0, 0};
+    CHECK_FALSE(ecc::recoveryMatrix(repeated, 2).has_value());
+}
+
+TEST_CASE("Payload capacity is what hide fits")
+{
+    const std::vector<payload::Options> optionSets = {
+        {},
+        {.bpp = 3, .channels = 0b0111},
+        {.ecc = ecc::Params{.blockSize = 64, .parity = 8}},
+        {.matrix = 4},
+        {.encryption = "capacity"},
+        {.ecc = ecc::Params{.blockSize = 64, .parity = 8}, .encryption = "capacity"},
+    };
+    for (const payload::Options& options : optionSets) {
+        CAPTURE(options.bpp);
+        std::vector<u8> pixels = noise(90 * 70 * 4, 70);
+        Image img = makeImage(90, 70, 4, pixels.data());
+
+        const size_t capacity = payload::capacity(img.x, img.y, img.channels, options);
+        REQUIRE(capacity > 0);
+        CHECK(payload::hide(img, std::string(capacity, 'c'), options).has_value());
+        CHECK_FALSE(payload::hide(img, std::string(capacity + 1, 'c'), options).has_value());
+    }
+    CHECK(payload::capacity(4, 4, 4) == 0);
+}
+
+TEST_CASE("Sharded payloads reassemble from all their images")
+{
+    const std::vector<u8> bytes = noise(6000, 80);
+    const std::string message(bytes.begin(), bytes.end());
+    const std::vector<std::tuple<int, int, int>> layouts = {{100, 80, 4}, {60, 60, 3}, {200, 20, 1}, {90, 50, 4}};
+
+    const auto makeCarriers = [&](std::vector<std::vector<u8>>& buffers) {
+        std::vector<Image> carriers;
+        for (size_t i = 0; i < layouts.size(); ++i) {
+            const auto [x, y, channels] = layouts[i];
+            buffers.push_back(noise(static_cast<size_t>(x) * y * channels, 81 + static_cast<u32>(i)));
+            carriers.push_back(makeImage(x, y, channels, buffers.back().data()));
+        }
+        return carriers;
+    };
+
+    const std::vector<payload::Options> optionSets = {
+        {},
+        {.bpp = 2, .key = keyed::deriveKey("shards")},
+        {.ecc = ecc::Params{.parity = 16}},
+    };
+    for (const payload::Options& options : optionSets) {
+        CAPTURE(options.bpp);
+        std::vector<std::vector<u8>> buffers;
+        std::vector<Image> carriers = makeCarriers(buffers);
+        REQUIRE(shards::hide(carriers, message, options).has_value());
+        CHECK(shards::reveal(carriers, options.key).value() == message);
+
+        // Any order works, but every shard is needed and only once
+        std::swap(carriers[0], carriers[2]);
+        CHECK(shards::reveal(carriers, options.key).value() == message);
+        CHECK_FALSE(shards::reveal(std::span(carriers).first(3), options.key).has_value());
+        CHECK_FALSE(shards::reveal(std::vector<Image>{}, options.key).has_value());
+    }
+
+    std::vector<std::vector<u8>> buffers;
+    std::vector<Image> carriers = makeCarriers(buffers);
+    REQUIRE(shards::hide(carriers, "small").has_value());
+    CHECK(shards::reveal(carriers).value() == "small");
+    CHECK(shards::hide(carriers, "").has_value());
+    CHECK(shards::reveal(carriers).value().empty());
+    CHECK_FALSE(shards::hide(carriers, std::string(200000, 'x')).has_value());
+
+    // One image holds only part of the message, so it is not revealed on its own
+    REQUIRE(shards::hide(carriers, message).has_value());
+    const auto alone = payload::reveal(carriers[1]);
+    REQUIRE_FALSE(alone.has_value());
+    CHECK(alone.error() == "The image holds shard 1 of 4, pass all images");
+    CHECK_FALSE(payload::revealImage(carriers[1]).has_value());
+    std::ostringstream output;
+    CHECK_FALSE(payload::revealStream(carriers[1], output).has_value());
+    CHECK(output.str().empty());
+
+    // Shards of two different messages do not mix
+    std::vector<std::vector<u8>> otherBuffers;
+    std::vector<Image> others = makeCarriers(otherBuffers);
+    REQUIRE(shards::hide(carriers, message).has_value());
+    REQUIRE(shards::hide(others, message).has_value());
+    std::swap(carriers[1], others[1]);
+    CHECK_FALSE(shards::reveal(carriers).has_value());
+}
+
+TEST_CASE("Sharded payloads with parity survive losing images")
+{
+    const std::vector<u8> bytes = noise(3001, 100);
+    const std::string message(bytes.begin(), bytes.end());
+    constexpr size_t count = 6;
+    constexpr size_t parity = 3;
+
+    std::vector<std::vector<u8>> buffers;
+    std::vector<Image> carriers;
+    for (size_t i = 0; i < count + parity; ++i) {
+        buffers.push_back(noise(80 * 60 * 3, 101 + static_cast<u32>(i)));
+        carriers.push_back(makeImage(80, 60, 3, buffers.back().data()));
+    }
+    for (const std::string& hidden : {message, std::string("tiny"), std::string()}) {
+        CAPTURE(hidden.size());
+        REQUIRE(shards::hide(carriers, hidden, {}, parity).has_value());
+        CHECK(shards::reveal(carriers).value() == hidden);
+
+        // Every choice of images to lose up to the number of parity images
+        for (u32 lost = 0; lost < (1u << (count + parity)); ++lost) {
+            std::vector<Image> left;
+            for (size_t i = 0; i < count + parity; ++i) {
+                if (!((lost >> i) & 1)) {
+                    Image img = makeImage(carriers[i].x, carriers[i].y, carriers[i].channels, carriers[i].data);
+                    left.push_back(std::move(img));
+                }
+            }
+            const auto revealed = shards::reveal(left);
+            CHECK(revealed.has_value() == (std::popcount(lost) <= static_cast<int>(parity)));
+            if (revealed) {
+                CHECK(*revealed == hidden);
+            }
+        }
+    }
+
+    // Images whose payload header is destroyed are left out like missing ones
+    REQUIRE(shards::hide(carriers, message, {}, parity).has_value());
+    std::fill_n(carriers[1].data, 256, u8{0});
+    std::fill_n(carriers[4].data, 256, u8{0});
+    CHECK(shards::reveal(carriers).value() == message);
+    std::fill_n(carriers[7].data, 256, u8{0});
+    std::fill_n(carriers[8].data, 256, u8{0});
+    CHECK_FALSE(shards::reveal(carriers).has_value());
+
+    CHECK_FALSE(shards::hide(carriers, message, {}, count + parity).has_value());
+    CHECK_FALSE(shards::hide(carriers, std::string(20000, 'x'), {}, parity).has_value());
+}
+
+TEST_CASE("Sharded payloads apply their codec once")
+{
+    std::vector<std::vector<u8>> buffers;
+    std::vector<Image> carriers;
+    for (const auto [x, y, channels] : {std::tuple(70, 50, 4), std::tuple(60, 40, 3), std::tuple(50, 50, 3)}) {
+        buffers.push_back(noise(static_cast<size_t>(x) * y * channels, 120 + static_cast<u32>(buffers.size())));
+        carriers.push_back(makeImage(x, y, channels, buffers.back().data()));
+    }
+    std::vector<size_t> capacities;
+    for (const Image& carrier : carriers) {
+        capacities.push_back(payload::capacity(carrier.x, carrier.y, carrier.channels) - shards::headerSize);
+    }
+    const std::vector<u8> bytes = noise(capacities[0] + capacities[1] + capacities[2], 123);
+
+    for (auto codec : {payload::Codec::Rle8, payload::Codec::Packed}) {
+        for (size_t parity : {0, 1}) {
+            CAPTURE(static_cast<int>(codec));
+            CAPTURE(parity);
+            // Incompressible input as long as fits once encoded, which the codec would overflow if it were applied
+            // to every shard again
+            const size_t room = parity ? *std::min_element(capacities.begin(), capacities.end()) * (3 - parity)
+                                       : capacities[0] + capacities[1] + capacities[2];
+            size_t size = room;
+            const auto encodedSize = [&] {
+                return payload::encode(std::string_view(reinterpret_cast<const char*>(bytes.data()), size), codec)
+                    .size();
+            };
+            for (size_t encoded = encodedSize(); encoded > room; encoded = encodedSize()) {
+                size -= std::max<size_t>(1, (encoded - room) / 2);
+            }
+            const std::string message(bytes.begin(), bytes.begin() + static_cast<ptrdiff_t>(size));
+
+            REQUIRE(shards::hide(carriers, message, {.codec = codec}, parity).has_value());
+            CHECK(payload::readHeader(carriers[0]).value().codec == payload::Codec::None);
+            CHECK(shards::reveal(carriers).value() == message);
+            if (parity) {
+                CHECK(shards::reveal(std::span(carriers).last(2)).value() == message);
+            }
+        }
+    }
+}
+
+TEST_CASE("Encrypted sharded payloads fill their images")
+{
+    const payload::Options options{.encryption = "shards"};
+    std::vector<std::vector<u8>> buffers;
+    std::vector<Image> carriers;
+    for (const auto [x, y, channels] : {std::tuple(70, 50, 4), std::tuple(60, 40, 3)}) {
+        buffers.push_back(noise(static_cast<size_t>(x) * y * channels, 105 + static_cast<u32>(buffers.size())));
+        carriers.push_back(makeImage(x, y, channels, buffers.back().data()));
+    }
+    std::vector<size_t> capacities;
+    for (const Image& carrier : carriers) {
+        capacities.push_back(payload::capacity(carrier.x, carrier.y, carrier.channels, options) - shards::headerSize);
+    }
+
+    // Split in proportion, every image full
+    const std::vector<u8> bytes = noise(capacities[0] + capacities[1] + 1, 107);
+    const std::string full(bytes.begin(), bytes.end() - 1);
+    REQUIRE(shards::hide(carriers, full, options).has_value());
+    CHECK(shards::reveal(carriers, {}, "shards").value() == full);
+    CHECK_FALSE(shards::hide(carriers, std::string(bytes.begin(), bytes.end()), options).has_value());
+
+    // With one parity image, each image holds the whole message
+    const std::string half(bytes.begin(), bytes.begin() + static_cast<ptrdiff_t>(capacities[1]));
+    REQUIRE(shards::hide(carriers, half, options, 1).has_value());
+    CHECK(shards::reveal(std::span(carriers).first(1), {}, "shards").value() == half);
+    CHECK_FALSE(shards::hide(carriers, half + "x", options, 1).has_value());
+}
+
+TEST_CASE("ChaCha20 matches RFC 8439 and all its kernels agree")
+{
+    cipher::Key key;
+    for (size_t i = 0; i < key.size(); ++i) {
+        key[i] = static_cast<u8>(i);
+    }
+    const cipher::Nonce nonce = {0, 0, 0, 0, 0, 0, 0, 0x4A, 0, 0, 0, 0};
+    std::string text = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the future, "
+                       "sunscreen would be it.";
+    const std::vector<u8> expected = {
+        0x6E, 0x2E, 0x35, 0x9A, 0x25, 0x68, 0xF9, 0x80, 0x41, 0xBA, 0x07, 0x28, 0xDD, 0x0D, 0x69, 0x81, 0xE9, 0x7E, 0x7A,
+        0xEC, 0x1D, 0x43, 0x60, 0xC2, 0x0A, 0x27, 0xAF, 0xCC, 0xFD, 0x9F, 0xAE, 0x0B, 0xF9, 0x1B, 0x65, 0xC5, 0x52, 0x47,
+        0x33, 0xAB, 0x8F, 0x59, 0x3D, 0xAB, 0xCD, 0x62, 0xB3, 0x57, 0x16, 0x39, 0xD6, 0x24, 0xE6, 0x51, 0x52, 0xAB, 0x8F,
+        0x53, 0x0C, 0x35, 0x9F, 0x08, 0x61, 0xD8, 0x07, 0xCA, 0x0D, 0xBF, 0x50, 0x0D, 0x6A, 0x61, 0x56, 0xA3, 0x8E, 0x08,
+        0x8A, 0x22, 0xB6, 0x5E, 0x52, 0xBC, 0x51, 0x4D, 0x16, 0xCC, 0xF8, 0x06, 0x81, 0x8C, 0xE9, 0x1A, 0xB7, 0x79, 0x37,
+        0x36, 0x5A, 0xF9, 0x0B, 0xBF, 0x74, 0xA3, 0x5B, 0xE6, 0xB4, 0x0B, 0x8E, 0xED, 0xF2, 0x78, 0x5E, 0x42, 0x87, 0x4D,
+    };
+    cipher::apply(key, nonce, 1, reinterpret_cast<u8*>(text.data()), text.size());
+    CHECK(std::vector<u8>(text.begin(), text.end()) == expected);
+
+    // The SIMD kernels and splitting over threads give the same stream as the scalar one
+    const std::vector<u8> bytes = noise((3 << 20) + 77, 110);
+    const auto state = cipher::detail::initialState(key, nonce, 7);
+    std::vector<u8> reference = bytes;
+    cipher::detail::xorScalar(state, reference.data(), reference.size());
+
+    std::vector<u8> dispatched = bytes;
+    cipher::apply(key, nonce, 7, dispatched.data(), dispatched.size(), 4);
+    CHECK(dispatched == reference);
+#ifdef STEG_X86
+    for (size_t size : {0, 100, 64 * 8, 64 * 8 + 5, 64 * 20}) {
+        CAPTURE(size);
+        std::vector<u8> sse2 = bytes;
+        auto sse2State = state;
+        const size_t sse2Done = cipher::detail::xorSse2(sse2State, sse2.data(), size);
+        cipher::detail::xorScalar(sse2State, sse2.data() + sse2Done, size - sse2Done);
+        CHECK(std::equal(sse2.begin(), sse2.begin() + size, reference.begin()));
+
+        if (cpu::features().avx2) {
+            std::vector<u8> avx2 = bytes;
+            auto avx2State = state;
+            const size_t avx2Done = cipher::detail::xorAvx2(avx2State, avx2.data(), size);
+            cipher::detail::xorScalar(avx2State, avx2.data() + avx2Done, size - avx2Done);
+            CHECK(std::equal(avx2.begin(), avx2.begin() + size, reference.begin()));
+        }
+    }
+#endif
+}
+
+TEST_CASE("ChaCha20-Poly1305 and PBKDF2 match their RFCs")
+{
+    // RFC 8439 2.5.2
+    const std::array<u8, 32> macKey = {
+        0x85, 0xD6, 0xBE, 0x78, 0x57, 0x55, 0x6D, 0x33, 0x7F, 0x44, 0x52, 0xFE, 0x42, 0xD5, 0x06, 0xA8,
+        0x01, 0x03, 0x80, 0x8A, 0xFB, 0x0D, 0xB2, 0xFD, 0x4A, 0xBF, 0xF6, 0xAF, 0x41, 0x49, 0xF5, 0x1B,
+    };
+    const std::string forum = "Cryptographic Forum Research Group";
+    cipher::detail::Poly1305 mac(macKey.data());
+    mac.update(reinterpret_cast<const u8*>(forum.data()), 10);
+    mac.update(reinterpret_cast<const u8*>(forum.data()) + 10, forum.size() - 10);
+    const cipher::Tag forumTag = {0xA8, 0x06, 0x1D, 0xC1, 0x30, 0x51, 0x36, 0xC6,
+                                  0xC2, 0x2B, 0x8B, 0xAF, 0x0C, 0x01, 0x27, 0xA9};
+    CHECK(mac.finish() == forumTag);
+
+    // RFC 8439 2.8.2
+    cipher::Key key;
+    for (size_t i = 0; i < key.size(); ++i) {
+        key[i] = static_cast<u8>(0x80 + i);
+    }
+    const cipher::Nonce nonce = {0x07, 0, 0, 0, 0x40, 0x41, 0x42, 0x43, 0x44, 0x45, 0x46, 0x47};
+    const std::array<u8, 12> aad = {0x50, 0x51, 0x52, 0x53, 0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7};
+    const std::string plaintext = "Ladies and Gentlemen of the class of '99: If I could offer you only one tip for the "
+                                  "future, sunscreen would be it.";
+    std::string text = plaintext;
+    u8* data = reinterpret_cast<u8*>(text.data());
+    const cipher::Tag tag = cipher::seal(key, nonce, aad, data, text.size());
+    const std::vector<u8> start = {0xD3, 0x1A, 0x8D, 0x34, 0x64, 0x8E, 0x60, 0xDB,
+                                   0x7B, 0x86, 0xAF, 0xBC, 0x53, 0xEF, 0x7E, 0xC2};
+    CHECK(std::vector<u8>(data, data + start.size()) == start);
+    const cipher::Tag expectedTag = {0x1A, 0xE1, 0x0B, 0x59, 0x4F, 0x09, 0xE2, 0x6A,
+                                     0x7E, 0x90, 0x2E, 0xCB, 0xD0, 0x60, 0x06, 0x91};
+    CHECK(tag == expectedTag);
+
+    // A changed ciphertext or tag is left alone
+    data[40] ^= 1;
+    CHECK_FALSE(cipher::open(key, nonce, aad, data, text.size(), tag));
+    data[40] ^= 1;
+    cipher::Tag badTag = tag;
+    badTag[15] ^= 0x80;
+    CHECK_FALSE(cipher::open(key, nonce, aad, data, text.size(), badTag));
+    REQUIRE(cipher::open(key, nonce, aad, data, text.size(), tag));
+    CHECK(text == plaintext);
+
+    // RFC 7914 11, and the common 4096 round vector
+    const std::string salt = "salt";
+    const std::span<const u8> saltBytes(reinterpret_cast<const u8*>(salt.data()), salt.size());
+    const cipher::Key once = {0x55, 0xAC, 0x04, 0x6E, 0x56, 0xE3, 0x08, 0x9F, 0xEC, 0x16, 0x91,
+                              0xC2, 0x25, 0x44, 0xB6, 0x05, 0xF9, 0x41, 0x85, 0x21, 0x6D, 0xDE,
+                              0x04, 0x65, 0xE6, 0x8B, 0x9D, 0x57, 0xC2, 0x0D, 0xAC, 0xBC};
+    CHECK(cipher::deriveKey("passwd", saltBytes, 1) == once);
+    const cipher::Key stretched = {0xC5, 0xE4, 0x78, 0xD5, 0x92, 0x88, 0xC8, 0x41, 0xAA, 0x53, 0x0D,
+                                   0xB6, 0x84, 0x5C, 0x4C, 0x8D, 0x96, 0x28, 0x93, 0xA0, 0x01, 0xCE,
+                                   0x4E, 0x11, 0xA4, 0x96, 0x38, 0x73, 0xAA, 0x98, 0x13, 0x4A};
+    CHECK(cipher::deriveKey("password", saltBytes, 4096) == stretched);
+    // Passphrases longer than a block are hashed first
+    CHECK(cipher::deriveKey(std::string(100, 'p'), saltBytes, 2) !=
+          cipher::deriveKey(std::string(99, 'p'), saltBytes, 2));
+
+    // The same passphrase encrypts differently every time and only decrypts with itself
+    const std::string first = cipher::encrypt(plaintext, "passphrase");
+    CHECK(first.size() == plaintext.size() + cipher::overhead);
+    CHECK(first != cipher::encrypt(plaintext, "passphrase"));
+    CHECK(cipher::decrypt(first, "passphrase").value() == plaintext);
+    CHECK_FALSE(cipher::decrypt(first, "passphrasf").has_value());
+    CHECK_FALSE(cipher::decrypt(first.substr(0, cipher::overhead - 1), "passphrase").has_value());
+}
+
+TEST_CASE("Encrypted payloads need their passphrase")
+{
+    const std::string message = "Meet me at the old oak tree at midnight, bring the documents. aaaaaaaaaaaaaaaaaaaa";
+    std::vector<u8> pixels = noise(120 * 90 * 4, 111);
+    Image img = makeImage(120, 90, 4, pixels.data());
+
+    const std::string passphrase = "correct horse";
+    const std::vector<payload::Options> optionSets = {
+        {.encryption = passphrase},
+        {.codec = payload::Codec::Rle8, .threads = 4, .key = keyed::deriveKey("order"), .encryption = passphrase},
+        {.ecc = ecc::Params{.parity = 8}, .encryption = passphrase},
+    };
+    for (const payload::Options& options : optionSets) {
+        REQUIRE(payload::hide(img, message, options).has_value());
+        CHECK(payload::readHeader(img).value().encrypted);
+        CHECK(payload::reveal(img, 1, options.key, passphrase).value() == message);
+        CHECK_FALSE(payload::reveal(img, 1, options.key).has_value());
+        CHECK_FALSE(payload::reveal(img, 1, options.key, "battery staple").has_value());
+
+        std::ostringstream output;
+        CHECK(payload::revealStream(img, output, 1, options.key, passphrase).has_value());
+        CHECK(output.str() == message);
+    }
+
+    // A changed ciphertext with a CRC to match is caught by its tag
+    REQUIRE(payload::hide(img, message, {.encryption = passphrase}).has_value());
+    pixels[payload::detail::headerPixels(4) * 4 + 300] ^= 1;
+    payload::Header header = payload::readHeader(img).value();
+    std::string ciphertext(header.length, 0);
+    const auto body = payload::detail::region(img, false);
+    REQUIRE(::reveal(*body, header.length, std::span(reinterpret_cast<u8*>(ciphertext.data()), ciphertext.size()),
+                     header.bpp, 1, header.channels)
+                .has_value());
+    header.crc = checksum::crc32c(ciphertext, 1);
+    REQUIRE(payload::detail::writeHeader(img, header).has_value());
+    const auto tampered = payload::reveal(img, 1, {}, passphrase);
+    REQUIRE_FALSE(tampered.has_value());
+    CHECK(tampered.error().find("was changed") != std::string::npos);
+
+    // The message does not show in the carrier
+    REQUIRE(payload::hide(img, std::string(1000, 'a'), {.encryption = passphrase}).has_value());
+    const auto raw = revealRange(img, 0, 1000, 1);
+    CHECK(raw.value().find("aaaaaaaa") == std::string::npos);
+
+    std::istringstream input(message);
+    CHECK_FALSE(payload::hideStream(img, input, {.encryption = passphrase}).has_value());
+    CHECK_FALSE(watermark::Plane::compile(message, 120, 90, 4, {.encryption = passphrase}).has_value());
 }